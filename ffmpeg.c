@@ -39,8 +39,13 @@
 #include "libavcodec/colorspace.h"
 #include "libavutil/fifo.h"
 #include "libavutil/avstring.h"
+#include "libavutil/perf.h"
 #include "libavformat/os_support.h"
 
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #if HAVE_SYS_RESOURCE_H
 #include <sys/types.h>
 #include <sys/resource.h>
@@ -201,6 +206,15 @@ static int exit_on_error = 0;
 static int using_stdin = 0;
 static int verbose = 1;
 static int thread_count= 1;
+static int use_pipeline = 0;
+static int64_t abr_gop_duration = 0;
+static int show_stage_stats = 0;
+static int do_perf = 0;
+static int do_stage_stats = 0;
+static char *stage_stats_filename;
+static FILE *stage_stats_file;
+static float stage_stats_period = 0;
+static int64_t last_stage_stats_time;
 static int q_pressed = 0;
 static int64_t video_size = 0;
 static int64_t audio_size = 0;
@@ -231,7 +245,33 @@ static AVBitStreamFilterContext *bitstream_filters[MAX_FILES][MAX_STREAMS];
 
 #define DEFAULT_PASS_LOGFILENAME_PREFIX "ffmpeg2pass"
 
+/* stages of the transcoding timed with -stage_stats */
+enum TranscodeStage {
+    STAGE_DEMUX,
+    STAGE_DECODE,
+    STAGE_PREPROCESS,
+    STAGE_SCALE,
+    STAGE_ENCODE,
+    STAGE_BSF,
+    STAGE_MUX_WAIT,         /* waiting for the muxer used by another thread */
+    STAGE_MUX,              /* interleaving and writing, including I/O */
+    STAGE_QUEUE_WAIT,       /* waiting for a -pipeline queue */
+    NB_STAGES
+};
+
+static const char *stage_names[NB_STAGES] = {
+    "demux", "decode", "preprocess", "scale", "encode",
+    "bsf", "mux_wait", "mux", "queue_wait",
+};
+
+typedef struct StageStats {
+    int64_t wall[NB_STAGES]; /* microseconds */
+    int64_t cpu[NB_STAGES];  /* microseconds of the thread running the stage */
+    int64_t count[NB_STAGES];
+} StageStats;
+
 struct AVInputStream;
+struct SharedFrame;
 
 typedef struct AVOutputStream {
     int file_index;          /* file index */
@@ -284,6 +324,12 @@ typedef struct AVOutputStream {
     AVAudioConvert *reformat_ctx;
     AVFifoBuffer *fifo;     /* for compression: one audio fifo per codec */
     FILE *logfile;
+
+    struct EncoderThread *encoder; /* encodes on its own thread with -pipeline */
+    int gop_started;         /* a keyframe was forced with -abr */
+    int64_t gop_index;       /* -abr GOP of the last encoded frame */
+
+    StageStats stats;
 } AVOutputStream;
 
 typedef struct AVInputStream {
@@ -299,6 +345,9 @@ typedef struct AVInputStream {
                                 is not defined */
     int64_t       pts;       /* current pts */
     int is_start;            /* is 1 at the start and after a discontinuity */
+    int repeat_pict;         /* parser repeat_pict of the last packet read */
+
+    StageStats stats;
 } AVInputStream;
 
 typedef struct AVInputFile {
@@ -308,6 +357,233 @@ typedef struct AVInputFile {
     int nb_streams;       /* nb streams we are aware of */
 } AVInputFile;
 
+static int64_t getutime(void)
+{
+#if HAVE_GETRUSAGE
+    struct rusage rusage;
+
+    getrusage(RUSAGE_SELF, &rusage);
+    return (rusage.ru_utime.tv_sec * 1000000LL) + rusage.ru_utime.tv_usec;
+#elif HAVE_GETPROCESSTIMES
+    HANDLE proc;
+    FILETIME c, e, k, u;
+    proc = GetCurrentProcess();
+    GetProcessTimes(proc, &c, &e, &k, &u);
+    return ((int64_t) u.dwHighDateTime << 32 | u.dwLowDateTime) / 10;
+#else
+    return av_gettime();
+#endif
+}
+
+/* CPU time of the calling thread */
+static int64_t getcputime(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+    return getutime();
+}
+
+typedef struct StageTimer {
+    int64_t wall;
+    int64_t cpu;
+} StageTimer;
+
+static StageStats input_file_stats[MAX_FILES]; /* demuxing of each input file */
+
+static void stage_start(StageTimer *t)
+{
+    t->wall = do_stage_stats ? av_gettime() : 0;
+    t->cpu  = do_stage_stats ? getcputime() : 0;
+}
+
+static void stage_stop(StageStats *stats, enum TranscodeStage stage,
+                       StageTimer *t, int count)
+{
+    if (!do_stage_stats)
+        return;
+    stats->wall[stage]  += av_gettime() - t->wall;
+    stats->cpu[stage]   += getcputime() - t->cpu;
+    stats->count[stage] += count;
+}
+
+#if HAVE_PTHREADS
+/* With -pipeline each input file is demuxed on its own thread and each
+   audio and video encoder runs on its own thread, fed through bounded
+   queues. Decoding and all A/V sync decisions stay on the main thread, so
+   the same frames reach the encoders as without -pipeline; the muxers are
+   shared and serialized by mux_mutex. av_read_frame() updates the codec
+   contexts the decoders use, so each input file has a lock held around
+   demuxing and around decoding its streams. */
+
+#define PIPELINE_PACKETS 64 ///< demuxed packets queued per input file
+#define PIPELINE_FRAMES   8 ///< raw frames queued per encoder
+
+typedef struct ThreadQueue {
+    AVFifoBuffer *fifo;
+    int elem_size;
+    int max_size;         ///< bytes queued before senders block
+    int finished;         ///< nothing more is sent, receivers drain the queue
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ThreadQueue;
+
+/* demuxed packet with the parser state the main thread needs, the parser
+   itself runs ahead on the demuxing thread */
+typedef struct InputPacket {
+    AVPacket pkt;
+    int repeat_pict;
+} InputPacket;
+
+typedef struct InputThread {
+    pthread_t thread;
+    ThreadQueue packets;  ///< InputPacket
+    AVFormatContext *ic;
+    pthread_mutex_t codec_mutex; ///< serializes av_read_frame() with decoding
+    int ret;              ///< av_read_frame() error that ended the thread
+} InputThread;
+
+/* decoded picture shared by the video encoding threads */
+typedef struct SharedFrame {
+    AVFrame frame;        ///< data points into buf
+    uint8_t *buf;
+    int buf_size;
+    int width, height;
+    enum PixelFormat pix_fmt;
+    int refcount;
+    struct SharedFrame *next; ///< next unused frame
+} SharedFrame;
+
+typedef struct EncodeJob {
+    uint8_t *buf;         ///< pooled sample buffer
+    SharedFrame *picture; ///< picture to convert and encode
+    struct AVInputStream *ist;
+    int nb_frames;        ///< times the picture is encoded
+    int flush;            ///< encode what is left in the audio fifo and drain the encoder
+    int frame_number;     ///< output frame number and pts of the first frame
+    int64_t sync_opts;
+} EncodeJob;
+
+typedef struct EncoderThread {
+    pthread_t thread;
+    ThreadQueue jobs;     ///< EncodeJob
+    ThreadQueue buffers;  ///< free sample buffers
+    int buf_size;
+    uint8_t *out;         ///< encoded frame
+    int out_size;
+    AVFormatContext *os;
+    AVOutputStream *ost;
+} EncoderThread;
+
+static InputThread *input_threads;
+static pthread_mutex_t mux_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SharedFrame *unused_frames;
+static pthread_mutex_t frame_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int tq_init(ThreadQueue *q, int elem_size, int nb_elems)
+{
+    q->fifo = av_fifo_alloc(elem_size * nb_elems);
+    if (!q->fifo)
+        return AVERROR(ENOMEM);
+    q->elem_size = elem_size;
+    q->max_size  = elem_size * nb_elems;
+    q->finished  = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    return 0;
+}
+
+static void tq_free(ThreadQueue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+    av_fifo_free(q->fifo);
+    q->fifo = NULL;
+}
+
+/* blocks while the queue is full, fails once it is finished */
+static int tq_send(ThreadQueue *q, void *elem)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->finished && av_fifo_size(q->fifo) >= q->max_size)
+        pthread_cond_wait(&q->cond, &q->lock);
+    if (q->finished) {
+        ret = -1;
+    } else {
+        av_fifo_generic_write(q->fifo, elem, q->elem_size, NULL);
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/* blocks while the queue is empty, fails once it is finished and empty */
+static int tq_recv(ThreadQueue *q, void *elem)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->finished && !av_fifo_size(q->fifo))
+        pthread_cond_wait(&q->cond, &q->lock);
+    if (av_fifo_size(q->fifo)) {
+        av_fifo_generic_read(q->fifo, elem, q->elem_size, NULL);
+        pthread_cond_broadcast(&q->cond);
+    } else
+        ret = -1;
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+static void tq_finish(ThreadQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->finished = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* number of queued elements */
+static int tq_depth(ThreadQueue *q)
+{
+    int depth;
+
+    pthread_mutex_lock(&q->lock);
+    depth = av_fifo_size(q->fifo) / q->elem_size;
+    pthread_mutex_unlock(&q->lock);
+    return depth;
+}
+
+static int tq_finished(ThreadQueue *q)
+{
+    int finished;
+
+    pthread_mutex_lock(&q->lock);
+    finished = q->finished;
+    pthread_mutex_unlock(&q->lock);
+    return finished;
+}
+
+static void mux_lock(void)
+{
+    if (use_pipeline)
+        pthread_mutex_lock(&mux_mutex);
+}
+
+static void mux_unlock(void)
+{
+    if (use_pipeline)
+        pthread_mutex_unlock(&mux_mutex);
+}
+#else
+#define mux_lock()
+#define mux_unlock()
+#endif
+
 #if HAVE_TERMIOS_H
 
 /* init terminal so that we can grab keys */
@@ -518,9 +794,17 @@ get_sync_ipts(const AVOutputStream *ost)
     return (double)(ist->pts - start_time)/AV_TIME_BASE;
 }
 
-static void write_frame(AVFormatContext *s, AVPacket *pkt, AVCodecContext *avctx, AVBitStreamFilterContext *bsfc){
+static void write_frame(AVFormatContext *s, AVPacket *pkt, AVOutputStream *ost){
+    AVCodecContext *avctx= ost->st->codec;
+    AVBitStreamFilterContext *bsfc= bitstream_filters[ost->file_index][pkt->stream_index];
+    StageTimer t;
     int ret;
 
+    stage_start(&t);
+    mux_lock();
+    stage_stop(&ost->stats, STAGE_MUX_WAIT, &t, 1);
+
+    stage_start(&t);
     while(bsfc){
         AVPacket new_pkt= *pkt;
         int a= av_bitstream_filter_filter(bsfc, avctx, NULL,
@@ -542,14 +826,219 @@ static void write_frame(AVFormatContext *s, AVPacket *pkt, AVCodecContext *avctx
 
         bsfc= bsfc->next;
     }
+    stage_stop(&ost->stats, STAGE_BSF, &t, !!bitstream_filters[ost->file_index][pkt->stream_index]);
 
+    stage_start(&t);
     ret= av_interleaved_write_frame(s, pkt);
     if(ret < 0){
         print_error("av_interleaved_write_frame()", ret);
         av_exit(1);
     }
+    stage_stop(&ost->stats, STAGE_MUX, &t, 1);
+    mux_unlock();
+}
+
+static void encode_audio_frame(AVFormatContext *s, AVOutputStream *ost,
+                               uint8_t *out, int out_size, short *samples)
+{
+    AVCodecContext *enc= ost->st->codec;
+    AVPacket pkt;
+    StageTimer t;
+    int ret;
+
+    av_init_packet(&pkt);
+
+    //FIXME pass ost->sync_opts as AVFrame.pts in avcodec_encode_audio()
+    stage_start(&t);
+    ret = avcodec_encode_audio(enc, out, out_size, samples);
+    stage_stop(&ost->stats, STAGE_ENCODE, &t, 1);
+    if (ret < 0) {
+        fprintf(stderr, "Audio encoding failed\n");
+        av_exit(1);
+    }
+    mux_lock();
+    audio_size += ret;
+    mux_unlock();
+    pkt.stream_index= ost->index;
+    pkt.data= out;
+    pkt.size= ret;
+    if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
+        pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
+    pkt.flags |= PKT_FLAG_KEY;
+    write_frame(s, &pkt, ost);
+}
+
+static int encode_video_frame(AVFormatContext *s, AVOutputStream *ost,
+                              uint8_t *out, int out_size, AVFrame *picture)
+{
+    AVCodecContext *enc= ost->st->codec;
+    AVPacket pkt;
+    StageTimer t;
+    int ret;
+
+    av_init_packet(&pkt);
+    pkt.stream_index= ost->index;
+
+    stage_start(&t);
+    ret = avcodec_encode_video(enc, out, out_size, picture);
+    stage_stop(&ost->stats, STAGE_ENCODE, &t, 1);
+    if (ret < 0) {
+        fprintf(stderr, "Video encoding failed\n");
+        av_exit(1);
+    }
+
+    if(ret>0){
+        pkt.data= out;
+        pkt.size= ret;
+        if(enc->coded_frame->pts != AV_NOPTS_VALUE)
+            pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
+/*av_log(NULL, AV_LOG_DEBUG, "encoder -> %"PRId64"/%"PRId64"\n",
+   pkt.pts != AV_NOPTS_VALUE ? av_rescale(pkt.pts, enc->time_base.den, AV_TIME_BASE*(int64_t)enc->time_base.num) : -1,
+   pkt.dts != AV_NOPTS_VALUE ? av_rescale(pkt.dts, enc->time_base.den, AV_TIME_BASE*(int64_t)enc->time_base.num) : -1);*/
+
+        if(enc->coded_frame->key_frame)
+            pkt.flags |= PKT_FLAG_KEY;
+        write_frame(s, &pkt, ost);
+        mux_lock();
+        video_size += ret;
+        mux_unlock();
+        //fprintf(stderr,"\nFrame: %3d size: %5d type: %d",
+        //        enc->frame_number-1, ret, enc->pict_type);
+        /* if two pass, output log */
+        if (ost->logfile && enc->stats_out) {
+            fprintf(ost->logfile, "%s", enc->stats_out);
+        }
+    }
+    return ret;
+}
+
+#if HAVE_PTHREADS
+/* the time the main thread is blocked by a busy encoder counts as
+   queue_wait of its output stream */
+static uint8_t *encoder_get_buffer(EncoderThread *et)
+{
+    StageTimer t;
+    uint8_t *buf;
+
+    stage_start(&t);
+    tq_recv(&et->buffers, &buf);
+    stage_stop(&et->ost->stats, STAGE_QUEUE_WAIT, &t, 0);
+    return buf;
+}
+
+static void encoder_send(EncoderThread *et, EncodeJob *job)
+{
+    StageTimer t;
+
+    stage_start(&t);
+    tq_send(&et->jobs, job);
+    stage_stop(&et->ost->stats, STAGE_QUEUE_WAIT, &t, 1);
+}
+
+static void encoder_submit_samples(EncoderThread *et, AVFifoBuffer *fifo, int size)
+{
+    EncodeJob job;
+
+    memset(&job, 0, sizeof(job));
+    job.buf = encoder_get_buffer(et);
+    av_fifo_generic_read(fifo, job.buf, size, NULL);
+    encoder_send(et, &job);
 }
 
+static SharedFrame *shared_frame_new(const AVFrame *picture, int width, int height,
+                                     enum PixelFormat pix_fmt)
+{
+    SharedFrame *sf, **p;
+    int size = avpicture_get_size(pix_fmt, width, height);
+
+    pthread_mutex_lock(&frame_mutex);
+    for (p = &unused_frames; *p && (*p)->buf_size != size; p = &(*p)->next);
+    sf = *p;
+    if (sf)
+        *p = sf->next;
+    pthread_mutex_unlock(&frame_mutex);
+
+    if (!sf) {
+        sf = av_mallocz(sizeof(SharedFrame));
+        if (sf)
+            sf->buf = av_malloc(size);
+        if (!sf || !sf->buf) {
+            fprintf(stderr, "Out of memory in shared_frame_new\n");
+            av_exit(1);
+        }
+        sf->buf_size = size;
+    }
+    avcodec_get_frame_defaults(&sf->frame);
+    avpicture_fill((AVPicture *)&sf->frame, sf->buf, pix_fmt, width, height);
+    av_picture_copy((AVPicture *)&sf->frame, (const AVPicture *)picture,
+                    pix_fmt, width, height);
+    sf->frame.interlaced_frame = picture->interlaced_frame;
+    sf->frame.top_field_first  = picture->top_field_first;
+    sf->frame.quality          = picture->quality;
+    sf->frame.pict_type        = picture->pict_type;
+    sf->width    = width;
+    sf->height   = height;
+    sf->pix_fmt  = pix_fmt;
+    sf->refcount = 1;
+    return sf;
+}
+
+static void shared_frame_ref(SharedFrame *sf)
+{
+    pthread_mutex_lock(&frame_mutex);
+    sf->refcount++;
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+static void shared_frame_unref(SharedFrame *sf)
+{
+    pthread_mutex_lock(&frame_mutex);
+    if (!--sf->refcount) {
+        sf->next = unused_frames;
+        unused_frames = sf;
+    }
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+static void shared_frames_free(void)
+{
+    SharedFrame *sf;
+
+    while ((sf = unused_frames)) {
+        unused_frames = sf->next;
+        av_free(sf->buf);
+        av_free(sf);
+    }
+}
+
+static void encoder_submit_picture(EncoderThread *et, struct AVInputStream *ist,
+                                   SharedFrame *picture, int nb_frames,
+                                   int frame_number, int64_t sync_opts)
+{
+    EncodeJob job;
+
+    memset(&job, 0, sizeof(job));
+    shared_frame_ref(picture);
+    job.picture      = picture;
+    job.ist          = ist;
+    job.nb_frames    = nb_frames;
+    job.frame_number = frame_number;
+    job.sync_opts    = sync_opts;
+    encoder_send(et, &job);
+}
+
+static void encoder_submit_flush(EncoderThread *et)
+{
+    EncodeJob job;
+
+    memset(&job, 0, sizeof(job));
+    if (et->buf_size)
+        job.buf = encoder_get_buffer(et);
+    job.flush = 1;
+    encoder_send(et, &job);
+}
+#endif
+
 #define MAX_AUDIO_PACKET_SIZE (128 * 1024)
 
 static void do_audio_out(AVFormatContext *s,
@@ -560,7 +1049,7 @@ static void do_audio_out(AVFormatContext *s,
     uint8_t *buftmp;
     int64_t audio_out_size, audio_buf_size;
 
-    int size_out, frame_bytes, ret;
+    int size_out, frame_bytes;
     AVCodecContext *enc= ost->st->codec;
     AVCodecContext *dec= ist->st->codec;
     int osize= av_get_bits_per_sample_format(enc->sample_fmt)/8;
@@ -709,34 +1198,19 @@ static void do_audio_out(AVFormatContext *s,
         frame_bytes = enc->frame_size * osize * enc->channels;
 
         while (av_fifo_size(ost->fifo) >= frame_bytes) {
-            AVPacket pkt;
-            av_init_packet(&pkt);
-
-            av_fifo_generic_read(ost->fifo, audio_buf, frame_bytes, NULL);
-
-            //FIXME pass ost->sync_opts as AVFrame.pts in avcodec_encode_audio()
-
-            ret = avcodec_encode_audio(enc, audio_out, audio_out_size,
-                                       (short *)audio_buf);
-            if (ret < 0) {
-                fprintf(stderr, "Audio encoding failed\n");
-                av_exit(1);
+#if HAVE_PTHREADS
+            if (ost->encoder) {
+                encoder_submit_samples(ost->encoder, ost->fifo, frame_bytes);
+            } else
+#endif
+            {
+                av_fifo_generic_read(ost->fifo, audio_buf, frame_bytes, NULL);
+                encode_audio_frame(s, ost, audio_out, audio_out_size,
+                                   (short *)audio_buf);
             }
-            audio_size += ret;
-            pkt.stream_index= ost->index;
-            pkt.data= audio_out;
-            pkt.size= ret;
-            if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
-                pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
-            pkt.flags |= PKT_FLAG_KEY;
-            write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
-
             ost->sync_opts += enc->frame_size;
         }
     } else {
-        AVPacket pkt;
-        av_init_packet(&pkt);
-
         ost->sync_opts += size_out / (osize * enc->channels);
 
         /* output a pcm frame */
@@ -750,21 +1224,7 @@ static void do_audio_out(AVFormatContext *s,
             av_exit(1);
         }
 
-        //FIXME pass ost->sync_opts as AVFrame.pts in avcodec_encode_audio()
-        ret = avcodec_encode_audio(enc, audio_out, size_out,
-                                   (short *)buftmp);
-        if (ret < 0) {
-            fprintf(stderr, "Audio encoding failed\n");
-            av_exit(1);
-        }
-        audio_size += ret;
-        pkt.stream_index= ost->index;
-        pkt.data= audio_out;
-        pkt.size= ret;
-        if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
-            pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
-        pkt.flags |= PKT_FLAG_KEY;
-        write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+        encode_audio_frame(s, ost, audio_out, size_out, (short *)buftmp);
     }
 }
 
@@ -869,72 +1329,43 @@ static void do_subtitle_out(AVFormatContext *s,
             else
                 pkt.pts += 90 * sub->end_display_time;
         }
-        write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+        write_frame(s, &pkt, ost);
     }
 }
 
 static int bit_buffer_size= 1024*256;
 static uint8_t *bit_buffer= NULL;
 
-static void do_video_out(AVFormatContext *s,
-                         AVOutputStream *ost,
-                         AVInputStream *ist,
-                         AVFrame *in_picture,
-                         int *frame_size)
+/* crop, scale and pad in_picture, which is width x height in pix_fmt, to
+   the output size and write it nb_frames times starting at output
+   timestamp sync_opts, returns the size of the last encoded frame or a
+   negative value if the picture could not be converted */
+static int encode_video_frames(AVFormatContext *s,
+                               AVOutputStream *ost,
+                               AVInputStream *ist,
+                               AVFrame *in_picture,
+                               int width, int height, enum PixelFormat pix_fmt,
+                               int64_t sync_opts, int nb_frames,
+                               uint8_t *buf, int buf_size)
 {
-    int nb_frames, i, ret;
+    int i, ret, frame_size = 0;
     int64_t topBand, bottomBand, leftBand, rightBand;
     AVFrame *final_picture, *formatted_picture, *resampling_dst, *padding_src;
     AVFrame picture_crop_temp, picture_pad_temp;
-    AVCodecContext *enc, *dec;
+    AVCodecContext *enc;
+    StageTimer t;
 
     avcodec_get_frame_defaults(&picture_crop_temp);
     avcodec_get_frame_defaults(&picture_pad_temp);
 
     enc = ost->st->codec;
-    dec = ist->st->codec;
-
-    /* by default, we output a single frame */
-    nb_frames = 1;
-
-    *frame_size = 0;
-
-    if(video_sync_method){
-        double vdelta;
-        vdelta = get_sync_ipts(ost) / av_q2d(enc->time_base) - ost->sync_opts;
-        //FIXME set to 0.5 after we fix some dts/pts bugs like in avidec.c
-        if (vdelta < -1.1)
-            nb_frames = 0;
-        else if (video_sync_method == 2 || (video_sync_method<0 && (s->oformat->flags & AVFMT_VARIABLE_FPS))){
-            if(vdelta<=-0.6){
-                nb_frames=0;
-            }else if(vdelta>0.6)
-            ost->sync_opts= lrintf(get_sync_ipts(ost) / av_q2d(enc->time_base));
-        }else if (vdelta > 1.1)
-            nb_frames = lrintf(vdelta);
-//fprintf(stderr, "vdelta:%f, ost->sync_opts:%"PRId64", ost->sync_ipts:%f nb_frames:%d\n", vdelta, ost->sync_opts, get_sync_ipts(ost), nb_frames);
-        if (nb_frames == 0){
-            ++nb_frames_drop;
-            if (verbose>2)
-                fprintf(stderr, "*** drop!\n");
-        }else if (nb_frames > 1) {
-            nb_frames_dup += nb_frames - 1;
-            if (verbose>2)
-                fprintf(stderr, "*** %d dup!\n", nb_frames-1);
-        }
-    }else
-        ost->sync_opts= lrintf(get_sync_ipts(ost) / av_q2d(enc->time_base));
-
-    nb_frames= FFMIN(nb_frames, max_frames[CODEC_TYPE_VIDEO] - ost->frame_number);
-    if (nb_frames <= 0)
-        return;
 
     if (ost->video_crop) {
-        if (av_picture_crop((AVPicture *)&picture_crop_temp, (AVPicture *)in_picture, dec->pix_fmt, ost->topBand, ost->leftBand) < 0) {
+        if (av_picture_crop((AVPicture *)&picture_crop_temp, (AVPicture *)in_picture, pix_fmt, ost->topBand, ost->leftBand) < 0) {
             fprintf(stderr, "error cropping picture\n");
             if (exit_on_error)
                 av_exit(1);
-            return;
+            return -1;
         }
         formatted_picture = &picture_crop_temp;
     } else {
@@ -951,17 +1382,17 @@ static void do_video_out(AVFormatContext *s,
                 fprintf(stderr, "error padding picture\n");
                 if (exit_on_error)
                     av_exit(1);
-                return;
+                return -1;
             }
             resampling_dst = &picture_pad_temp;
         }
     }
 
-    if(    (ost->resample_height != (ist->st->codec->height - (ost->topBand  + ost->bottomBand)))
-        || (ost->resample_width  != (ist->st->codec->width  - (ost->leftBand + ost->rightBand)))
-        || (ost->resample_pix_fmt!= ist->st->codec->pix_fmt) ) {
+    if(    (ost->resample_height != (height - (ost->topBand  + ost->bottomBand)))
+        || (ost->resample_width  != (width  - (ost->leftBand + ost->rightBand)))
+        || (ost->resample_pix_fmt!= pix_fmt) ) {
 
-        fprintf(stderr,"Input Stream #%d.%d frame size changed to %dx%d, %s\n", ist->file_index, ist->index, ist->st->codec->width,     ist->st->codec->height,avcodec_get_pix_fmt_name(ist->st->codec->pix_fmt));
+        fprintf(stderr,"Input Stream #%d.%d frame size changed to %dx%d, %s\n", ist->file_index, ist->index, width,     height,avcodec_get_pix_fmt_name(pix_fmt));
         if(!ost->video_resample)
             av_exit(1);
     }
@@ -969,15 +1400,15 @@ static void do_video_out(AVFormatContext *s,
     if (ost->video_resample) {
         padding_src = NULL;
         final_picture = &ost->pict_tmp;
-        if(  (ost->resample_height != (ist->st->codec->height - (ost->topBand  + ost->bottomBand)))
-          || (ost->resample_width  != (ist->st->codec->width  - (ost->leftBand + ost->rightBand)))
-          || (ost->resample_pix_fmt!= ist->st->codec->pix_fmt) ) {
+        if(  (ost->resample_height != (height - (ost->topBand  + ost->bottomBand)))
+          || (ost->resample_width  != (width  - (ost->leftBand + ost->rightBand)))
+          || (ost->resample_pix_fmt!= pix_fmt) ) {
 
             /* keep bands proportional to the frame size */
-            topBand    = ((int64_t)ist->st->codec->height * ost->original_topBand    / ost->original_height) & ~1;
-            bottomBand = ((int64_t)ist->st->codec->height * ost->original_bottomBand / ost->original_height) & ~1;
-            leftBand   = ((int64_t)ist->st->codec->width  * ost->original_leftBand   / ost->original_width)  & ~1;
-            rightBand  = ((int64_t)ist->st->codec->width  * ost->original_rightBand  / ost->original_width)  & ~1;
+            topBand    = ((int64_t)height * ost->original_topBand    / ost->original_height) & ~1;
+            bottomBand = ((int64_t)height * ost->original_bottomBand / ost->original_height) & ~1;
+            leftBand   = ((int64_t)width  * ost->original_leftBand   / ost->original_width)  & ~1;
+            rightBand  = ((int64_t)width  * ost->original_rightBand  / ost->original_width)  & ~1;
 
             /* sanity check to ensure no bad band sizes sneak in */
             assert(topBand    <= INT_MAX && topBand    >= 0);
@@ -990,17 +1421,17 @@ static void do_video_out(AVFormatContext *s,
             ost->leftBand   = leftBand;
             ost->rightBand  = rightBand;
 
-            ost->resample_height = ist->st->codec->height - (ost->topBand  + ost->bottomBand);
-            ost->resample_width  = ist->st->codec->width  - (ost->leftBand + ost->rightBand);
-            ost->resample_pix_fmt= ist->st->codec->pix_fmt;
+            ost->resample_height = height - (ost->topBand  + ost->bottomBand);
+            ost->resample_width  = width  - (ost->leftBand + ost->rightBand);
+            ost->resample_pix_fmt= pix_fmt;
 
             /* initialize a new scaler context */
             sws_freeContext(ost->img_resample_ctx);
             sws_flags = av_get_int(sws_opts, "sws_flags", NULL);
             ost->img_resample_ctx = sws_getContext(
-                ist->st->codec->width  - (ost->leftBand + ost->rightBand),
-                ist->st->codec->height - (ost->topBand  + ost->bottomBand),
-                ist->st->codec->pix_fmt,
+                width  - (ost->leftBand + ost->rightBand),
+                height - (ost->topBand  + ost->bottomBand),
+                pix_fmt,
                 ost->st->codec->width  - (ost->padleft  + ost->padright),
                 ost->st->codec->height - (ost->padtop   + ost->padbottom),
                 ost->st->codec->pix_fmt,
@@ -1010,8 +1441,10 @@ static void do_video_out(AVFormatContext *s,
                 av_exit(1);
             }
         }
+        stage_start(&t);
         sws_scale(ost->img_resample_ctx, formatted_picture->data, formatted_picture->linesize,
               0, ost->resample_height, resampling_dst->data, resampling_dst->linesize);
+        stage_stop(&ost->stats, STAGE_SCALE, &t, 1);
     }
 
     if (ost->video_pad) {
@@ -1031,13 +1464,13 @@ static void do_video_out(AVFormatContext *s,
                avoid any copies. We support temorarily the older
                method. */
             AVFrame* old_frame = enc->coded_frame;
-            enc->coded_frame = dec->coded_frame; //FIXME/XXX remove this hack
+            enc->coded_frame = ist->st->codec->coded_frame; //FIXME/XXX remove this hack
             pkt.data= (uint8_t *)final_picture;
             pkt.size=  sizeof(AVPicture);
-            pkt.pts= av_rescale_q(ost->sync_opts, enc->time_base, ost->st->time_base);
+            pkt.pts= av_rescale_q(sync_opts + i, enc->time_base, ost->st->time_base);
             pkt.flags |= PKT_FLAG_KEY;
 
-            write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
+            write_frame(s, &pkt, ost);
             enc->coded_frame = old_frame;
         } else {
             AVFrame big_picture;
@@ -1056,48 +1489,101 @@ static void do_video_out(AVFormatContext *s,
             /* handles sameq here. This is not correct because it may
                not be a global option */
             if (same_quality) {
-                big_picture.quality = ist->st->quality;
+                big_picture.quality = in_picture->quality;
             }else
                 big_picture.quality = ost->st->quality;
-            if(!me_threshold)
+            /* -me_threshold reuses the decoder picture types, but libx264
+               turns an I-type into an IDR frame, which only -abr wants */
+            if(!me_threshold || enc->codec_id == CODEC_ID_H264)
                 big_picture.pict_type = 0;
 //            big_picture.pts = AV_NOPTS_VALUE;
-            big_picture.pts= ost->sync_opts;
+            big_picture.pts= sync_opts + i;
 //            big_picture.pts= av_rescale(ost->sync_opts, AV_TIME_BASE*(int64_t)enc->time_base.num, enc->time_base.den);
 //av_log(NULL, AV_LOG_DEBUG, "%"PRId64" -> encoder\n", ost->sync_opts);
-            ret = avcodec_encode_video(enc,
-                                       bit_buffer, bit_buffer_size,
-                                       &big_picture);
-            if (ret < 0) {
-                fprintf(stderr, "Video encoding failed\n");
-                av_exit(1);
+            if (abr_gop_duration) {
+                /* start a GOP at the same instants in all renditions */
+                int64_t gop_index = av_rescale_q(big_picture.pts, enc->time_base, AV_TIME_BASE_Q) / abr_gop_duration;
+                if (!ost->gop_started || gop_index != ost->gop_index)
+                    big_picture.pict_type = FF_I_TYPE;
+                ost->gop_started = 1;
+                ost->gop_index   = gop_index;
             }
+            ret = encode_video_frame(s, ost, buf, buf_size, &big_picture);
+            if (ret > 0)
+                frame_size = ret;
+        }
+    }
+    return frame_size;
+}
+
+static void do_video_out(AVFormatContext *s,
+                         AVOutputStream *ost,
+                         AVInputStream *ist,
+                         AVFrame *in_picture,
+                         struct SharedFrame **shared_picture,
+                         int *frame_size)
+{
+    int nb_frames, ret;
+    AVCodecContext *enc, *dec;
+
+    enc = ost->st->codec;
+    dec = ist->st->codec;
+
+    /* by default, we output a single frame */
+    nb_frames = 1;
+
+    *frame_size = 0;
+
+    if(video_sync_method){
+        double vdelta;
+        vdelta = get_sync_ipts(ost) / av_q2d(enc->time_base) - ost->sync_opts;
+        //FIXME set to 0.5 after we fix some dts/pts bugs like in avidec.c
+        if (vdelta < -1.1)
+            nb_frames = 0;
+        else if (video_sync_method == 2 || (video_sync_method<0 && (s->oformat->flags & AVFMT_VARIABLE_FPS))){
+            if(vdelta<=-0.6){
+                nb_frames=0;
+            }else if(vdelta>0.6)
+            ost->sync_opts= lrintf(get_sync_ipts(ost) / av_q2d(enc->time_base));
+        }else if (vdelta > 1.1)
+            nb_frames = lrintf(vdelta);
+//fprintf(stderr, "vdelta:%f, ost->sync_opts:%"PRId64", ost->sync_ipts:%f nb_frames:%d\n", vdelta, ost->sync_opts, get_sync_ipts(ost), nb_frames);
+        if (nb_frames == 0){
+            ++nb_frames_drop;
+            if (verbose>2)
+                fprintf(stderr, "*** drop!\n");
+        }else if (nb_frames > 1) {
+            nb_frames_dup += nb_frames - 1;
+            if (verbose>2)
+                fprintf(stderr, "*** %d dup!\n", nb_frames-1);
+        }
+    }else
+        ost->sync_opts= lrintf(get_sync_ipts(ost) / av_q2d(enc->time_base));
 
-            if(ret>0){
-                pkt.data= bit_buffer;
-                pkt.size= ret;
-                if(enc->coded_frame->pts != AV_NOPTS_VALUE)
-                    pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
-/*av_log(NULL, AV_LOG_DEBUG, "encoder -> %"PRId64"/%"PRId64"\n",
-   pkt.pts != AV_NOPTS_VALUE ? av_rescale(pkt.pts, enc->time_base.den, AV_TIME_BASE*(int64_t)enc->time_base.num) : -1,
-   pkt.dts != AV_NOPTS_VALUE ? av_rescale(pkt.dts, enc->time_base.den, AV_TIME_BASE*(int64_t)enc->time_base.num) : -1);*/
+    nb_frames= FFMIN(nb_frames, max_frames[CODEC_TYPE_VIDEO] - ost->frame_number);
+    if (nb_frames <= 0)
+        return;
 
-                if(enc->coded_frame->key_frame)
-                    pkt.flags |= PKT_FLAG_KEY;
-                write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
-                *frame_size = ret;
-                video_size += ret;
-                //fprintf(stderr,"\nFrame: %3d size: %5d type: %d",
-                //        enc->frame_number-1, ret, enc->pict_type);
-                /* if two pass, output log */
-                if (ost->logfile && enc->stats_out) {
-                    fprintf(ost->logfile, "%s", enc->stats_out);
-                }
-            }
-        }
-        ost->sync_opts++;
-        ost->frame_number++;
-    }
+#if HAVE_PTHREADS
+    if (ost->encoder) {
+        /* the encoding thread converts the picture itself, all of them
+           share one copy of the decoded picture */
+        if (!*shared_picture)
+            *shared_picture = shared_frame_new(in_picture, dec->width, dec->height, dec->pix_fmt);
+        encoder_submit_picture(ost->encoder, ist, *shared_picture,
+                               nb_frames, ost->frame_number, ost->sync_opts);
+        ret = 0;
+    } else
+#endif
+    ret = encode_video_frames(s, ost, ist, in_picture,
+                              dec->width, dec->height, dec->pix_fmt,
+                              ost->sync_opts, nb_frames,
+                              bit_buffer, bit_buffer_size);
+    if (ret < 0)
+        return;
+    *frame_size = ret;
+    ost->sync_opts    += nb_frames;
+    ost->frame_number += nb_frames;
 }
 
 static double psnr(double d){
@@ -1105,10 +1591,9 @@ static double psnr(double d){
 }
 
 static void do_video_stats(AVFormatContext *os, AVOutputStream *ost,
-                           int frame_size)
+                           int frame_size, int frame_number, int64_t sync_opts)
 {
     AVCodecContext *enc;
-    int frame_number;
     double ti1, bitrate, avg_bitrate;
 
     /* this is executed just the first time do_video_stats is called */
@@ -1122,14 +1607,13 @@ static void do_video_stats(AVFormatContext *os, AVOutputStream *ost,
 
     enc = ost->st->codec;
     if (enc->codec_type == CODEC_TYPE_VIDEO) {
-        frame_number = ost->frame_number;
         fprintf(vstats_file, "frame= %5d q= %2.1f ", frame_number, enc->coded_frame->quality/(float)FF_QP2LAMBDA);
         if (enc->flags&CODEC_FLAG_PSNR)
             fprintf(vstats_file, "PSNR= %6.2f ", psnr(enc->coded_frame->error[0]/(enc->width*enc->height*255.0*255.0)));
 
         fprintf(vstats_file,"f_size= %6d ", frame_size);
         /* compute pts value */
-        ti1 = ost->sync_opts * av_q2d(enc->time_base);
+        ti1 = sync_opts * av_q2d(enc->time_base);
         if (ti1 < 0.01)
             ti1 = 0.01;
 
@@ -1264,10 +1748,461 @@ static void print_report(AVFormatContext **output_files,
     }
 }
 
+static const char *codec_type_name(enum CodecType type)
+{
+    switch (type) {
+    case CODEC_TYPE_VIDEO:    return "video";
+    case CODEC_TYPE_AUDIO:    return "audio";
+    case CODEC_TYPE_SUBTITLE: return "subtitle";
+    default:                  return "data";
+    }
+}
+
+static void print_stage_stats_line(const char *name, const StageStats *stats)
+{
+    int i;
+
+    for (i = 0; i < NB_STAGES; i++)
+        if (stats->count[i] || stats->wall[i])
+            fprintf(stderr, "%-14s %-11s %10.3f %10.3f %10"PRId64"\n",
+                    name, stage_names[i], stats->wall[i] / 1000000.0,
+                    stats->cpu[i] / 1000000.0, stats->count[i]);
+}
+
+static void print_stage_stats(AVInputStream **ist_table, int nb_istreams,
+                              AVOutputStream **ost_table, int nb_ostreams)
+{
+    char name[32];
+    int i;
+
+    fprintf(stderr, "%-14s %-11s %10s %10s %10s\n",
+            "stream", "stage", "wall(s)", "cpu(s)", "count");
+    for (i = 0; i < nb_input_files; i++) {
+        snprintf(name, sizeof(name), "input #%d", i);
+        print_stage_stats_line(name, &input_file_stats[i]);
+    }
+    for (i = 0; i < nb_istreams; i++) {
+        snprintf(name, sizeof(name), "input #%d.%d",
+                 ist_table[i]->file_index, ist_table[i]->index);
+        print_stage_stats_line(name, &ist_table[i]->stats);
+    }
+    for (i = 0; i < nb_ostreams; i++) {
+        snprintf(name, sizeof(name), "output #%d.%d",
+                 ost_table[i]->file_index, ost_table[i]->index);
+        print_stage_stats_line(name, &ost_table[i]->stats);
+    }
+}
+
+static void write_stage_stats_json(FILE *f, const StageStats *stats)
+{
+    const char *sep = "";
+    int i;
+
+    fprintf(f, "\"stages\":{");
+    for (i = 0; i < NB_STAGES; i++) {
+        if (!stats->count[i] && !stats->wall[i])
+            continue;
+        fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f,\"count\":%"PRId64"}",
+                sep, stage_names[i], stats->wall[i] / 1000000.0,
+                stats->cpu[i] / 1000000.0, stats->count[i]);
+        sep = ",";
+    }
+    fprintf(f, "}");
+}
+
+/* write one line of JSON with the stage statistics so far */
+static void write_stage_stats(AVInputStream **ist_table, int nb_istreams,
+                              AVOutputStream **ost_table, int nb_ostreams,
+                              int is_last_report)
+{
+    FILE *f = stage_stats_file;
+    int i, j, depth;
+
+    fprintf(f, "{\"time\":%.6f,\"final\":%s,\"inputs\":[",
+            (av_gettime() - timer_start) / 1000000.0,
+            is_last_report ? "true" : "false");
+    for (i = 0; i < nb_input_files; i++) {
+        const char *sep = "";
+        depth = 0;
+#if HAVE_PTHREADS
+        if (input_threads)
+            depth = tq_depth(&input_threads[i].packets);
+#endif
+        fprintf(f, "%s{\"file\":%d,\"queue_depth\":%d,", i ? "," : "", i, depth);
+        write_stage_stats_json(f, &input_file_stats[i]);
+        fprintf(f, ",\"streams\":[");
+        for (j = 0; j < nb_istreams; j++) {
+            AVInputStream *ist = ist_table[j];
+            if (ist->file_index != i)
+                continue;
+            fprintf(f, "%s{\"index\":%d,\"type\":\"%s\",\"frames\":%"PRId64",",
+                    sep, ist->index, codec_type_name(ist->st->codec->codec_type),
+                    ist->stats.count[STAGE_DECODE]);
+            write_stage_stats_json(f, &ist->stats);
+            fprintf(f, "}");
+            sep = ",";
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "],\"outputs\":[");
+    for (i = 0; i < nb_ostreams; i++) {
+        AVOutputStream *ost = ost_table[i];
+        depth = 0;
+#if HAVE_PTHREADS
+        if (ost->encoder)
+            depth = tq_depth(&ost->encoder->jobs);
+#endif
+        fprintf(f, "%s{\"file\":%d,\"index\":%d,\"type\":\"%s\",\"frames\":%"PRId64",\"queue_depth\":%d,",
+                i ? "," : "", ost->file_index, ost->index,
+                codec_type_name(ost->st->codec->codec_type),
+                ost->encoding_needed ? ost->stats.count[STAGE_ENCODE] : ost->frame_number,
+                depth);
+        write_stage_stats_json(f, &ost->stats);
+        fprintf(f, "}");
+    }
+    fprintf(f, "]}\n");
+    fflush(f);
+}
+
+/* encode the samples left in the audio fifo and drain the encoder */
+static void flush_encoder(AVFormatContext *os, AVOutputStream *ost,
+                          uint8_t *buf, int buf_size,
+                          short *samples, int samples_size)
+{
+    AVCodecContext *enc= ost->st->codec;
+    StageTimer t;
+    int ret;
+
+    for(;;) {
+        AVPacket pkt;
+        int fifo_bytes;
+        av_init_packet(&pkt);
+        pkt.stream_index= ost->index;
+
+        switch(ost->st->codec->codec_type) {
+        case CODEC_TYPE_AUDIO:
+            fifo_bytes = av_fifo_size(ost->fifo);
+            ret = 0;
+            /* encode any samples remaining in fifo */
+            if (fifo_bytes > 0) {
+                int osize = av_get_bits_per_sample_format(enc->sample_fmt) >> 3;
+                int fs_tmp = enc->frame_size;
+
+                av_fifo_generic_read(ost->fifo, samples, fifo_bytes, NULL);
+                if (enc->codec->capabilities & CODEC_CAP_SMALL_LAST_FRAME) {
+                    enc->frame_size = fifo_bytes / (osize * enc->channels);
+                } else { /* pad */
+                    int frame_bytes = enc->frame_size*osize*enc->channels;
+                    if (samples_size < frame_bytes)
+                        av_exit(1);
+                    memset((uint8_t*)samples+fifo_bytes, 0, frame_bytes - fifo_bytes);
+                }
+
+                stage_start(&t);
+                ret = avcodec_encode_audio(enc, buf, buf_size, samples);
+                stage_stop(&ost->stats, STAGE_ENCODE, &t, 1);
+                pkt.duration = av_rescale((int64_t)enc->frame_size*ost->st->time_base.den,
+                                          ost->st->time_base.num, enc->sample_rate);
+                enc->frame_size = fs_tmp;
+            }
+            if(ret <= 0) {
+                stage_start(&t);
+                ret = avcodec_encode_audio(enc, buf, buf_size, NULL);
+                stage_stop(&ost->stats, STAGE_ENCODE, &t, ret > 0);
+            }
+            if (ret < 0) {
+                fprintf(stderr, "Audio encoding failed\n");
+                av_exit(1);
+            }
+            mux_lock();
+            audio_size += ret;
+            mux_unlock();
+            pkt.flags |= PKT_FLAG_KEY;
+            break;
+        case CODEC_TYPE_VIDEO:
+            stage_start(&t);
+            ret = avcodec_encode_video(enc, buf, buf_size, NULL);
+            stage_stop(&ost->stats, STAGE_ENCODE, &t, ret > 0);
+            if (ret < 0) {
+                fprintf(stderr, "Video encoding failed\n");
+                av_exit(1);
+            }
+            mux_lock();
+            video_size += ret;
+            mux_unlock();
+            if(enc->coded_frame && enc->coded_frame->key_frame)
+                pkt.flags |= PKT_FLAG_KEY;
+            if (ost->logfile && enc->stats_out) {
+                fprintf(ost->logfile, "%s", enc->stats_out);
+            }
+            break;
+        default:
+            ret=-1;
+        }
+
+        if(ret<=0)
+            break;
+        pkt.data= buf;
+        pkt.size= ret;
+        if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
+            pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
+        write_frame(os, &pkt, ost);
+    }
+}
+
+/* repeat_pict the parser of the packet's stream left for that packet */
+static int get_repeat_pict(AVFormatContext *ic, AVPacket *pkt)
+{
+    AVStream *st;
+
+    if (pkt->stream_index >= ic->nb_streams)
+        return 0;
+    st = ic->streams[pkt->stream_index];
+    return st->parser ? st->parser->repeat_pict : 0;
+}
+
+#if HAVE_PTHREADS
+static void *input_thread(void *arg)
+{
+    InputThread *it = arg;
+    StageStats *stats = &input_file_stats[it - input_threads];
+    StageTimer t;
+    InputPacket ipkt;
+    AVPacket *pkt = &ipkt.pkt;
+    int ret;
+
+    for (;;) {
+        stage_start(&t);
+        pthread_mutex_lock(&it->codec_mutex);
+        ret = av_read_frame(it->ic, pkt);
+        ipkt.repeat_pict = ret >= 0 ? get_repeat_pict(it->ic, pkt) : 0;
+        pthread_mutex_unlock(&it->codec_mutex);
+        stage_stop(stats, STAGE_DEMUX, &t, ret >= 0);
+        if (ret == AVERROR(EAGAIN)) {
+            if (tq_finished(&it->packets))
+                break;
+            usleep(10000);
+            continue;
+        }
+        if (ret < 0)
+            break;
+        /* the payload may point into demuxer buffers that the next
+           av_read_frame() call reuses */
+        if ((ret = av_dup_packet(pkt)) < 0) {
+            av_free_packet(pkt);
+            break;
+        }
+        if (tq_send(&it->packets, &ipkt) < 0) {
+            av_free_packet(pkt);
+            ret = AVERROR_EOF;
+            break;
+        }
+    }
+    it->ret = ret;
+    tq_finish(&it->packets);
+    return NULL;
+}
+
+static int start_input_threads(void)
+{
+    int i;
+
+    input_threads = av_mallocz(nb_input_files * sizeof(*input_threads));
+    if (!input_threads)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < nb_input_files; i++) {
+        InputThread *it = &input_threads[i];
+        it->ic = input_files[i];
+        if (tq_init(&it->packets, sizeof(InputPacket), PIPELINE_PACKETS) < 0)
+            return AVERROR(ENOMEM);
+        pthread_mutex_init(&it->codec_mutex, NULL);
+        if (pthread_create(&it->thread, NULL, input_thread, it)) {
+            pthread_mutex_destroy(&it->codec_mutex);
+            tq_free(&it->packets);
+            return AVERROR(EAGAIN);
+        }
+    }
+    return 0;
+}
+
+static void stop_input_threads(void)
+{
+    InputPacket ipkt;
+    int i;
+
+    if (!input_threads)
+        return;
+    for (i = 0; i < nb_input_files; i++) {
+        InputThread *it = &input_threads[i];
+        if (!it->packets.fifo)
+            break;
+        tq_finish(&it->packets);
+        pthread_join(it->thread, NULL);
+        while (tq_recv(&it->packets, &ipkt) >= 0)
+            av_free_packet(&ipkt.pkt);
+        tq_free(&it->packets);
+        pthread_mutex_destroy(&it->codec_mutex);
+    }
+    av_freep(&input_threads);
+}
+
+static void *encoder_thread(void *arg)
+{
+    EncoderThread *et = arg;
+    AVOutputStream *ost = et->ost;
+    EncodeJob job;
+    int frame_size;
+
+    while (tq_recv(&et->jobs, &job) >= 0) {
+        if (job.flush) {
+            flush_encoder(et->os, ost, et->out, et->out_size,
+                          (short *)job.buf, et->buf_size);
+        } else if (ost->st->codec->codec_type == CODEC_TYPE_AUDIO) {
+            encode_audio_frame(et->os, ost, et->out, et->out_size,
+                               (short *)job.buf);
+        } else {
+            SharedFrame *sf = job.picture;
+            frame_size = encode_video_frames(et->os, ost, job.ist, &sf->frame,
+                                             sf->width, sf->height, sf->pix_fmt,
+                                             job.sync_opts, job.nb_frames,
+                                             et->out, et->out_size);
+            shared_frame_unref(sf);
+            if (vstats_filename && frame_size > 0) {
+                mux_lock();
+                do_video_stats(et->os, ost, frame_size,
+                               job.frame_number + job.nb_frames,
+                               job.sync_opts    + job.nb_frames);
+                mux_unlock();
+            }
+        }
+        if (job.buf)
+            tq_send(&et->buffers, &job.buf);
+    }
+    return NULL;
+}
+
+static int start_encoder_thread(AVFormatContext *os, AVOutputStream *ost)
+{
+    AVCodecContext *enc = ost->st->codec;
+    EncoderThread *et;
+    uint8_t *buf;
+    int i;
+
+    if (enc->codec_type == CODEC_TYPE_VIDEO) {
+        if (os->oformat->flags & AVFMT_RAWPICTURE)
+            return 0;
+    } else if (enc->codec_type != CODEC_TYPE_AUDIO || enc->frame_size <= 1)
+        return 0;
+
+    et = av_mallocz(sizeof(EncoderThread));
+    if (!et)
+        return AVERROR(ENOMEM);
+    et->os  = os;
+    et->ost = ost;
+    /* pictures are shared with the other encoders, samples are copied */
+    if (enc->codec_type == CODEC_TYPE_AUDIO)
+        et->buf_size = enc->frame_size * enc->channels *
+                       (av_get_bits_per_sample_format(enc->sample_fmt) >> 3);
+    et->out_size = bit_buffer_size;
+    et->out = av_malloc(et->out_size);
+    if (!et->out ||
+        tq_init(&et->jobs,    sizeof(EncodeJob), PIPELINE_FRAMES) < 0 ||
+        tq_init(&et->buffers, sizeof(uint8_t *), PIPELINE_FRAMES) < 0)
+        goto fail;
+    for (i = 0; et->buf_size && i < PIPELINE_FRAMES; i++) {
+        if (!(buf = av_malloc(et->buf_size)))
+            goto fail;
+        tq_send(&et->buffers, &buf);
+    }
+    if (pthread_create(&et->thread, NULL, encoder_thread, et))
+        goto fail;
+    ost->encoder = et;
+    return 0;
+fail:
+    if (et->buffers.fifo) {
+        while (av_fifo_size(et->buffers.fifo)) {
+            av_fifo_generic_read(et->buffers.fifo, &buf, sizeof(buf), NULL);
+            av_free(buf);
+        }
+        tq_free(&et->buffers);
+    }
+    if (et->jobs.fifo)
+        tq_free(&et->jobs);
+    av_free(et->out);
+    av_free(et);
+    return AVERROR(ENOMEM);
+}
+
+static void stop_encoder_thread(AVOutputStream *ost)
+{
+    EncoderThread *et = ost->encoder;
+    uint8_t *buf;
+
+    if (!et)
+        return;
+    tq_finish(&et->jobs);
+    pthread_join(et->thread, NULL);
+    tq_finish(&et->buffers);
+    while (tq_recv(&et->buffers, &buf) >= 0)
+        av_free(buf);
+    tq_free(&et->buffers);
+    tq_free(&et->jobs);
+    av_free(et->out);
+    av_freep(&ost->encoder);
+}
+#endif
+
+/* read the next packet of an input file, from its demuxing thread with
+   -pipeline */
+static int read_input_packet(int file_index, AVPacket *pkt, int *repeat_pict)
+{
+    StageTimer t;
+    int ret;
+
+#if HAVE_PTHREADS
+    if (input_threads) {
+        InputThread *it = &input_threads[file_index];
+        InputPacket ipkt;
+        stage_start(&t);
+        ret = tq_recv(&it->packets, &ipkt) < 0 ? it->ret : 0;
+        stage_stop(&input_file_stats[file_index], STAGE_QUEUE_WAIT, &t, 1);
+        if (ret >= 0) {
+            *pkt         = ipkt.pkt;
+            *repeat_pict = ipkt.repeat_pict;
+        }
+        return ret;
+    }
+#endif
+    stage_start(&t);
+    ret = av_read_frame(input_files[file_index], pkt);
+    stage_stop(&input_file_stats[file_index], STAGE_DEMUX, &t, ret >= 0);
+    if (ret >= 0)
+        *repeat_pict = get_repeat_pict(input_files[file_index], pkt);
+    return ret;
+}
+
+/* keep the demuxing thread of an input file off the codec contexts of its
+   streams */
+static void input_lock(int file_index)
+{
+#if HAVE_PTHREADS
+    if (input_threads)
+        pthread_mutex_lock(&input_threads[file_index].codec_mutex);
+#endif
+}
+
+static void input_unlock(int file_index)
+{
+#if HAVE_PTHREADS
+    if (input_threads)
+        pthread_mutex_unlock(&input_threads[file_index].codec_mutex);
+#endif
+}
+
 /* pkt = NULL means EOF (needed to flush decoder buffers) */
 static int output_packet(AVInputStream *ist, int ist_index,
                          AVOutputStream **ost_table, int nb_ostreams,
-                         const AVPacket *pkt)
+                         AVPacket *pkt)
 {
     AVFormatContext *os;
     AVOutputStream *ost;
@@ -1278,8 +2213,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
     static unsigned int samples_size= 0;
     AVSubtitle subtitle, *subtitle_to_free;
     int got_subtitle;
+    struct SharedFrame *shared_picture;
     AVPacket avpkt;
     int bps = av_get_bits_per_sample_format(ist->st->codec->sample_fmt)>>3;
+    StageTimer t;
 
     if(ist->next_pts == AV_NOPTS_VALUE)
         ist->next_pts= ist->pts;
@@ -1325,8 +2262,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 decoded_data_size= samples_size;
                     /* XXX: could avoid copy if PCM 16 bits with same
                        endianness as CPU */
+                stage_start(&t);
                 ret = avcodec_decode_audio3(ist->st->codec, samples, &decoded_data_size,
                                             &avpkt);
+                stage_stop(&ist->stats, STAGE_DECODE, &t, decoded_data_size > 0);
                 if (ret < 0)
                     goto fail_decode;
                 avpkt.data += ret;
@@ -1347,8 +2286,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
                     /* XXX: allocate picture correctly */
                     avcodec_get_frame_defaults(&picture);
 
+                    stage_start(&t);
                     ret = avcodec_decode_video2(ist->st->codec,
                                                 &picture, &got_picture, &avpkt);
+                    stage_stop(&ist->stats, STAGE_DECODE, &t, !!got_picture);
                     ist->st->quality= picture.quality;
                     if (ret < 0)
                         goto fail_decode;
@@ -1357,7 +2298,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
                         goto discard_packet;
                     }
                     if (ist->st->codec->time_base.num != 0) {
-                        int ticks= ist->st->parser ? ist->st->parser->repeat_pict+1 : ist->st->codec->ticks_per_frame;
+                        int ticks= ist->st->parser ? ist->repeat_pict+1 : ist->st->codec->ticks_per_frame;
                         ist->next_pts += ((int64_t)AV_TIME_BASE *
                                           ist->st->codec->time_base.num * ticks) /
                             ist->st->codec->time_base.den;
@@ -1365,8 +2306,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
                     avpkt.size = 0;
                     break;
             case CODEC_TYPE_SUBTITLE:
+                stage_start(&t);
                 ret = avcodec_decode_subtitle2(ist->st->codec,
                                                &subtitle, &got_subtitle, &avpkt);
+                stage_stop(&ist->stats, STAGE_DECODE, &t, !!got_subtitle);
                 if (ret < 0)
                     goto fail_decode;
                 if (!got_subtitle) {
@@ -1386,7 +2329,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 break;
             case CODEC_TYPE_VIDEO:
                 if (ist->st->codec->time_base.num != 0) {
-                    int ticks= ist->st->parser ? ist->st->parser->repeat_pict+1 : ist->st->codec->ticks_per_frame;
+                    int ticks= ist->st->parser ? ist->repeat_pict+1 : ist->st->codec->ticks_per_frame;
                     ist->next_pts += ((int64_t)AV_TIME_BASE *
                                       ist->st->codec->time_base.num * ticks) /
                         ist->st->codec->time_base.den;
@@ -1399,8 +2342,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
 
         buffer_to_free = NULL;
         if (ist->st->codec->codec_type == CODEC_TYPE_VIDEO) {
+            stage_start(&t);
             pre_process_video_frame(ist, (AVPicture *)&picture,
                                     &buffer_to_free);
+            stage_stop(&ist->stats, STAGE_PREPROCESS, &t, 1);
         }
 
         // preprocess audio (volume)
@@ -1427,6 +2372,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
 
         /* if output time reached then transcode raw format,
            encode packets and output them */
+        shared_picture = NULL;
         if (start_time == 0 || ist->pts >= start_time)
             for(i=0;i<nb_ostreams;i++) {
                 int frame_size;
@@ -1445,9 +2391,9 @@ static int output_packet(AVInputStream *ist, int ist_index,
                             do_audio_out(os, ost, ist, decoded_data_buf, decoded_data_size);
                             break;
                         case CODEC_TYPE_VIDEO:
-                            do_video_out(os, ost, ist, &picture, &frame_size);
+                            do_video_out(os, ost, ist, &picture, &shared_picture, &frame_size);
                             if (vstats_filename && frame_size)
-                                do_video_stats(os, ost, frame_size);
+                                do_video_stats(os, ost, frame_size, ost->frame_number, ost->sync_opts);
                             break;
                         case CODEC_TYPE_SUBTITLE:
                             do_subtitle_out(os, ost, ist, &subtitle,
@@ -1504,13 +2450,32 @@ static int output_packet(AVInputStream *ist, int ist_index,
                             opkt.size = data_size;
                         }
 
-                        write_frame(os, &opkt, ost->st->codec, bitstream_filters[ost->file_index][opkt.stream_index]);
+                        /* reference the input payload instead of having
+                           each output copy it, the reference count is not
+                           shared with the encoder threads of -pipeline */
+                        if (!use_pipeline && !opkt.destruct && opkt.data == pkt->data && opkt.size == pkt->size) {
+                            uint8_t *old_data = pkt->data;
+                            AVPacket ref;
+                            if (av_packet_ref(&ref, pkt) >= 0) {
+                                /* the input payload may have been moved */
+                                avpkt.data    = pkt->data + (avpkt.data - old_data);
+                                opkt.data     = ref.data;
+                                opkt.destruct = ref.destruct;
+                                opkt.priv     = ref.priv;
+                            }
+                        }
+
+                        write_frame(os, &opkt, ost);
                         ost->st->codec->frame_number++;
                         ost->frame_number++;
                         av_free_packet(&opkt);
                     }
                 }
             }
+#if HAVE_PTHREADS
+        if (shared_picture)
+            shared_frame_unref(shared_picture);
+#endif
         av_free(buffer_to_free);
         /* XXX: allocate the subtitles in the codec ? */
         if (subtitle_to_free) {
@@ -1541,73 +2506,14 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 if(ost->st->codec->codec_type == CODEC_TYPE_VIDEO && (os->oformat->flags & AVFMT_RAWPICTURE))
                     continue;
 
-                if (ost->encoding_needed) {
-                    for(;;) {
-                        AVPacket pkt;
-                        int fifo_bytes;
-                        av_init_packet(&pkt);
-                        pkt.stream_index= ost->index;
-
-                        switch(ost->st->codec->codec_type) {
-                        case CODEC_TYPE_AUDIO:
-                            fifo_bytes = av_fifo_size(ost->fifo);
-                            ret = 0;
-                            /* encode any samples remaining in fifo */
-                            if (fifo_bytes > 0) {
-                                int osize = av_get_bits_per_sample_format(enc->sample_fmt) >> 3;
-                                int fs_tmp = enc->frame_size;
-
-                                av_fifo_generic_read(ost->fifo, samples, fifo_bytes, NULL);
-                                if (enc->codec->capabilities & CODEC_CAP_SMALL_LAST_FRAME) {
-                                    enc->frame_size = fifo_bytes / (osize * enc->channels);
-                                } else { /* pad */
-                                    int frame_bytes = enc->frame_size*osize*enc->channels;
-                                    if (samples_size < frame_bytes)
-                                        av_exit(1);
-                                    memset((uint8_t*)samples+fifo_bytes, 0, frame_bytes - fifo_bytes);
-                                }
-
-                                ret = avcodec_encode_audio(enc, bit_buffer, bit_buffer_size, samples);
-                                pkt.duration = av_rescale((int64_t)enc->frame_size*ost->st->time_base.den,
-                                                          ost->st->time_base.num, enc->sample_rate);
-                                enc->frame_size = fs_tmp;
-                            }
-                            if(ret <= 0) {
-                                ret = avcodec_encode_audio(enc, bit_buffer, bit_buffer_size, NULL);
-                            }
-                            if (ret < 0) {
-                                fprintf(stderr, "Audio encoding failed\n");
-                                av_exit(1);
-                            }
-                            audio_size += ret;
-                            pkt.flags |= PKT_FLAG_KEY;
-                            break;
-                        case CODEC_TYPE_VIDEO:
-                            ret = avcodec_encode_video(enc, bit_buffer, bit_buffer_size, NULL);
-                            if (ret < 0) {
-                                fprintf(stderr, "Video encoding failed\n");
-                                av_exit(1);
-                            }
-                            video_size += ret;
-                            if(enc->coded_frame && enc->coded_frame->key_frame)
-                                pkt.flags |= PKT_FLAG_KEY;
-                            if (ost->logfile && enc->stats_out) {
-                                fprintf(ost->logfile, "%s", enc->stats_out);
-                            }
-                            break;
-                        default:
-                            ret=-1;
-                        }
-
-                        if(ret<=0)
-                            break;
-                        pkt.data= bit_buffer;
-                        pkt.size= ret;
-                        if(enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
-                            pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
-                        write_frame(os, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
-                    }
+#if HAVE_PTHREADS
+                if (ost->encoder) {
+                    encoder_submit_flush(ost->encoder);
+                    continue;
                 }
+#endif
+                if (ost->encoding_needed)
+                    flush_encoder(os, ost, bit_buffer, bit_buffer_size, samples, samples_size);
             }
         }
     }
@@ -1672,6 +2578,7 @@ static int av_encode(AVFormatContext **output_files,
     int want_sdp = 1;
     uint8_t no_packet[MAX_FILES]={0};
     int no_packet_count=0;
+    int repeat_pict;
 
     file_table= av_mallocz(nb_input_files * sizeof(AVInputFile));
     if (!file_table)
@@ -2178,7 +3085,40 @@ static int av_encode(AVFormatContext **output_files,
     }
     term_init();
 
+#if HAVE_PTHREADS
+    if (use_pipeline) {
+        for(i=0;i<nb_ostreams;i++) {
+            ost = ost_table[i];
+            if (ost->encoding_needed &&
+                start_encoder_thread(output_files[ost->file_index], ost) < 0) {
+                fprintf(stderr, "Could not start encoding thread for output stream #%d.%d\n",
+                        ost->file_index, ost->index);
+                av_exit(1);
+            }
+        }
+        if (start_input_threads() < 0) {
+            fprintf(stderr, "Could not start demuxing threads\n");
+            av_exit(1);
+        }
+    }
+#else
+    if (use_pipeline) {
+        fprintf(stderr, "Pipelining requires threads, transcoding serially\n");
+        use_pipeline = 0;
+    }
+#endif
+
+    if (stage_stats_filename) {
+        stage_stats_file = fopen(stage_stats_filename, "w");
+        if (!stage_stats_file) {
+            perror(stage_stats_filename);
+            av_exit(1);
+        }
+    }
+    do_stage_stats = show_stage_stats || stage_stats_file;
+
     timer_start = av_gettime();
+    last_stage_stats_time = timer_start;
 
     for(; received_sigterm == 0;) {
         int file_index, ist_index;
@@ -2211,8 +3151,13 @@ static int av_encode(AVFormatContext **output_files,
                 continue;
             if(ost->st->codec->codec_type == CODEC_TYPE_VIDEO)
                 opts = ost->sync_opts * av_q2d(ost->st->codec->time_base);
-            else
+            else if (ost->encoder) /* the muxer lags behind by the queued frames */
+                opts = ost->sync_opts / (double)ost->st->codec->sample_rate;
+            else {
+                mux_lock();
                 opts = ost->st->pts.val * av_q2d(ost->st->time_base);
+                mux_unlock();
+            }
             ipts = (double)ist->pts;
             if (!file_table[ist->file_index].eof_reached){
                 if(ipts < ipts_min) {
@@ -2245,12 +3190,18 @@ static int av_encode(AVFormatContext **output_files,
             break;
 
         /* finish if limit size exhausted */
-        if (limit_filesize != 0 && limit_filesize < url_ftell(output_files[0]->pb))
-            break;
+        if (limit_filesize != 0) {
+            int64_t size;
+            mux_lock();
+            size = url_ftell(output_files[0]->pb);
+            mux_unlock();
+            if (limit_filesize < size)
+                break;
+        }
 
         /* read a frame from it and output it in the fifo */
         is = input_files[file_index];
-        ret= av_read_frame(is, &pkt);
+        ret= read_input_packet(file_index, &pkt, &repeat_pict);
         if(ret == AVERROR(EAGAIN)){
             no_packet[file_index]=1;
             no_packet_count++;
@@ -2278,6 +3229,7 @@ static int av_encode(AVFormatContext **output_files,
         ist = ist_table[ist_index];
         if (ist->discard)
             goto discard_packet;
+        ist->repeat_pict = repeat_pict;
 
         if (pkt.dts != AV_NOPTS_VALUE)
             pkt.dts += av_rescale_q(input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q, ist->st->time_base);
@@ -2307,7 +3259,10 @@ static int av_encode(AVFormatContext **output_files,
         }
 
         //fprintf(stderr,"read #%d.%d size=%d\n", ist->file_index, ist->index, pkt.size);
-        if (output_packet(ist, ist_index, ost_table, nb_ostreams, &pkt) < 0) {
+        input_lock(file_index);
+        ret = output_packet(ist, ist_index, ost_table, nb_ostreams, &pkt);
+        input_unlock(file_index);
+        if (ret < 0) {
 
             if (verbose >= 0)
                 fprintf(stderr, "Error while decoding stream #%d.%d\n",
@@ -2322,9 +3277,21 @@ static int av_encode(AVFormatContext **output_files,
         av_free_packet(&pkt);
 
         /* dump report by using the output first video and audio streams */
+        mux_lock();
         print_report(output_files, ost_table, nb_ostreams, 0);
+        mux_unlock();
+
+        if (stage_stats_file && stage_stats_period > 0 &&
+            av_gettime() - last_stage_stats_time >= stage_stats_period * 1000000) {
+            last_stage_stats_time = av_gettime();
+            write_stage_stats(ist_table, nb_istreams, ost_table, nb_ostreams, 0);
+        }
     }
 
+#if HAVE_PTHREADS
+    stop_input_threads();
+#endif
+
     /* at the end of stream, we must flush the decoder buffers */
     for(i=0;i<nb_istreams;i++) {
         ist = ist_table[i];
@@ -2333,6 +3300,12 @@ static int av_encode(AVFormatContext **output_files,
         }
     }
 
+#if HAVE_PTHREADS
+    for(i=0;i<nb_ostreams;i++)
+        stop_encoder_thread(ost_table[i]);
+    shared_frames_free();
+#endif
+
     term_exit();
 
     /* write the trailer if needed and close file */
@@ -2344,6 +3317,14 @@ static int av_encode(AVFormatContext **output_files,
     /* dump report by using the first video and audio streams */
     print_report(output_files, ost_table, nb_ostreams, 1);
 
+    if (show_stage_stats)
+        print_stage_stats(ist_table, nb_istreams, ost_table, nb_ostreams);
+    if (stage_stats_file) {
+        write_stage_stats(ist_table, nb_istreams, ost_table, nb_ostreams, 1);
+        fclose(stage_stats_file);
+        stage_stats_file = NULL;
+    }
+
     /* close each encoder */
     for(i=0;i<nb_ostreams;i++) {
         ost = ost_table[i];
@@ -2813,6 +3794,17 @@ static int opt_input_ts_offset(const char *opt, const char *arg)
     return 0;
 }
 
+static int opt_abr(const char *opt, const char *arg)
+{
+    abr_gop_duration = parse_time_or_die(opt, arg, 1);
+    if (abr_gop_duration <= 0) {
+        fprintf(stderr, "Invalid GOP duration: %s\n", arg);
+        av_exit(1);
+    }
+    use_pipeline = 1;
+    return 0;
+}
+
 static enum CodecID find_codec_or_die(const char *name, int type, int encoder)
 {
     const char *codec_string = encoder ? "encoder" : "decoder";
@@ -3350,6 +4342,7 @@ static void opt_output_file(const char *filename)
 {
     AVFormatContext *oc;
     int use_video, use_audio, use_subtitle;
+    int i;
     int input_has_video, input_has_audio, input_has_subtitle;
     AVFormatParameters params, *ap = &params;
     AVOutputFormat *file_oformat;
@@ -3492,6 +4485,15 @@ static void opt_output_file(const char *filename)
     oc->loop_output = loop_output;
     oc->flags |= AVFMT_FLAG_NONBLOCK;
 
+    /* expected duration, muxers may reserve room for their index with it */
+    if (recording_time != INT64_MAX) {
+        oc->duration = recording_time;
+    } else {
+        for (i = 0; i < nb_input_files; i++)
+            if (input_files[i]->duration != AV_NOPTS_VALUE)
+                oc->duration = FFMAX(oc->duration, input_files[i]->duration);
+    }
+
     set_context_opts(oc, avformat_opts, AV_OPT_FLAG_ENCODING_PARAM);
 }
 
@@ -3507,24 +4509,6 @@ static void opt_pass(const char *pass_str)
     do_pass = pass;
 }
 
-static int64_t getutime(void)
-{
-#if HAVE_GETRUSAGE
-    struct rusage rusage;
-
-    getrusage(RUSAGE_SELF, &rusage);
-    return (rusage.ru_utime.tv_sec * 1000000LL) + rusage.ru_utime.tv_usec;
-#elif HAVE_GETPROCESSTIMES
-    HANDLE proc;
-    FILETIME c, e, k, u;
-    proc = GetCurrentProcess();
-    GetProcessTimes(proc, &c, &e, &k, &u);
-    return ((int64_t) u.dwHighDateTime << 32 | u.dwLowDateTime) / 10;
-#else
-    return av_gettime();
-#endif
-}
-
 static void parse_matrix_coeffs(uint16_t *dest, const char *str)
 {
     int i;
@@ -3861,6 +4845,14 @@ static const OptionDef options[] = {
     { "timestamp", OPT_FUNC2 | HAS_ARG, {(void*)opt_rec_timestamp}, "set the timestamp ('now' to set the current time)", "time" },
     { "metadata", OPT_FUNC2 | HAS_ARG, {(void*)opt_metadata}, "add metadata", "string=string" },
     { "dframes", OPT_INT | HAS_ARG, {(void*)&max_frames[CODEC_TYPE_DATA]}, "set the number of data frames to record", "number" },
+    { "stage_stats", OPT_BOOL | OPT_EXPERT, {(void*)&show_stage_stats},
+      "print wall and CPU time of each transcoding stage per stream" },
+    { "stage_stats_file", HAS_ARG | OPT_STRING | OPT_EXPERT, {(void*)&stage_stats_filename},
+      "write the stage statistics as JSON to file", "file" },
+    { "stage_stats_period", HAS_ARG | OPT_FLOAT | OPT_EXPERT, {(void*)&stage_stats_period},
+      "also write the JSON stage statistics every period seconds", "period" },
+    { "perf", OPT_BOOL | OPT_EXPERT, {(void*)&do_perf},
+      "print the cycles spent in the instrumented library functions" },
     { "benchmark", OPT_BOOL | OPT_EXPERT, {(void*)&do_benchmark},
       "add timings for benchmarking" },
     { "dump", OPT_BOOL | OPT_EXPERT, {(void*)&do_pkt_dump},
@@ -3873,6 +4865,8 @@ static const OptionDef options[] = {
     { "v", HAS_ARG | OPT_FUNC2, {(void*)opt_verbose}, "set ffmpeg verbosity level", "number" },
     { "target", HAS_ARG, {(void*)opt_target}, "specify target file type (\"vcd\", \"svcd\", \"dvd\", \"dv\", \"dv50\", \"pal-vcd\", \"ntsc-svcd\", ...)", "type" },
     { "threads", OPT_FUNC2 | HAS_ARG | OPT_EXPERT, {(void*)opt_thread_count}, "thread count", "count" },
+    { "pipeline", OPT_BOOL | OPT_EXPERT, {(void*)&use_pipeline}, "demux, encode and mux on separate threads" },
+    { "abr", OPT_FUNC2 | HAS_ARG | OPT_EXPERT, {(void*)opt_abr}, "encode the outputs as a bitrate ladder with keyframes aligned every \"duration\" seconds, implies -pipeline", "duration" },
     { "vsync", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&video_sync_method}, "video sync method", "" },
     { "async", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&audio_sync_method}, "audio sync method", "" },
     { "adrift_threshold", HAS_ARG | OPT_FLOAT | OPT_EXPERT, {(void*)&audio_drift_threshold}, "audio drift threshold", "threshold" },
@@ -4012,6 +5006,7 @@ int main(int argc, char **argv)
         av_exit(1);
     }
 
+    av_perf_enable(do_perf);
     ti = getutime();
     if (av_encode(output_files, nb_output_files, input_files, nb_input_files,
                   stream_maps, nb_stream_maps) < 0)
@@ -4020,6 +5015,8 @@ int main(int argc, char **argv)
     if (do_benchmark) {
         printf("bench: utime=%0.3fs\n", ti / 1000000.0);
     }
+    if (do_perf)
+        av_perf_dump(NULL, AV_LOG_INFO);
 
     return av_exit(0);
 }
@@ -46,6 +46,20 @@
 #if HAVE_POLL_H
 #include <poll.h>
 #endif
+#if HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#endif
+#if HAVE_WRITEV
+#include <sys/uio.h>
+#endif
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#define USE_WORKERS (HAVE_PTHREADS && HAVE_EPOLL_CREATE)
+#if USE_WORKERS
+#include <pthread.h>
+#endif
 #include <errno.h>
 #include <sys/time.h>
 #undef time //needed because HAVE_AV_CONFIG_H is defined on top
@@ -104,6 +118,23 @@ static const char *http_state[] = {
 
 #define SYNC_TIMEOUT (10 * 1000)
 
+/* bitrate adaptation decides every ADAPT_INTERVAL ms. A client is tried
+   on a faster encoding after it kept up with the feed for ADAPT_HOLD_MIN
+   intervals, doubled up to ADAPT_HOLD_MAX each time it had to go down. */
+#define ADAPT_INTERVAL (5 * 1000)
+#define ADAPT_HOLD_MIN 2
+#define ADAPT_HOLD_MAX 32
+
+/* with epoll, connections without events are handled from a timer wheel
+   with slots of TIMER_RESOLUTION ms. Timers further away than the span
+   of the wheel are checked once per lap. */
+#define TIMER_RESOLUTION 10
+#define TIMER_WHEEL_SIZE 1024
+
+#define EPOLL_MAX_EVENTS 256
+#define ACCEPT_BATCH 64 /* connections accepted per event loop iteration */
+#define MAX_WORKERS 64
+
 typedef struct RTSPActionServerSetup {
     uint32_t ipaddr;
     char transport_option[512];
@@ -120,11 +151,17 @@ typedef struct HTTPContext {
     int fd; /* socket file descriptor */
     struct sockaddr_in from_addr; /* origin */
     struct pollfd *poll_entry; /* used when polling */
+    int revents; /* events returned by the last poll or epoll_wait */
+    int events;  /* events the socket is registered for with epoll */
+    int64_t timer; /* time at which to handle the connection without events */
+    struct HTTPContext *next_timer, **prev_timer;   /* timer wheel slot */
+    struct HTTPContext *next_active, **prev_active; /* connections to handle */
     int64_t timeout;
     uint8_t *buffer_ptr, *buffer_end;
     int http_error;
     int post;
-    struct HTTPContext *next;
+    struct HTTPContext *next, **prev;
+    struct WorkerThread *worker; /* thread serving the connection, NULL for the main loop */
     int got_key_frame; /* stream 0 => 1, stream 1 => 2, stream 2=> 4 */
     int64_t data_count;
     /* feed input */
@@ -140,12 +177,20 @@ typedef struct HTTPContext {
                                   packet */
     int pts_stream_index;        /* stream we choose as clock reference */
     int64_t cur_clock;           /* current clock reference value in us */
+    int key_frame;               /* the last muxed packet starts a key frame */
     /* output format handling */
     struct FFStream *stream;
+    struct SharedStream *shared; /* if set, output is taken from the shared stream */
+    struct OutputChunk *chunk;   /* shared output being sent */
+    int64_t chunk_seq;           /* sequence number of the next shared chunk */
     /* -1 is invalid stream */
     int feed_streams[MAX_STREAMS]; /* index of streams in the feed */
     int switch_feed_streams[MAX_STREAMS]; /* index of streams in the feed */
     int switch_pending;
+    int64_t adapt_time;   /* time of the last bitrate adaptation decision */
+    int adapt_wait;       /* consecutive intervals the client kept up */
+    int adapt_hold;       /* intervals to keep up before switching up */
+    int caught_up;        /* reached the end of the feed since adapt_time */
     AVFormatContext fmt_ctx; /* instance of FFStream for one user */
     int last_packet_sent; /* true if last data packet was sent */
     int suppress_log;
@@ -211,6 +256,7 @@ typedef struct FFStream {
     int prebuffer;      /* Number of millseconds early to start */
     int64_t max_time;      /* Number of milliseconds to run */
     int send_on_key;
+    int adaptive;       /* switch clients between encodings by their rate */
     AVStream *streams[MAX_STREAMS];
     int feed_streams[MAX_STREAMS]; /* index of streams in the feed */
     char feed_filename[1024]; /* file name of the feed storage, or
@@ -243,14 +289,78 @@ typedef struct FFStream {
     int64_t feed_max_size;      /* maximum storage size, zero means unlimited */
     int64_t feed_write_index;   /* current write position in feed (it wraps around) */
     int64_t feed_size;          /* current size of feed */
+    uint8_t *feed_map;          /* feed file mapped in memory, NULL if it is not */
+    int64_t feed_map_size;
     struct FFStream *next_feed;
+    struct SharedStream *shared; /* output muxed once for all clients */
 } FFStream;
 
+#define SHARED_RING_SIZE 512
+#define SHARED_IOV_MAX 32 /* shared chunks sent per system call */
+
+/* muxed output, referenced by the ring and by the connections sending it */
+typedef struct OutputChunk {
+    uint8_t *data;
+    int size;
+    int key_frame;
+    int refcount;
+} OutputChunk;
+
+/* live stream muxed once and sent to all its clients at their own pace,
+   protected by the server lock */
+typedef struct SharedStream {
+    HTTPContext *src;        /* reads and muxes the feed, NULL once it ended */
+    OutputChunk *header;
+    OutputChunk *ring[SHARED_RING_SIZE];
+    int64_t next_seq;        /* sequence number of the next chunk */
+    int64_t key_seq;         /* last chunk starting a key frame, -1 if none */
+    int eof;
+    int nb_clients;
+} SharedStream;
+
+/* formats whose output can be joined at any packet once the header is sent */
+static const char *shared_formats[] = {
+    "mpjpeg", "mpegts", "flv", "mpeg", "mp2", "mp3", "adts", NULL
+};
+
 typedef struct FeedData {
     long long data_count;
     float avg_frame_size;   /* frame size averaged over last frames with exponential mean */
 } FeedData;
 
+#if USE_WORKERS
+/* event loop of a thread serving HTTP streams, connections are passed
+   to it by the main loop once their request has been parsed */
+typedef struct WorkerThread {
+    pthread_t thread;
+    pthread_mutex_t lock;       /* held while the connections are handled */
+    pthread_mutex_t queue_lock; /* protects handoff and feed_updated */
+    int epoll_fd;
+    int wake_fds[2];            /* pipe waking the thread up */
+    int64_t cur_time;
+    HTTPContext *first_ctx;     /* connections served by the thread */
+    HTTPContext *first_active;  /* connections to handle in this iteration */
+    HTTPContext *handoff;       /* connections passed by the main loop */
+    int feed_updated;           /* a feed received data or was closed */
+} WorkerThread;
+
+static WorkerThread *workers;
+static int next_worker;
+
+/* protects the counters and feed positions shared with the workers */
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_mutex;
+#define server_lock()   pthread_mutex_lock(&server_mutex)
+#define server_unlock() pthread_mutex_unlock(&server_mutex)
+#define log_lock()      if (workers) pthread_mutex_lock(&log_mutex)
+#define log_unlock()    if (workers) pthread_mutex_unlock(&log_mutex)
+#else
+#define server_lock()
+#define server_unlock()
+#define log_lock()
+#define log_unlock()
+#endif
+
 static struct sockaddr_in my_http_addr;
 static struct sockaddr_in my_rtsp_addr;
 
@@ -259,15 +369,22 @@ static HTTPContext *first_http_ctx;
 static FFStream *first_feed;   /* contains only feeds */
 static FFStream *first_stream; /* contains all streams, including feeds */
 
-static void new_connection(int server_fd, int is_rtsp);
+static int new_connection(int server_fd, int is_rtsp);
 static void close_connection(HTTPContext *c);
 
 /* HTTP handling */
 static int handle_connection(HTTPContext *c);
+static int http_prepare_data(HTTPContext *c);
+static int shared_prepare_data(HTTPContext *c);
 static int http_parse_request(HTTPContext *c);
 static int http_send_data(HTTPContext *c);
 static void compute_status(HTTPContext *c);
+static int print_connections(ByteIOContext *pb, HTTPContext *c1, int i);
 static int open_input_stream(HTTPContext *c, const char *info);
+static int join_shared_stream(HTTPContext *c, const char *info);
+static void update_shared_streams(FFStream *feed);
+static void unref_chunk(OutputChunk *chunk);
+static int feed_data_pending(HTTPContext *c);
 static int http_start_receive_data(HTTPContext *c);
 static int http_receive_data(HTTPContext *c);
 
@@ -306,6 +423,8 @@ static unsigned int nb_max_http_connections = 2000;
 static unsigned int nb_max_connections = 5;
 static unsigned int nb_connections;
 
+static int nb_workers; /* threads serving HTTP streams besides the main loop */
+
 static uint64_t max_bandwidth = 1000;
 static uint64_t current_bandwidth;
 
@@ -333,6 +452,7 @@ static void http_vlog(const char *fmt, va_list vargs)
 {
     static int print_prefix = 1;
     if (logfile) {
+        log_lock();
         if (print_prefix) {
             char buf[32];
             ctime1(buf);
@@ -341,6 +461,7 @@ static void http_vlog(const char *fmt, va_list vargs)
         print_prefix = strstr(fmt, "\n") != NULL;
         vfprintf(logfile, fmt, vargs);
         fflush(logfile);
+        log_unlock();
     }
 }
 
@@ -358,10 +479,12 @@ static void http_av_log(void *ptr, int level, const char *fmt, va_list vargs)
     AVClass *avc = ptr ? *(AVClass**)ptr : NULL;
     if (level > av_log_get_level())
         return;
+    log_lock();
     if (print_prefix && avc)
         http_log("[%s @ %p]", avc->item_name(ptr), ptr);
     print_prefix = strstr(fmt, "\n") != NULL;
     http_vlog(fmt, vargs);
+    log_unlock();
 }
 
 static void log_connection(HTTPContext *c)
@@ -374,26 +497,36 @@ static void log_connection(HTTPContext *c)
              c->protocol, (c->http_error ? c->http_error : 200), c->data_count);
 }
 
-static void update_datarate(DataRateData *drd, int64_t count)
+/* current time of the thread serving the connection */
+static int64_t connection_time(HTTPContext *c)
+{
+#if USE_WORKERS
+    if (c->worker)
+        return c->worker->cur_time;
+#endif
+    return cur_time;
+}
+
+static void update_datarate(DataRateData *drd, int64_t count, int64_t time)
 {
     if (!drd->time1 && !drd->count1) {
-        drd->time1 = drd->time2 = cur_time;
+        drd->time1 = drd->time2 = time;
         drd->count1 = drd->count2 = count;
-    } else if (cur_time - drd->time2 > 5000) {
+    } else if (time - drd->time2 > 5000) {
         drd->time1 = drd->time2;
         drd->count1 = drd->count2;
-        drd->time2 = cur_time;
+        drd->time2 = time;
         drd->count2 = count;
     }
 }
 
 /* In bytes per second */
-static int compute_datarate(DataRateData *drd, int64_t count)
+static int compute_datarate(DataRateData *drd, int64_t count, int64_t time)
 {
-    if (cur_time == drd->time1)
+    if (time == drd->time1)
         return 0;
 
-    return ((count - drd->count1) * 1000) / (cur_time - drd->time1);
+    return ((count - drd->count1) * 1000) / (time - drd->time1);
 }
 
 
@@ -481,7 +614,7 @@ static int socket_open_listen(struct sockaddr_in *my_addr)
         return -1;
     }
 
-    if (listen (server_fd, 5) < 0) {
+    if (listen (server_fd, SOMAXCONN) < 0) {
         perror ("listen");
         closesocket(server_fd);
         return -1;
@@ -491,6 +624,200 @@ static int socket_open_listen(struct sockaddr_in *my_addr)
     return server_fd;
 }
 
+static void add_connection(HTTPContext *c)
+{
+    c->next = first_http_ctx;
+    c->prev = &first_http_ctx;
+    if (first_http_ctx)
+        first_http_ctx->prev = &c->next;
+    first_http_ctx = c;
+}
+
+/* events to wait for on the socket of a connection in its current state */
+static int poll_events(HTTPContext *c)
+{
+    switch(c->state) {
+    case HTTPSTATE_SEND_HEADER:
+    case RTSPSTATE_SEND_REPLY:
+    case RTSPSTATE_SEND_PACKET:
+    /* for TCP, we output as much as we can (may need to put a limit) */
+    case HTTPSTATE_SEND_DATA_HEADER:
+    case HTTPSTATE_SEND_DATA:
+    case HTTPSTATE_SEND_DATA_TRAILER:
+        return POLLOUT;
+    case HTTPSTATE_WAIT_REQUEST:
+    case HTTPSTATE_RECEIVE_DATA:
+    case HTTPSTATE_WAIT_FEED:
+    case RTSPSTATE_WAIT_REQUEST:
+        /* need to catch errors */
+        return POLLIN;/* Maybe this will work */
+    default:
+        return 0;
+    }
+}
+
+/* when ffserver is doing the timing, we work by looking at which packet
+   need to be sent every 10 ms */
+static int is_ticking(HTTPContext *c)
+{
+    return c->is_packetized &&
+           (c->state == HTTPSTATE_SEND_DATA_HEADER ||
+            c->state == HTTPSTATE_SEND_DATA ||
+            c->state == HTTPSTATE_SEND_DATA_TRAILER);
+}
+
+#if HAVE_EPOLL_CREATE
+static int epoll_fd = -1;
+static HTTPContext *timer_wheel[TIMER_WHEEL_SIZE];
+static int64_t timer_wheel_time; /* start of the first slot not run to completion */
+static HTTPContext *first_active; /* connections to handle in this iteration */
+
+#define TIMER_SLOT(t) (&timer_wheel[((t) / TIMER_RESOLUTION) & (TIMER_WHEEL_SIZE - 1)])
+
+static void clear_timer(HTTPContext *c)
+{
+    if (!c->prev_timer)
+        return;
+    if (c->next_timer)
+        c->next_timer->prev_timer = c->prev_timer;
+    *c->prev_timer = c->next_timer;
+    c->prev_timer = NULL;
+}
+
+static void set_timer(HTTPContext *c, int64_t time)
+{
+    HTTPContext **slot;
+
+    clear_timer(c);
+    c->timer = FFMAX(time, timer_wheel_time);
+    slot = TIMER_SLOT(c->timer);
+    c->next_timer = *slot;
+    if (*slot)
+        (*slot)->prev_timer = &c->next_timer;
+    c->prev_timer = slot;
+    *slot = c;
+}
+
+static void activate_connection(HTTPContext *c, HTTPContext **first)
+{
+    if (c->prev_active)
+        return;
+    c->next_active = *first;
+    c->prev_active = first;
+    if (*first)
+        (*first)->prev_active = &c->next_active;
+    *first = c;
+}
+
+static void deactivate_connection(HTTPContext *c)
+{
+    if (!c->prev_active)
+        return;
+    if (c->next_active)
+        c->next_active->prev_active = c->prev_active;
+    *c->prev_active = c->next_active;
+    c->prev_active = NULL;
+}
+
+/* activate the connections whose timer expired */
+static void run_timers(void)
+{
+    HTTPContext *c, *c_next;
+    int64_t t;
+    int i;
+
+    for (i = 0, t = timer_wheel_time; i < TIMER_WHEEL_SIZE && t <= cur_time;
+         i++, t += TIMER_RESOLUTION) {
+        for (c = *TIMER_SLOT(t); c; c = c_next) {
+            c_next = c->next_timer;
+            if (c->timer <= cur_time) {
+                clear_timer(c);
+                activate_connection(c, &first_active);
+            }
+        }
+    }
+    /* the current slot may still hold timers that have not expired */
+    timer_wheel_time = cur_time - cur_time % TIMER_RESOLUTION;
+}
+
+/* time until the end of the first slot holding a timer, at most a second
+   so that the children are restarted in time */
+static int next_timer_delay(void)
+{
+    int64_t t;
+
+    for (t = timer_wheel_time; t < cur_time + 1000; t += TIMER_RESOLUTION)
+        if (*TIMER_SLOT(t))
+            return FFMAX(t + TIMER_RESOLUTION - cur_time, 0);
+    return 1000;
+}
+
+/* update the epoll registration and the timer of a connection after its
+   state changed */
+static void poll_update(HTTPContext *c)
+{
+    struct epoll_event ev;
+    int events, fd = epoll_fd;
+
+    if (epoll_fd < 0)
+        return;
+#if USE_WORKERS
+    if (c->worker)
+        fd = c->worker->epoll_fd;
+#endif
+
+    events = c->fd >= 0 && !is_ticking(c) ? poll_events(c) : 0;
+    if (events != c->events) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = (events & POLLIN  ? EPOLLIN  : 0) |
+                      (events & POLLOUT ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        /* errors are always reported for registered sockets, so remove
+           the socket while nothing is waited for */
+        epoll_ctl(fd, !events ? EPOLL_CTL_DEL :
+                      c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+        c->events = events;
+    }
+
+    /* the timer wheel belongs to the main loop, worker threads only
+       serve streams that need no timer */
+    if (c->worker)
+        return;
+    if (is_ticking(c))
+        set_timer(c, cur_time + TIMER_RESOLUTION);
+    else if (c->state == HTTPSTATE_WAIT_REQUEST ||
+             c->state == RTSPSTATE_WAIT_REQUEST)
+        set_timer(c, c->timeout);
+    else
+        clear_timer(c);
+}
+
+/* convert the events reported by epoll for a connection */
+static void set_revents(HTTPContext *c, uint32_t events)
+{
+    c->revents = (events & EPOLLIN  ? POLLIN  : 0) |
+                 (events & EPOLLOUT ? POLLOUT : 0) |
+                 (events & EPOLLERR ? POLLERR : 0) |
+                 (events & EPOLLHUP ? POLLHUP : 0);
+}
+
+/* every connection needs a file descriptor */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    rlim_t needed = nb_max_connections + 64;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= needed)
+        return;
+    rl.rlim_cur = FFMIN(needed, rl.rlim_max);
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < needed)
+        http_log("Only %d file descriptors available for %d clients\n",
+                 (int)rl.rlim_cur, nb_max_connections);
+}
+#else
+#define poll_update(c)
+#endif
+
 /* start all multicast streams */
 static void start_multicast(void)
 {
@@ -542,15 +869,15 @@ static void start_multicast(void)
 
             /* change state to send data */
             rtp_c->state = HTTPSTATE_SEND_DATA;
+            poll_update(rtp_c);
         }
     }
 }
 
-/* main loop of the http server */
-static int http_server(void)
+/* event loop polling the sockets of all connections on each iteration */
+static int poll_loop(int server_fd, int rtsp_server_fd)
 {
-    int server_fd = 0, rtsp_server_fd = 0;
-    int ret, delay, delay1;
+    int ret, delay, delay1, events;
     struct pollfd *poll_table, *poll_entry;
     HTTPContext *c, *c_next;
 
@@ -559,29 +886,6 @@ static int http_server(void)
         return -1;
     }
 
-    if (my_http_addr.sin_port) {
-        server_fd = socket_open_listen(&my_http_addr);
-        if (server_fd < 0)
-            return -1;
-    }
-
-    if (my_rtsp_addr.sin_port) {
-        rtsp_server_fd = socket_open_listen(&my_rtsp_addr);
-        if (rtsp_server_fd < 0)
-            return -1;
-    }
-
-    if (!rtsp_server_fd && !server_fd) {
-        http_log("HTTP and RTSP disabled.\n");
-        return -1;
-    }
-
-    http_log("FFserver started.\n");
-
-    start_children(first_feed);
-
-    start_multicast();
-
     for(;;) {
         poll_entry = poll_table;
         if (server_fd) {
@@ -599,48 +903,16 @@ static int http_server(void)
         c = first_http_ctx;
         delay = 1000;
         while (c != NULL) {
-            int fd;
-            fd = c->fd;
-            switch(c->state) {
-            case HTTPSTATE_SEND_HEADER:
-            case RTSPSTATE_SEND_REPLY:
-            case RTSPSTATE_SEND_PACKET:
-                c->poll_entry = poll_entry;
-                poll_entry->fd = fd;
-                poll_entry->events = POLLOUT;
-                poll_entry++;
-                break;
-            case HTTPSTATE_SEND_DATA_HEADER:
-            case HTTPSTATE_SEND_DATA:
-            case HTTPSTATE_SEND_DATA_TRAILER:
-                if (!c->is_packetized) {
-                    /* for TCP, we output as much as we can (may need to put a limit) */
-                    c->poll_entry = poll_entry;
-                    poll_entry->fd = fd;
-                    poll_entry->events = POLLOUT;
-                    poll_entry++;
-                } else {
-                    /* when ffserver is doing the timing, we work by
-                       looking at which packet need to be sent every
-                       10 ms */
-                    delay1 = 10; /* one tick wait XXX: 10 ms assumed */
-                    if (delay1 < delay)
-                        delay = delay1;
-                }
-                break;
-            case HTTPSTATE_WAIT_REQUEST:
-            case HTTPSTATE_RECEIVE_DATA:
-            case HTTPSTATE_WAIT_FEED:
-            case RTSPSTATE_WAIT_REQUEST:
-                /* need to catch errors */
+            c->poll_entry = NULL;
+            if (is_ticking(c)) {
+                delay1 = 10; /* one tick wait XXX: 10 ms assumed */
+                if (delay1 < delay)
+                    delay = delay1;
+            } else if ((events = poll_events(c))) {
                 c->poll_entry = poll_entry;
-                poll_entry->fd = fd;
-                poll_entry->events = POLLIN;/* Maybe this will work */
+                poll_entry->fd = c->fd;
+                poll_entry->events = events;
                 poll_entry++;
-                break;
-            default:
-                c->poll_entry = NULL;
-                break;
             }
             c = c->next;
         }
@@ -664,6 +936,7 @@ static int http_server(void)
         /* now handle the events */
         for(c = first_http_ctx; c != NULL; c = c_next) {
             c_next = c->next;
+            c->revents = c->poll_entry ? c->poll_entry->revents : 0;
             if (handle_connection(c) < 0) {
                 /* close and free the connection */
                 log_connection(c);
@@ -686,6 +959,328 @@ static int http_server(void)
     }
 }
 
+#if !USE_WORKERS
+#define can_handoff(c) 0
+#define handoff_connection(c)
+#define notify_workers()
+#endif
+
+#if HAVE_EPOLL_CREATE
+#if USE_WORKERS
+/* HTTP streams are served by the worker threads once the request has
+   been parsed, everything else stays in the main loop */
+static int can_handoff(HTTPContext *c)
+{
+    return workers && !c->worker &&
+           c->state == HTTPSTATE_SEND_HEADER && !c->http_error && !c->post &&
+           c->stream && c->stream->stream_type == STREAM_TYPE_LIVE &&
+           !c->is_packetized && !c->wmp_client_id;
+}
+
+static void wake_worker(WorkerThread *w)
+{
+    /* if the pipe is full, the thread is woken up anyway */
+    if (write(w->wake_fds[1], "", 1) < 0 && errno != EAGAIN)
+        http_log("Could not wake up worker thread: %s\n", strerror(errno));
+}
+
+/* pass a connection from the main loop to a worker thread */
+static void handoff_connection(HTTPContext *c)
+{
+    WorkerThread *w = &workers[next_worker];
+
+    next_worker = (next_worker + 1) % nb_workers;
+
+    if (c->next)
+        c->next->prev = c->prev;
+    *c->prev = c->next;
+    clear_timer(c);
+    if (c->events) {
+        struct epoll_event ev;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, &ev);
+        c->events = 0;
+    }
+    c->worker = w;
+
+    pthread_mutex_lock(&w->queue_lock);
+    c->next = w->handoff;
+    w->handoff = c;
+    pthread_mutex_unlock(&w->queue_lock);
+    wake_worker(w);
+}
+
+/* wake up the connections of the workers waiting for a feed */
+static void notify_workers(void)
+{
+    int i, notify;
+
+    for (i = 0; workers && i < nb_workers; i++) {
+        pthread_mutex_lock(&workers[i].queue_lock);
+        notify = !workers[i].feed_updated;
+        workers[i].feed_updated = 1;
+        pthread_mutex_unlock(&workers[i].queue_lock);
+        if (notify)
+            wake_worker(&workers[i]);
+    }
+}
+#endif
+
+/* handle and update the connections of an active list */
+static void handle_active_connections(HTTPContext **first)
+{
+    HTTPContext *c;
+    int ret;
+
+    while ((c = *first)) {
+        deactivate_connection(c);
+        ret = handle_connection(c);
+        c->revents = 0;
+        if (ret < 0) {
+            /* close and free the connection */
+            log_connection(c);
+            close_connection(c);
+        } else if (can_handoff(c))
+            handoff_connection(c);
+        else
+            poll_update(c);
+    }
+}
+
+#if USE_WORKERS
+static void *worker_thread(void *arg)
+{
+    WorkerThread *w = arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    HTTPContext *c, *c_next, *handoff;
+    int i, n, feed_updated;
+    char buf[64];
+
+    pthread_mutex_lock(&w->lock);
+    for(;;) {
+        pthread_mutex_unlock(&w->lock);
+        n = epoll_wait(w->epoll_fd, events, EPOLL_MAX_EVENTS, 1000);
+        pthread_mutex_lock(&w->lock);
+
+        w->cur_time = av_gettime() / 1000;
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == w) {
+                while (read(w->wake_fds[0], buf, sizeof(buf)) > 0);
+            } else {
+                c = events[i].data.ptr;
+                set_revents(c, events[i].events);
+                activate_connection(c, &w->first_active);
+            }
+        }
+
+        pthread_mutex_lock(&w->queue_lock);
+        handoff = w->handoff;
+        feed_updated = w->feed_updated;
+        w->handoff = NULL;
+        w->feed_updated = 0;
+        pthread_mutex_unlock(&w->queue_lock);
+
+        for (c = handoff; c; c = c_next) {
+            c_next = c->next;
+            c->next = w->first_ctx;
+            c->prev = &w->first_ctx;
+            if (w->first_ctx)
+                w->first_ctx->prev = &c->next;
+            w->first_ctx = c;
+            poll_update(c);
+        }
+
+        if (feed_updated) {
+            for (c = w->first_ctx; c; c = c->next) {
+                if (c->state == HTTPSTATE_WAIT_FEED && feed_data_pending(c)) {
+                    c->state = HTTPSTATE_SEND_DATA;
+                    poll_update(c);
+                }
+            }
+        }
+
+        handle_active_connections(&w->first_active);
+    }
+    return NULL;
+}
+
+static int lockmgr(void **mutex, enum AVLockOp op)
+{
+    pthread_mutex_t **m = (pthread_mutex_t **)mutex;
+
+    switch (op) {
+    case AV_LOCK_CREATE:
+        if (!(*m = av_malloc(sizeof(pthread_mutex_t))))
+            return -1;
+        return pthread_mutex_init(*m, NULL) ? -1 : 0;
+    case AV_LOCK_OBTAIN:
+        return pthread_mutex_lock(*m) ? -1 : 0;
+    case AV_LOCK_RELEASE:
+        return pthread_mutex_unlock(*m) ? -1 : 0;
+    case AV_LOCK_DESTROY:
+        pthread_mutex_destroy(*m);
+        av_freep(m);
+        return 0;
+    }
+    return -1;
+}
+
+static void start_workers(void)
+{
+    pthread_mutexattr_t attr;
+    struct epoll_event ev;
+    WorkerThread *w;
+    int i;
+
+    if (!(workers = av_mallocz(nb_workers * sizeof(*workers)))) {
+        nb_workers = 0;
+        return;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&log_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    av_lockmgr_register(lockmgr);
+
+    for (i = 0; i < nb_workers; i++) {
+        w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_mutex_init(&w->queue_lock, NULL);
+        w->cur_time = cur_time;
+        if ((w->epoll_fd = epoll_create(nb_max_connections / nb_workers + 1)) < 0 ||
+            pipe(w->wake_fds) < 0) {
+            http_log("Could not create worker thread: %s\n", strerror(errno));
+            exit(1);
+        }
+        ff_socket_nonblock(w->wake_fds[0], 1);
+        ff_socket_nonblock(w->wake_fds[1], 1);
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = w;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fds[0], &ev);
+        if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+            http_log("Could not create worker thread\n");
+            exit(1);
+        }
+    }
+    http_log("%d worker threads started\n", nb_workers);
+}
+#endif
+
+/* event loop handling only the connections with events or expired timers */
+static int epoll_loop(int server_fd, int rtsp_server_fd)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS], ev;
+    HTTPContext *c;
+    int i, n, new_http, new_rtsp;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (server_fd) {
+        ev.data.ptr = &server_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+    }
+    if (rtsp_server_fd) {
+        ev.data.ptr = &rtsp_server_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rtsp_server_fd, &ev);
+    }
+
+    for(;;) {
+        n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, next_timer_delay());
+        if (n < 0) {
+            if (ff_neterrno() != FF_NETERROR(EAGAIN) &&
+                ff_neterrno() != FF_NETERROR(EINTR))
+                return -1;
+            n = 0;
+        }
+
+        cur_time = av_gettime() / 1000;
+
+        if (need_to_start_children) {
+            need_to_start_children = 0;
+            start_children(first_feed);
+        }
+
+        new_http = new_rtsp = 0;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &server_fd) {
+                new_http = 1;
+            } else if (events[i].data.ptr == &rtsp_server_fd) {
+                new_rtsp = 1;
+            } else {
+                c = events[i].data.ptr;
+                set_revents(c, events[i].events);
+                activate_connection(c, &first_active);
+            }
+        }
+        run_timers();
+
+        /* now handle the events */
+        handle_active_connections(&first_active);
+
+        for (i = 0; new_http && i < ACCEPT_BATCH; i++)
+            if (new_connection(server_fd, 0) < 0)
+                break;
+        for (i = 0; new_rtsp && i < ACCEPT_BATCH; i++)
+            if (new_connection(rtsp_server_fd, 1) < 0)
+                break;
+    }
+}
+#endif
+
+/* main loop of the http server */
+static int http_server(void)
+{
+    int server_fd = 0, rtsp_server_fd = 0;
+
+    if (my_http_addr.sin_port) {
+        server_fd = socket_open_listen(&my_http_addr);
+        if (server_fd < 0)
+            return -1;
+    }
+
+    if (my_rtsp_addr.sin_port) {
+        rtsp_server_fd = socket_open_listen(&my_rtsp_addr);
+        if (rtsp_server_fd < 0)
+            return -1;
+    }
+
+    if (!rtsp_server_fd && !server_fd) {
+        http_log("HTTP and RTSP disabled.\n");
+        return -1;
+    }
+
+    cur_time = av_gettime() / 1000;
+#if HAVE_EPOLL_CREATE
+    epoll_fd = epoll_create(nb_max_connections + 2);
+    if (epoll_fd < 0)
+        http_log("epoll_create failed: %s, using poll\n", strerror(errno));
+    else
+        raise_fd_limit();
+    timer_wheel_time = cur_time - cur_time % TIMER_RESOLUTION;
+    if (epoll_fd < 0)
+        nb_workers = 0;
+#endif
+
+    http_log("FFserver started.\n");
+
+    start_children(first_feed);
+
+    start_multicast();
+
+#if USE_WORKERS
+    if (nb_workers)
+        start_workers();
+#endif
+
+#if HAVE_EPOLL_CREATE
+    if (epoll_fd >= 0)
+        return epoll_loop(server_fd, rtsp_server_fd);
+#endif
+    return poll_loop(server_fd, rtsp_server_fd);
+}
+
 /* start waiting for a new HTTP/RTSP request */
 static void start_wait_request(HTTPContext *c, int is_rtsp)
 {
@@ -717,7 +1312,8 @@ static void http_send_too_busy_reply(int fd)
 }
 
 
-static void new_connection(int server_fd, int is_rtsp)
+/* accept a new connection, return -1 if there was none to accept */
+static int new_connection(int server_fd, int is_rtsp)
 {
     struct sockaddr_in from_addr;
     int fd, len;
@@ -727,15 +1323,20 @@ static void new_connection(int server_fd, int is_rtsp)
     fd = accept(server_fd, (struct sockaddr *)&from_addr,
                 &len);
     if (fd < 0) {
-        http_log("error during accept %s\n", strerror(errno));
-        return;
+        if (ff_neterrno() != FF_NETERROR(EAGAIN))
+            http_log("error during accept %s\n", strerror(errno));
+        return -1;
     }
     ff_socket_nonblock(fd, 1);
 
+    server_lock();
     if (nb_connections >= nb_max_connections) {
+        server_unlock();
         http_send_too_busy_reply(fd);
         goto fail;
     }
+    nb_connections++;
+    server_unlock();
 
     /* add a new connection */
     c = av_mallocz(sizeof(HTTPContext));
@@ -750,44 +1351,49 @@ static void new_connection(int server_fd, int is_rtsp)
     if (!c->buffer)
         goto fail;
 
-    c->next = first_http_ctx;
-    first_http_ctx = c;
-    nb_connections++;
+    add_connection(c);
 
     start_wait_request(c, is_rtsp);
+    poll_update(c);
 
-    return;
+    return 0;
 
  fail:
     if (c) {
         av_free(c->buffer);
         av_free(c);
+        server_lock();
+        nb_connections--;
+        server_unlock();
     }
     closesocket(fd);
+    return 0;
 }
 
 static void close_connection(HTTPContext *c)
 {
-    HTTPContext **cp, *c1;
+    HTTPContext *c1;
     int i, nb_streams;
     AVFormatContext *ctx;
     URLContext *h;
     AVStream *st;
 
     /* remove connection from list */
-    cp = &first_http_ctx;
-    while ((*cp) != NULL) {
-        c1 = *cp;
-        if (c1 == c)
-            *cp = c->next;
-        else
-            cp = &c1->next;
-    }
+    if (c->next)
+        c->next->prev = c->prev;
+    *c->prev = c->next;
+#if HAVE_EPOLL_CREATE
+    clear_timer(c);
+    deactivate_connection(c);
+#endif
 
-    /* remove references, if any (XXX: do it faster) */
-    for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
-        if (c1->rtsp_c == c)
-            c1->rtsp_c = NULL;
+    /* remove references, if any (XXX: do it faster), only RTSP
+       connections are referenced */
+    if (c->state >= RTSPSTATE_WAIT_REQUEST) {
+        for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
+            if (c1->rtsp_c == c)
+                c1->rtsp_c = NULL;
+        }
     }
 
     /* remove connection associated resources */
@@ -835,8 +1441,11 @@ static void close_connection(HTTPContext *c)
     for(i=0; i<ctx->nb_streams; i++)
         av_free(ctx->streams[i]);
 
+    server_lock();
     if (c->stream && !c->post && c->stream->stream_type == STREAM_TYPE_LIVE)
         current_bandwidth -= c->stream->bandwidth;
+    nb_connections--;
+    server_unlock();
 
     /* signal that there is no feed if we are the feeder socket */
     if (c->state == HTTPSTATE_RECEIVE_DATA && c->stream) {
@@ -844,11 +1453,17 @@ static void close_connection(HTTPContext *c)
         close(c->feed_fd);
     }
 
+    if (c->shared) {
+        server_lock();
+        unref_chunk(c->chunk);
+        c->shared->nb_clients--;
+        server_unlock();
+    }
+
     av_freep(&c->pb_buffer);
     av_freep(&c->packet_buffer);
     av_free(c->buffer);
     av_free(c);
-    nb_connections--;
 }
 
 static int handle_connection(HTTPContext *c)
@@ -861,11 +1476,11 @@ static int handle_connection(HTTPContext *c)
         /* timeout ? */
         if ((c->timeout - cur_time) < 0)
             return -1;
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
 
         /* no need to read if no events */
-        if (!(c->poll_entry->revents & POLLIN))
+        if (!(c->revents & POLLIN))
             return 0;
         /* read the data */
     read_loop:
@@ -899,11 +1514,11 @@ static int handle_connection(HTTPContext *c)
         break;
 
     case HTTPSTATE_SEND_HEADER:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
 
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
         if (len < 0) {
@@ -915,8 +1530,11 @@ static int handle_connection(HTTPContext *c)
             }
         } else {
             c->buffer_ptr += len;
-            if (c->stream)
+            if (c->stream) {
+                server_lock();
                 c->stream->bytes_served += len;
+                server_unlock();
+            }
             c->data_count += len;
             if (c->buffer_ptr >= c->buffer_end) {
                 av_freep(&c->pb_buffer);
@@ -937,11 +1555,11 @@ static int handle_connection(HTTPContext *c)
            input streams sets the speed). It may be better to verify
            that we do not rely too much on the kernel queues */
         if (!c->is_packetized) {
-            if (c->poll_entry->revents & (POLLERR | POLLHUP))
+            if (c->revents & (POLLERR | POLLHUP))
                 return -1;
 
             /* no need to read if no events */
-            if (!(c->poll_entry->revents & POLLOUT))
+            if (!(c->revents & POLLOUT))
                 return 0;
         }
         if (http_send_data(c) < 0)
@@ -952,28 +1570,28 @@ static int handle_connection(HTTPContext *c)
         break;
     case HTTPSTATE_RECEIVE_DATA:
         /* no need to read if no events */
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
-        if (!(c->poll_entry->revents & POLLIN))
+        if (!(c->revents & POLLIN))
             return 0;
         if (http_receive_data(c) < 0)
             return -1;
         break;
     case HTTPSTATE_WAIT_FEED:
         /* no need to read if no events */
-        if (c->poll_entry->revents & (POLLIN | POLLERR | POLLHUP))
+        if (c->revents & (POLLIN | POLLERR | POLLHUP))
             return -1;
 
         /* nothing to do, we'll be waken up by incoming feed packets */
         break;
 
     case RTSPSTATE_SEND_REPLY:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP)) {
+        if (c->revents & (POLLERR | POLLHUP)) {
             av_freep(&c->pb_buffer);
             return -1;
         }
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
         if (len < 0) {
@@ -994,12 +1612,12 @@ static int handle_connection(HTTPContext *c)
         }
         break;
     case RTSPSTATE_SEND_PACKET:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP)) {
+        if (c->revents & (POLLERR | POLLHUP)) {
             av_freep(&c->packet_buffer);
             return -1;
         }
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->packet_buffer_ptr,
                     c->packet_buffer_end - c->packet_buffer_ptr, 0);
@@ -1081,40 +1699,134 @@ static int find_stream_in_feed(FFStream *feed, AVCodecContext *codec, int bit_ra
     int best_bitrate = 100000000;
     int best = -1;
 
-    for (i = 0; i < feed->nb_streams; i++) {
-        AVCodecContext *feed_codec = feed->streams[i]->codec;
+    for (i = 0; i < feed->nb_streams; i++) {
+        AVCodecContext *feed_codec = feed->streams[i]->codec;
+
+        if (feed_codec->codec_id != codec->codec_id ||
+            feed_codec->sample_rate != codec->sample_rate ||
+            feed_codec->width != codec->width ||
+            feed_codec->height != codec->height)
+            continue;
+
+        /* Potential stream */
+
+        /* We want the fastest stream less than bit_rate, or the slowest
+         * faster than bit_rate
+         */
+
+        if (feed_codec->bit_rate <= bit_rate) {
+            if (best_bitrate > bit_rate || feed_codec->bit_rate > best_bitrate) {
+                best_bitrate = feed_codec->bit_rate;
+                best = i;
+            }
+        } else {
+            if (feed_codec->bit_rate < best_bitrate) {
+                best_bitrate = feed_codec->bit_rate;
+                best = i;
+            }
+        }
+    }
+
+    return best;
+}
+
+/* the slowest encoding faster than bit_rate and not faster than max_bit_rate */
+static int find_faster_stream_in_feed(FFStream *feed, AVCodecContext *codec,
+                                      int bit_rate, int max_bit_rate)
+{
+    int i;
+    int best = -1;
+
+    for (i = 0; i < feed->nb_streams; i++) {
+        AVCodecContext *feed_codec = feed->streams[i]->codec;
+
+        if (feed_codec->codec_id != codec->codec_id ||
+            feed_codec->sample_rate != codec->sample_rate ||
+            feed_codec->width != codec->width ||
+            feed_codec->height != codec->height)
+            continue;
+
+        if (feed_codec->bit_rate > bit_rate && feed_codec->bit_rate <= max_bit_rate &&
+            (best < 0 || feed_codec->bit_rate < feed->streams[best]->codec->bit_rate))
+            best = i;
+    }
+
+    return best;
+}
+
+/* check that the packets of feed stream b can follow those of feed stream a
+   in the same output stream */
+static int can_switch_stream(FFStream *feed, int a, int b)
+{
+    AVCodecContext *ca = feed->streams[a]->codec;
+    AVCodecContext *cb = feed->streams[b]->codec;
+
+    return ca->codec_id       == cb->codec_id    &&
+           ca->sample_rate    == cb->sample_rate &&
+           ca->channels       == cb->channels    &&
+           ca->width          == cb->width       &&
+           ca->height         == cb->height      &&
+           ca->extradata_size == cb->extradata_size &&
+           (!ca->extradata_size ||
+            !memcmp(ca->extradata, cb->extradata, ca->extradata_size));
+}
+
+/* server driven bitrate adaptation: a client which did not keep up with the
+   feed and took data slower than the bitrate it is sent goes down to the
+   encodings matching its rate, a client which kept up long enough is tried
+   on the next faster ones, up to those of its stream. The switch itself
+   happens at the next key frame of the new encoding. */
+static void adapt_stream(HTTPContext *c, int64_t now)
+{
+    FFStream *req = c->stream;
+    FFStream *feed = req->feed;
+    int64_t rate, bitrate = 0;
+    int i, j, down, up;
 
-        if (feed_codec->codec_id != codec->codec_id ||
-            feed_codec->sample_rate != codec->sample_rate ||
-            feed_codec->width != codec->width ||
-            feed_codec->height != codec->height)
-            continue;
+    for (i = 0; i < req->nb_streams; i++) {
+        if (c->feed_streams[i] >= 0)
+            bitrate += feed->streams[c->feed_streams[i]]->codec->bit_rate;
+    }
+    rate = compute_datarate(&c->datarate, c->data_count, now) * 8LL;
 
-        /* Potential stream */
+    if (c->caught_up)
+        c->adapt_wait++;
+    else
+        c->adapt_wait = 0;
+    down = !c->caught_up && rate < bitrate;
+    up   = c->adapt_wait >= c->adapt_hold;
+    c->adapt_time = now;
+    c->caught_up  = 0;
+    if (!bitrate || (!down && !up))
+        return;
 
-        /* We want the fastest stream less than bit_rate, or the slowest
-         * faster than bit_rate
-         */
+    for (i = 0; i < req->nb_streams; i++) {
+        AVCodecContext *codec = req->streams[i]->codec;
+        int cur = c->feed_streams[i];
 
-        if (feed_codec->bit_rate <= bit_rate) {
-            if (best_bitrate > bit_rate || feed_codec->bit_rate > best_bitrate) {
-                best_bitrate = feed_codec->bit_rate;
-                best = i;
-            }
-        } else {
-            if (feed_codec->bit_rate < best_bitrate) {
-                best_bitrate = feed_codec->bit_rate;
-                best = i;
-            }
+        if (cur < 0)
+            continue;
+        if (down)
+            j = find_stream_in_feed(feed, codec,
+                                    feed->streams[cur]->codec->bit_rate * rate / bitrate);
+        else
+            j = find_faster_stream_in_feed(feed, codec,
+                                           feed->streams[cur]->codec->bit_rate,
+                                           feed->streams[req->feed_streams[i]]->codec->bit_rate);
+        if (j >= 0 && j != cur && can_switch_stream(feed, cur, j)) {
+            c->switch_feed_streams[i] = j;
+            c->switch_pending = 1;
         }
     }
-
-    return best;
+    if (down && c->switch_pending)
+        c->adapt_hold = FFMIN(c->adapt_hold * 2, ADAPT_HOLD_MAX);
+    if (up)
+        c->adapt_wait = 0;
 }
 
 static int modify_current_stream(HTTPContext *c, char *rates)
 {
-    int i;
+    int i, j;
     FFStream *req = c->stream;
     int action_required = 0;
 
@@ -1127,22 +1839,33 @@ static int modify_current_stream(HTTPContext *c, char *rates)
 
         switch(rates[i]) {
             case 0:
-                c->switch_feed_streams[i] = req->feed_streams[i];
+                j = req->feed_streams[i];
                 break;
             case 1:
-                c->switch_feed_streams[i] = find_stream_in_feed(req->feed, codec, codec->bit_rate / 2);
+                j = find_stream_in_feed(req->feed, codec, codec->bit_rate / 2);
                 break;
             case 2:
                 /* Wants off or slow */
-                c->switch_feed_streams[i] = find_stream_in_feed(req->feed, codec, codec->bit_rate / 4);
+                j = find_stream_in_feed(req->feed, codec, codec->bit_rate / 4);
 #ifdef WANTS_OFF
                 /* This doesn't work well when it turns off the only stream! */
-                c->switch_feed_streams[i] = -2;
+                j = -2;
                 c->feed_streams[i] = -2;
 #endif
                 break;
+            default:
+                j = c->switch_feed_streams[i];
+                break;
         }
 
+        /* the client's muxer was set up for the stream's own encoding */
+        if (j >= 0 && !can_switch_stream(req->feed, req->feed_streams[i], j))
+            j = -1;
+        /* an encoding already stopped for a switch waits for its successor */
+        if (j < 0 && c->feed_streams[i] == -1)
+            j = c->switch_feed_streams[i];
+        c->switch_feed_streams[i] = j;
+
         if (c->switch_feed_streams[i] >= 0 && c->switch_feed_streams[i] != c->feed_streams[i])
             action_required = 1;
     }
@@ -1151,15 +1874,11 @@ static int modify_current_stream(HTTPContext *c, char *rates)
 }
 
 
+/* switch_feed_streams[] only holds encodings checked by can_switch_stream() */
 static void do_switch_stream(HTTPContext *c, int i)
 {
-    if (c->switch_feed_streams[i] >= 0) {
-#ifdef PHILIP
+    if (c->switch_feed_streams[i] >= 0)
         c->feed_streams[i] = c->switch_feed_streams[i];
-#endif
-
-        /* Now update the stream */
-    }
     c->switch_feed_streams[i] = -1;
 }
 
@@ -1377,6 +2096,8 @@ static int http_parse_request(HTTPContext *c)
     c->stream = stream;
     memcpy(c->feed_streams, stream->feed_streams, sizeof(c->feed_streams));
     memset(c->switch_feed_streams, -1, sizeof(c->switch_feed_streams));
+    c->adapt_time = connection_time(c);
+    c->adapt_hold = ADAPT_HOLD_MIN;
 
     if (stream->stream_type == STREAM_TYPE_REDIRECT) {
         c->http_error = 301;
@@ -1406,8 +2127,10 @@ static int http_parse_request(HTTPContext *c)
         }
     }
 
+    server_lock();
     if (c->post == 0 && stream->stream_type == STREAM_TYPE_LIVE)
         current_bandwidth += stream->bandwidth;
+    server_unlock();
 
     /* If already streaming this feed, do not let start another feeder. */
     if (stream->feed_opened) {
@@ -1632,8 +2355,8 @@ static int http_parse_request(HTTPContext *c)
     if (c->stream->stream_type == STREAM_TYPE_STATUS)
         goto send_status;
 
-    /* open input stream */
-    if (open_input_stream(c, info) < 0) {
+    /* open input stream, unless the output is shared with other clients */
+    if (join_shared_stream(c, info) < 0 && open_input_stream(c, info) < 0) {
         snprintf(msg, sizeof(msg), "Input stream corresponding to '%s' not found", url);
         goto send_error;
     }
@@ -1699,12 +2422,14 @@ static void fmt_bytecount(ByteIOContext *pb, int64_t count)
 
 static void compute_status(HTTPContext *c)
 {
-    HTTPContext *c1;
     FFStream *stream;
     char *p;
     time_t ti;
     int i, len;
     ByteIOContext *pb;
+#if USE_WORKERS
+    WorkerThread *w;
+#endif
 
     if (url_open_dyn_buf(&pb) < 0) {
         /* XXX: return an error ? */
@@ -1893,8 +2618,32 @@ static void compute_status(HTTPContext *c)
 
     url_fprintf(pb, "<table>\n");
     url_fprintf(pb, "<tr><th>#<th>File<th>IP<th>Proto<th>State<th>Target bits/sec<th>Actual bits/sec<th>Bytes transferred\n");
-    c1 = first_http_ctx;
-    i = 0;
+    i = print_connections(pb, first_http_ctx, 0);
+#if USE_WORKERS
+    for (w = workers; w && w < workers + nb_workers; w++) {
+        pthread_mutex_lock(&w->lock);
+        i = print_connections(pb, w->first_ctx, i);
+        pthread_mutex_unlock(&w->lock);
+    }
+#endif
+    url_fprintf(pb, "</table>\n");
+
+    /* date */
+    ti = time(NULL);
+    p = ctime(&ti);
+    url_fprintf(pb, "<hr size=1 noshade>Generated at %s", p);
+    url_fprintf(pb, "</body>\n</html>\n");
+
+    len = url_close_dyn_buf(pb, &c->pb_buffer);
+    c->buffer_ptr = c->pb_buffer;
+    c->buffer_end = c->pb_buffer + len;
+}
+
+/* print a table row for each connection of a list, numbered from i + 1 */
+static int print_connections(ByteIOContext *pb, HTTPContext *c1, int i)
+{
+    const char *p;
+
     while (c1 != NULL) {
         int bitrate;
         int j;
@@ -1920,23 +2669,13 @@ static void compute_status(HTTPContext *c)
                     http_state[c1->state]);
         fmt_bytecount(pb, bitrate);
         url_fprintf(pb, "<td align=right>");
-        fmt_bytecount(pb, compute_datarate(&c1->datarate, c1->data_count) * 8);
+        fmt_bytecount(pb, compute_datarate(&c1->datarate, c1->data_count, cur_time) * 8);
         url_fprintf(pb, "<td align=right>");
         fmt_bytecount(pb, c1->data_count);
         url_fprintf(pb, "\n");
         c1 = c1->next;
     }
-    url_fprintf(pb, "</table>\n");
-
-    /* date */
-    ti = time(NULL);
-    p = ctime(&ti);
-    url_fprintf(pb, "<hr size=1 noshade>Generated at %s", p);
-    url_fprintf(pb, "</body>\n</html>\n");
-
-    len = url_close_dyn_buf(pb, &c->pb_buffer);
-    c->buffer_ptr = c->pb_buffer;
-    c->buffer_end = c->pb_buffer + len;
+    return i;
 }
 
 /* check if the parser needs to be opened for stream i */
@@ -1955,17 +2694,108 @@ static void open_parser(AVFormatContext *s, int i)
     }
 }
 
+#if HAVE_SYS_MMAN_H
+/* "ffmmap:<feed filename>" reads a feed file through its memory mapping */
+typedef struct FeedMapContext {
+    FFStream *feed;
+    int64_t pos;
+} FeedMapContext;
+
+static int feed_map_open(URLContext *h, const char *filename, int flags)
+{
+    FeedMapContext *m;
+    FFStream *feed;
+
+    if (flags & (URL_WRONLY | URL_RDWR))
+        return AVERROR(EINVAL);
+    av_strstart(filename, "ffmmap:", &filename);
+    for(feed = first_feed; feed != NULL; feed = feed->next_feed) {
+        if (feed->feed_map && !strcmp(feed->feed_filename, filename))
+            break;
+    }
+    if (!feed)
+        return AVERROR(ENOENT);
+    m = av_mallocz(sizeof(FeedMapContext));
+    if (!m)
+        return AVERROR(ENOMEM);
+    m->feed = feed;
+    h->priv_data = m;
+    return 0;
+}
+
+static int feed_map_read(URLContext *h, unsigned char *buf, int size)
+{
+    FeedMapContext *m = h->priv_data;
+    int64_t len;
+
+    /* the mapped file never shrinks, only the data past the size of the
+       feed is not written yet */
+    server_lock();
+    len = FFMAX(FFMIN(m->feed->feed_size - m->pos, size), 0);
+    server_unlock();
+    memcpy(buf, m->feed->feed_map + m->pos, len);
+    m->pos += len;
+    return len;
+}
+
+static int64_t feed_map_seek(URLContext *h, int64_t pos, int whence)
+{
+    FeedMapContext *m = h->priv_data;
+    int64_t size;
+
+    server_lock();
+    size = m->feed->feed_size;
+    server_unlock();
+    switch(whence) {
+    case AVSEEK_SIZE:
+        return size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        pos += m->pos;
+        break;
+    case SEEK_END:
+        pos += size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > m->feed->feed_map_size)
+        return AVERROR(EINVAL);
+    return m->pos = pos;
+}
+
+static int feed_map_close(URLContext *h)
+{
+    av_free(h->priv_data);
+    return 0;
+}
+
+static URLProtocol feed_map_protocol = {
+    "ffmmap",
+    feed_map_open,
+    feed_map_read,
+    NULL,
+    feed_map_seek,
+    feed_map_close,
+};
+#endif
+
 static int open_input_stream(HTTPContext *c, const char *info)
 {
     char buf[128];
-    char input_filename[1024];
+    char input_filename[sizeof("ffmmap:") + sizeof(c->stream->feed_filename)];
     AVFormatContext *s;
     int buf_size, i, ret;
     int64_t stream_pos;
 
     /* find file name */
     if (c->stream->feed) {
-        strcpy(input_filename, c->stream->feed->feed_filename);
+        if (c->stream->feed->feed_map)
+            snprintf(input_filename, sizeof(input_filename), "ffmmap:%s",
+                     c->stream->feed->feed_filename);
+        else
+            strcpy(input_filename, c->stream->feed->feed_filename);
         buf_size = FFM_PACKET_SIZE;
         /* compute position (absolute time) */
         if (find_info_tag(buf, sizeof(buf), "date", info)) {
@@ -2024,16 +2854,250 @@ static int open_input_stream(HTTPContext *c, const char *info)
         av_seek_frame(c->fmt_in, -1, stream_pos, 0);
 #endif
     /* set the start time (needed for maxtime and RTP packet timing) */
-    c->start_time = cur_time;
+    c->start_time = connection_time(c);
     c->first_pts = AV_NOPTS_VALUE;
     return 0;
 }
 
+static void unref_chunk(OutputChunk *chunk)
+{
+    if (chunk && !--chunk->refcount) {
+        av_free(chunk->data);
+        av_free(chunk);
+    }
+}
+
+/* free the connection muxing a shared stream once its feed ended */
+static void close_shared_source(SharedStream *ss)
+{
+    HTTPContext *c = ss->src;
+    int i;
+
+    if (c->fmt_in) {
+        for(i=0;i<c->fmt_in->nb_streams;i++) {
+            if (c->fmt_in->streams[i]->codec->codec)
+                avcodec_close(c->fmt_in->streams[i]->codec);
+        }
+        av_close_input_file(c->fmt_in);
+    }
+    for(i=0; i<c->fmt_ctx.nb_streams; i++)
+        av_free(c->fmt_ctx.streams[i]);
+    av_freep(&c->pb_buffer);
+    av_free(c);
+
+    server_lock();
+    ss->src = NULL;
+    ss->eof = 1;
+    server_unlock();
+}
+
+/* mux the packets newly available in the feed of a shared stream */
+static void update_shared_stream(SharedStream *ss)
+{
+    HTTPContext *c = ss->src;
+    OutputChunk *chunk;
+    int state, ret;
+
+    for(;;) {
+        if (c->state == HTTPSTATE_WAIT_FEED)
+            c->state = HTTPSTATE_SEND_DATA;
+        state = c->state;
+        c->buffer_ptr = c->buffer_end = NULL;
+        ret = http_prepare_data(c);
+        if (ret > 0)
+            break;
+        if (ret < 0) {
+            close_shared_source(ss);
+            break;
+        }
+        if (c->buffer_ptr == c->buffer_end && state != HTTPSTATE_SEND_DATA_HEADER)
+            continue;
+
+        if (!(chunk = av_mallocz(sizeof(OutputChunk)))) {
+            close_shared_source(ss);
+            break;
+        }
+        chunk->data      = c->pb_buffer;
+        chunk->size      = c->buffer_end - c->buffer_ptr;
+        chunk->key_frame = state == HTTPSTATE_SEND_DATA && c->key_frame;
+        chunk->refcount  = 1;
+        c->pb_buffer = NULL;
+
+        server_lock();
+        if (state == HTTPSTATE_SEND_DATA_HEADER) {
+            unref_chunk(ss->header);
+            ss->header = chunk;
+        } else {
+            unref_chunk(ss->ring[ss->next_seq % SHARED_RING_SIZE]);
+            ss->ring[ss->next_seq % SHARED_RING_SIZE] = chunk;
+            if (chunk->key_frame)
+                ss->key_seq = ss->next_seq;
+            ss->next_seq++;
+        }
+        server_unlock();
+    }
+}
+
+static void update_shared_streams(FFStream *feed)
+{
+    FFStream *stream;
+
+    for(stream = first_stream; stream != NULL; stream = stream->next) {
+        if (stream->feed == feed && stream->shared && stream->shared->src)
+            update_shared_stream(stream->shared);
+    }
+}
+
+/* start muxing a shared stream from the live position of its feed */
+static int open_shared_source(FFStream *stream)
+{
+    SharedStream *ss = stream->shared;
+    HTTPContext *c;
+    int i;
+
+    c = av_mallocz(sizeof(HTTPContext));
+    if (!c)
+        return -1;
+    c->fd = -1;
+    c->stream = stream;
+    memcpy(c->feed_streams, stream->feed_streams, sizeof(c->feed_streams));
+    if (open_input_stream(c, "") < 0) {
+        av_free(c);
+        return -1;
+    }
+    c->state = HTTPSTATE_SEND_DATA_HEADER;
+
+    /* drop the output of the previous feed */
+    server_lock();
+    for (i = 0; i < SHARED_RING_SIZE; i++) {
+        unref_chunk(ss->ring[i]);
+        ss->ring[i] = NULL;
+    }
+    unref_chunk(ss->header);
+    ss->header  = NULL;
+    ss->key_seq = -1;
+    ss->eof     = 0;
+    ss->src     = c;
+    server_unlock();
+
+    update_shared_stream(ss);
+    return ss->header ? 0 : -1;
+}
+
+/* let a client send the shared output of its stream, the live streams of
+   a feed in a format that needs no per client header are muxed once */
+static int join_shared_stream(HTTPContext *c, const char *info)
+{
+    FFStream *stream = c->stream;
+    SharedStream *ss;
+    char buf[128];
+    int i;
+
+    if (stream->stream_type != STREAM_TYPE_LIVE || !stream->feed ||
+        stream->feed == stream || !stream->feed->feed_opened ||
+        stream->max_time || stream->adaptive || c->switch_pending ||
+        memcmp(c->feed_streams, stream->feed_streams, sizeof(c->feed_streams)) ||
+        find_info_tag(buf, sizeof(buf), "date", info) ||
+        find_info_tag(buf, sizeof(buf), "buffer", info))
+        return -1;
+    for (i = 0; shared_formats[i]; i++)
+        if (!strcmp(stream->fmt->name, shared_formats[i]))
+            break;
+    if (!shared_formats[i])
+        return -1;
+
+    if (!stream->shared && !(stream->shared = av_mallocz(sizeof(SharedStream))))
+        return -1;
+    ss = stream->shared;
+    /* the clients of an ended feed must leave before it is muxed again */
+    if (!ss->src && (ss->nb_clients || open_shared_source(stream) < 0))
+        return -1;
+
+    server_lock();
+    ss->nb_clients++;
+    c->shared = ss;
+    c->got_key_frame = 0;
+    /* start at the last key frame still in the ring */
+    if (ss->key_seq >= 0 && ss->key_seq >= ss->next_seq - SHARED_RING_SIZE)
+        c->chunk_seq = ss->key_seq;
+    else
+        c->chunk_seq = ss->next_seq;
+    server_unlock();
+    return 0;
+}
+
+/* false if a connection waiting for its feed would find nothing new to
+   send, shared streams only wake up their clients for new chunks */
+static int feed_data_pending(HTTPContext *c)
+{
+    int pending;
+
+    if (!c->shared)
+        return 1;
+    server_lock();
+    pending = c->chunk_seq < c->shared->next_seq || c->shared->eof;
+    server_unlock();
+    return pending;
+}
+
+/* take the next chunk of the shared output of a stream */
+static int shared_prepare_data(HTTPContext *c)
+{
+    SharedStream *ss = c->shared;
+    OutputChunk *chunk = NULL;
+
+    server_lock();
+    switch(c->state) {
+    case HTTPSTATE_SEND_DATA_HEADER:
+        chunk = ss->header;
+        c->state = HTTPSTATE_SEND_DATA;
+        break;
+    case HTTPSTATE_SEND_DATA:
+        /* a client too slow for the ring restarts at the last key frame */
+        if (c->chunk_seq < ss->next_seq - SHARED_RING_SIZE) {
+            c->got_key_frame = 0;
+            if (ss->key_seq >= ss->next_seq - SHARED_RING_SIZE)
+                c->chunk_seq = ss->key_seq;
+            else
+                c->chunk_seq = ss->next_seq;
+        }
+        while (!chunk && c->chunk_seq < ss->next_seq) {
+            chunk = ss->ring[c->chunk_seq++ % SHARED_RING_SIZE];
+            if (chunk->key_frame)
+                c->got_key_frame = 1;
+            if (c->stream->send_on_key && !c->got_key_frame)
+                chunk = NULL;
+        }
+        if (!chunk) {
+            if (ss->eof) {
+                c->state = HTTPSTATE_SEND_DATA_TRAILER;
+                server_unlock();
+                return 0;
+            }
+            c->state = HTTPSTATE_WAIT_FEED;
+            server_unlock();
+            return 1; /* state changed */
+        }
+        break;
+    default:
+        /* the trailer is part of the shared output */
+        server_unlock();
+        return -1;
+    }
+    chunk->refcount++;
+    server_unlock();
+
+    c->chunk = chunk;
+    c->buffer_ptr = chunk->data;
+    c->buffer_end = chunk->data + chunk->size;
+    return 0;
+}
+
 /* return the server clock (in us) */
 static int64_t get_server_clock(HTTPContext *c)
 {
     /* compute current pts value from system time */
-    return (cur_time - c->start_time) * 1000;
+    return (connection_time(c) - c->start_time) * 1000;
 }
 
 /* return the estimated time at which the current packet must be sent
@@ -2059,6 +3123,14 @@ static int http_prepare_data(HTTPContext *c)
     AVFormatContext *ctx;
 
     av_freep(&c->pb_buffer);
+    if (c->chunk) {
+        server_lock();
+        unref_chunk(c->chunk);
+        server_unlock();
+        c->chunk = NULL;
+    }
+    if (c->shared)
+        return shared_prepare_data(c);
     switch(c->state) {
     case HTTPSTATE_SEND_DATA_HEADER:
         memset(&c->fmt_ctx, 0, sizeof(c->fmt_ctx));
@@ -2121,13 +3193,20 @@ static int http_prepare_data(HTTPContext *c)
     case HTTPSTATE_SEND_DATA:
         /* find a new packet */
         /* read a packet from the input stream */
-        if (c->stream->feed)
+        if (c->stream->feed) {
+            server_lock();
             ffm_set_write_index(c->fmt_in,
                                 c->stream->feed->feed_write_index,
                                 c->stream->feed->feed_size);
+            server_unlock();
+
+            if (c->stream->adaptive && !c->is_packetized && !c->switch_pending &&
+                connection_time(c) - c->adapt_time >= ADAPT_INTERVAL)
+                adapt_stream(c, connection_time(c));
+        }
 
         if (c->stream->max_time &&
-            c->stream->max_time + c->start_time - cur_time < 0)
+            c->stream->max_time + c->start_time - connection_time(c) < 0)
             /* We have timed out */
             c->state = HTTPSTATE_SEND_DATA_TRAILER;
         else {
@@ -2138,6 +3217,7 @@ static int http_prepare_data(HTTPContext *c)
                     /* if coming from feed, it means we reached the end of the
                        ffm file, so must wait for more data */
                     c->state = HTTPSTATE_WAIT_FEED;
+                    c->caught_up = 1;
                     return 1; /* state changed */
                 } else {
                     if (c->stream->loop) {
@@ -2157,7 +3237,7 @@ static int http_prepare_data(HTTPContext *c)
                 /* update first pts if needed */
                 if (c->first_pts == AV_NOPTS_VALUE) {
                     c->first_pts = av_rescale_q(pkt.dts, c->fmt_in->streams[pkt.stream_index]->time_base, AV_TIME_BASE_Q);
-                    c->start_time = cur_time;
+                    c->start_time = connection_time(c);
                 }
                 /* send it to the appropriate stream */
                 if (c->stream->feed) {
@@ -2165,9 +3245,17 @@ static int http_prepare_data(HTTPContext *c)
                     if (c->switch_pending) {
                         c->switch_pending = 0;
                         for(i=0;i<c->stream->nb_streams;i++) {
-                            if (c->switch_feed_streams[i] == pkt.stream_index)
+                            if (c->switch_feed_streams[i] == pkt.stream_index) {
                                 if (pkt.flags & PKT_FLAG_KEY)
                                     do_switch_stream(c, i);
+                            } else if (c->switch_feed_streams[i] >= 0 &&
+                                       c->feed_streams[i] == pkt.stream_index &&
+                                       pkt.flags & PKT_FLAG_KEY) {
+                                /* the old encoding stops at its key frame,
+                                   the new one starts at the aligned key
+                                   frame which follows it in the feed */
+                                c->feed_streams[i] = -1;
+                            }
                             if (c->switch_feed_streams[i] >= 0)
                                 c->switch_pending = 1;
                         }
@@ -2189,6 +3277,9 @@ static int http_prepare_data(HTTPContext *c)
                     AVStream *ist, *ost;
                 send_it:
                     ist = c->fmt_in->streams[source_index];
+                    c->key_frame = pkt.flags & PKT_FLAG_KEY &&
+                                   (ist->codec->codec_type == CODEC_TYPE_VIDEO ||
+                                    c->stream->nb_streams == 1);
                     /* specific handling for RTP: we use several
                        output stream (one for each RTP
                        connection). XXX: need more abstract handling */
@@ -2279,6 +3370,64 @@ static int http_prepare_data(HTTPContext *c)
     return 0;
 }
 
+#if HAVE_WRITEV
+/* send the rest of the current shared chunk together with the chunks
+   following it in the ring, the chunks reached become current */
+static int send_shared_chunks(HTTPContext *c)
+{
+    SharedStream *ss = c->shared;
+    OutputChunk *chunks[SHARED_IOV_MAX];
+    struct iovec iov[SHARED_IOV_MAX];
+    int64_t seq;
+    int i, n, len, left;
+
+    iov[0].iov_base = c->buffer_ptr;
+    iov[0].iov_len  = c->buffer_end - c->buffer_ptr;
+    n = 1;
+    /* chunks are only skipped while waiting for a key frame */
+    if (c->got_key_frame || !c->stream->send_on_key) {
+        server_lock();
+        if (c->chunk_seq >= ss->next_seq - SHARED_RING_SIZE) {
+            for (seq = c->chunk_seq; n < SHARED_IOV_MAX && seq < ss->next_seq; seq++, n++) {
+                chunks[n] = ss->ring[seq % SHARED_RING_SIZE];
+                chunks[n]->refcount++;
+                iov[n].iov_base = chunks[n]->data;
+                iov[n].iov_len  = chunks[n]->size;
+            }
+        }
+        server_unlock();
+    }
+
+    len = writev(c->fd, iov, n);
+
+    left = FFMAX(len, 0);
+    if (left < iov[0].iov_len) {
+        c->buffer_ptr += left;
+        left = 0;
+    } else {
+        c->buffer_ptr = c->buffer_end;
+        left -= iov[0].iov_len;
+    }
+    if (n > 1)
+        server_lock();
+    for (i = 1; i < n; i++) {
+        if (left > 0) {
+            /* partly or fully sent, it becomes the current chunk */
+            unref_chunk(c->chunk);
+            c->chunk = chunks[i];
+            c->chunk_seq++;
+            c->buffer_ptr = chunks[i]->data + FFMIN(left, chunks[i]->size);
+            c->buffer_end = chunks[i]->data + chunks[i]->size;
+            left -= FFMIN(left, chunks[i]->size);
+        } else
+            unref_chunk(chunks[i]);
+    }
+    if (n > 1)
+        server_unlock();
+    return len;
+}
+#endif
+
 /* should convert the format at the same time */
 /* send data starting at c->buffer_ptr to the output connection
    (either UDP or TCP connection) */
@@ -2316,9 +3465,12 @@ static int http_send_data(HTTPContext *c)
                 }
 
                 c->data_count += len;
-                update_datarate(&c->datarate, c->data_count);
-                if (c->stream)
+                update_datarate(&c->datarate, c->data_count, connection_time(c));
+                if (c->stream) {
+                    server_lock();
                     c->stream->bytes_served += len;
+                    server_unlock();
+                }
 
                 if (c->rtp_protocol == RTSP_LOWER_TRANSPORT_TCP) {
                     /* RTP packets are sent inside the RTSP TCP connection */
@@ -2365,6 +3517,7 @@ static int http_send_data(HTTPContext *c)
                            send it later, so a new state is needed to
                            "lock" the RTSP TCP connection */
                         rtsp_c->state = RTSPSTATE_SEND_PACKET;
+                        poll_update(rtsp_c);
                         break;
                     } else
                         /* all data has been sent */
@@ -2379,7 +3532,16 @@ static int http_send_data(HTTPContext *c)
                 }
             } else {
                 /* TCP data output */
-                len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
+#if HAVE_WRITEV
+                if (c->shared && c->state == HTTPSTATE_SEND_DATA)
+                    len = send_shared_chunks(c);
+                else
+#endif
+                {
+                    len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
+                    if (len > 0)
+                        c->buffer_ptr += len;
+                }
                 if (len < 0) {
                     if (ff_neterrno() != FF_NETERROR(EAGAIN) &&
                         ff_neterrno() != FF_NETERROR(EINTR))
@@ -2387,13 +3549,15 @@ static int http_send_data(HTTPContext *c)
                         return -1;
                     else
                         return 0;
-                } else
-                    c->buffer_ptr += len;
+                }
 
                 c->data_count += len;
-                update_datarate(&c->datarate, c->data_count);
-                if (c->stream)
+                update_datarate(&c->datarate, c->data_count, connection_time(c));
+                if (c->stream) {
+                    server_lock();
                     c->stream->bytes_served += len;
+                    server_unlock();
+                }
                 break;
             }
         }
@@ -2422,8 +3586,15 @@ static int http_start_receive_data(HTTPContext *c)
 
     if (c->stream->truncate) {
         /* truncate feed file */
+        server_lock();
         ffm_write_write_index(c->feed_fd, FFM_PACKET_SIZE);
-        ftruncate(c->feed_fd, FFM_PACKET_SIZE);
+        if (c->stream->feed_map)
+            /* the clients keep reading the mapping, just mark the end */
+            c->stream->feed_map[FFM_PACKET_SIZE] = 0;
+        else
+            ftruncate(c->feed_fd, FFM_PACKET_SIZE);
+        c->stream->feed_size = FFM_PACKET_SIZE;
+        server_unlock();
         http_log("Truncating feed file '%s'\n", c->stream->feed_filename);
     } else {
         if ((c->stream->feed_write_index = ffm_read_write_index(fd)) < 0) {
@@ -2432,8 +3603,12 @@ static int http_start_receive_data(HTTPContext *c)
         }
     }
 
+    server_lock();
     c->stream->feed_write_index = FFMAX(ffm_read_write_index(fd), FFM_PACKET_SIZE);
-    c->stream->feed_size = lseek(fd, 0, SEEK_END);
+    /* a mapped feed file has its final size, the feed keeps its own */
+    if (!c->stream->feed_map)
+        c->stream->feed_size = lseek(fd, 0, SEEK_END);
+    server_unlock();
     lseek(fd, 0, SEEK_SET);
 
     /* init buffer input */
@@ -2462,7 +3637,7 @@ static int http_receive_data(HTTPContext *c)
         else {
             c->buffer_ptr += len;
             c->data_count += len;
-            update_datarate(&c->datarate, c->data_count);
+            update_datarate(&c->datarate, c->data_count, connection_time(c));
         }
     }
 
@@ -2481,13 +3656,18 @@ static int http_receive_data(HTTPContext *c)
         if (c->data_count > FFM_PACKET_SIZE) {
 
             //            printf("writing pos=0x%"PRIx64" size=0x%"PRIx64"\n", feed->feed_write_index, feed->feed_size);
-            /* XXX: use llseek or url_seek */
-            lseek(c->feed_fd, feed->feed_write_index, SEEK_SET);
-            if (write(c->feed_fd, c->buffer, FFM_PACKET_SIZE) < 0) {
-                http_log("Error writing to feed file: %s\n", strerror(errno));
-                goto fail;
+            if (feed->feed_map) {
+                memcpy(feed->feed_map + feed->feed_write_index, c->buffer, FFM_PACKET_SIZE);
+            } else {
+                /* XXX: use llseek or url_seek */
+                lseek(c->feed_fd, feed->feed_write_index, SEEK_SET);
+                if (write(c->feed_fd, c->buffer, FFM_PACKET_SIZE) < 0) {
+                    http_log("Error writing to feed file: %s\n", strerror(errno));
+                    goto fail;
+                }
             }
 
+            server_lock();
             feed->feed_write_index += FFM_PACKET_SIZE;
             /* update file size */
             if (feed->feed_write_index > c->stream->feed_size)
@@ -2496,19 +3676,32 @@ static int http_receive_data(HTTPContext *c)
             /* handle wrap around if max file size reached */
             if (c->stream->feed_max_size && feed->feed_write_index >= c->stream->feed_max_size)
                 feed->feed_write_index = FFM_PACKET_SIZE;
+            server_unlock();
 
             /* write index */
-            if (ffm_write_write_index(c->feed_fd, feed->feed_write_index) < 0) {
+            if (feed->feed_map) {
+                /* until the feed wraps around, the packet at the write
+                   index is not valid, so that map_feed() finds its end */
+                if (feed->feed_write_index == feed->feed_size)
+                    feed->feed_map[feed->feed_write_index] = 0;
+                AV_WB64(feed->feed_map + 8, feed->feed_write_index);
+            } else if (ffm_write_write_index(c->feed_fd, feed->feed_write_index) < 0) {
                 http_log("Error writing index to feed file: %s\n", strerror(errno));
                 goto fail;
             }
 
+            update_shared_streams(c->stream);
+
             /* wake up any waiting connections */
             for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
                 if (c1->state == HTTPSTATE_WAIT_FEED &&
-                    c1->stream->feed == c->stream->feed)
+                    c1->stream->feed == c->stream->feed &&
+                    feed_data_pending(c1)) {
                     c1->state = HTTPSTATE_SEND_DATA;
+                    poll_update(c1);
+                }
             }
+            notify_workers();
         } else {
             /* We have a header in our hands that contains useful data */
             AVFormatContext *s = NULL;
@@ -2561,12 +3754,16 @@ static int http_receive_data(HTTPContext *c)
  fail:
     c->stream->feed_opened = 0;
     close(c->feed_fd);
+    update_shared_streams(c->stream);
     /* wake up any waiting connections to stop waiting for feed */
     for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
         if (c1->state == HTTPSTATE_WAIT_FEED &&
-            c1->stream->feed == c->stream->feed)
+            c1->stream->feed == c->stream->feed) {
             c1->state = HTTPSTATE_SEND_DATA_TRAILER;
+            poll_update(c1);
+        }
     }
+    notify_workers();
     return -1;
 }
 
@@ -3029,6 +4226,7 @@ static void rtsp_cmd_play(HTTPContext *c, const char *url, RTSPMessageHeader *h)
     }
 
     rtp_c->state = HTTPSTATE_SEND_DATA;
+    poll_update(rtp_c);
 
     /* now everything is OK, so we can send the connection parameters */
     rtsp_reply_header(c, RTSP_STATUS_OK);
@@ -3055,6 +4253,7 @@ static void rtsp_cmd_pause(HTTPContext *c, const char *url, RTSPMessageHeader *h
 
     rtp_c->state = HTTPSTATE_READY;
     rtp_c->first_pts = AV_NOPTS_VALUE;
+    poll_update(rtp_c);
     /* now everything is OK, so we can send the connection parameters */
     rtsp_reply_header(c, RTSP_STATUS_OK);
     /* session ID */
@@ -3113,7 +4312,9 @@ static HTTPContext *rtp_new_connection(struct sockaddr_in *from_addr,
     c->buffer = av_malloc(c->buffer_size);
     if (!c->buffer)
         goto fail;
+    server_lock();
     nb_connections++;
+    server_unlock();
     c->stream = stream;
     av_strlcpy(c->session_id, session_id, sizeof(c->session_id));
     c->state = HTTPSTATE_READY;
@@ -3138,10 +4339,11 @@ static HTTPContext *rtp_new_connection(struct sockaddr_in *from_addr,
     av_strlcpy(c->protocol, "RTP/", sizeof(c->protocol));
     av_strlcat(c->protocol, proto_str, sizeof(c->protocol));
 
+    server_lock();
     current_bandwidth += stream->bandwidth;
+    server_unlock();
 
-    c->next = first_http_ctx;
-    first_http_ctx = c;
+    add_connection(c);
     return c;
 
  fail:
@@ -3421,6 +4623,47 @@ static void build_file_streams(void)
     }
 }
 
+#if HAVE_SYS_MMAN_H
+/* map a feed file which wraps around in memory: the feeder then writes it
+   and the clients of the feed read it without system calls. The file is
+   given its final size once, so that the mapping stays valid; the packets
+   are written at multiples of FFM_PACKET_SIZE below feed_max_size. */
+static void map_feed(FFStream *feed)
+{
+    int64_t size = FFALIGN(feed->feed_max_size, FFM_PACKET_SIZE);
+    uint8_t *map;
+    int fd;
+
+    if (!feed->feed_max_size || feed->readonly || size > SIZE_MAX)
+        return;
+    fd = open(feed->feed_filename, O_RDWR);
+    if (fd < 0)
+        return;
+    if (feed->feed_size < size && ftruncate(fd, size) < 0) {
+        http_log("Could not extend feed file '%s': %s\n",
+                 feed->feed_filename, strerror(errno));
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        http_log("Could not map feed file '%s': %s\n",
+                 feed->feed_filename, strerror(errno));
+        if (feed->feed_size < size)
+            ftruncate(fd, feed->feed_size);
+        close(fd);
+        return;
+    }
+    close(fd);
+    /* a file mapped before ends at its write index until it wraps around */
+    if (feed->feed_size == size && feed->feed_write_index < size &&
+        (map[feed->feed_write_index] != 'f' || map[feed->feed_write_index + 1] != 'm'))
+        feed->feed_size = feed->feed_write_index;
+    feed->feed_map      = map;
+    feed->feed_map_size = size;
+}
+#endif
+
 /* compute the needed AVStream for each feed */
 static void build_feed_streams(void)
 {
@@ -3573,6 +4816,9 @@ static void build_feed_streams(void)
             feed->feed_max_size = feed->feed_size;
 
         close(fd);
+#if HAVE_SYS_MMAN_H
+        map_feed(feed);
+#endif
     }
 }
 
@@ -3845,6 +5091,19 @@ static int parse_ffconfig(const char *filename)
             } else {
                 nb_max_connections = val;
             }
+        } else if (!strcasecmp(cmd, "WorkerThreads")) {
+            get_arg(arg, sizeof(arg), &p);
+            val = atoi(arg);
+            if (val < 0 || val > MAX_WORKERS) {
+                fprintf(stderr, "%s:%d: Invalid WorkerThreads: %s\n",
+                        filename, line_num, arg);
+                errors++;
+            } else if (!USE_WORKERS) {
+                fprintf(stderr, "%s:%d: WorkerThreads ignored, ffserver was built without threads or epoll\n",
+                        filename, line_num);
+            } else {
+                nb_workers = val;
+            }
         } else if (!strcasecmp(cmd, "MaxBandwidth")) {
             int64_t llval;
             get_arg(arg, sizeof(arg), &p);
@@ -4087,6 +5346,9 @@ static int parse_ffconfig(const char *filename)
         } else if (!strcasecmp(cmd, "StartSendOnKey")) {
             if (stream)
                 stream->send_on_key = 1;
+        } else if (!strcasecmp(cmd, "AdaptBitRate")) {
+            if (stream)
+                stream->adaptive = 1;
         } else if (!strcasecmp(cmd, "AudioCodec")) {
             get_arg(arg, sizeof(arg), &p);
             audio_id = opt_audio_codec(arg);
@@ -4503,6 +5765,9 @@ int main(int argc, char **argv)
     struct sigaction sigact;
 
     av_register_all();
+#if HAVE_SYS_MMAN_H
+    av_register_protocol(&feed_map_protocol);
+#endif
 
     show_banner();
 
@@ -30,8 +30,8 @@
 #include "libavutil/avutil.h"
 
 #define LIBAVCODEC_VERSION_MAJOR 52
-#define LIBAVCODEC_VERSION_MINOR 45
-#define LIBAVCODEC_VERSION_MICRO  0
+#define LIBAVCODEC_VERSION_MINOR 46
+#define LIBAVCODEC_VERSION_MICRO  1
 
 #define LIBAVCODEC_VERSION_INT  AV_VERSION_INT(LIBAVCODEC_VERSION_MAJOR, \
                                                LIBAVCODEC_VERSION_MINOR, \
@@ -2829,6 +2829,27 @@ void av_shrink_packet(AVPacket *pkt, int size);
  */
 int av_dup_packet(AVPacket *pkt);
 
+/**
+ * Make dst a new reference to the payload of src and copy the other
+ * fields of src to dst.
+ *
+ * The payload is reference counted and freed when the last packet
+ * referencing it is freed with av_free_packet(), so a payload can be
+ * handed to several queues or muxers without being copied. If src does
+ * not own a reference counted payload yet, it is converted first: a payload
+ * allocated with av_new_packet() or av_dup_packet() is taken over as is,
+ * any other one is copied once.
+ *
+ * The payload of a packet sharing its data with others must not be
+ * modified, and the references to one payload must not be created or
+ * freed from several threads concurrently.
+ *
+ * @param dst packet to initialize, its previous content is not freed
+ * @param src packet to reference
+ * @return 0 if OK, AVERROR_xxx otherwise
+ */
+int av_packet_ref(AVPacket *dst, AVPacket *src);
+
 /**
  * Free a packet.
  *
@@ -21,6 +21,13 @@
 
 #include "avcodec.h"
 
+/**
+ * Payload shared by the packets created with av_packet_ref().
+ */
+typedef struct PacketBuffer {
+    int refcount;
+    uint8_t *data;          ///< allocated payload, freed with the last reference
+} PacketBuffer;
 
 void av_destruct_packet_nofree(AVPacket *pkt)
 {
@@ -90,6 +97,53 @@ int av_dup_packet(AVPacket *pkt)
     return 0;
 }
 
+static void destruct_packet_ref(AVPacket *pkt)
+{
+    PacketBuffer *buf = pkt->priv;
+
+    if (buf && !--buf->refcount) {
+        av_free(buf->data);
+        av_free(buf);
+    }
+    pkt->priv = NULL;
+    pkt->data = NULL; pkt->size = 0;
+}
+
+int av_packet_ref(AVPacket *dst, AVPacket *src)
+{
+    PacketBuffer *buf;
+    int ret;
+
+    if (!src->data) {
+        *dst = *src;
+        dst->destruct = NULL;
+        return 0;
+    }
+
+    if (src->destruct != destruct_packet_ref) {
+        if (src->destruct != av_destruct_packet) {
+            /* not allocated by us, copy the payload and release the original */
+            AVPacket tmp = *src;
+            tmp.destruct = NULL;
+            if ((ret = av_dup_packet(&tmp)) < 0)
+                return ret;
+            av_free_packet(src);
+            *src = tmp;
+        }
+        buf = av_malloc(sizeof(PacketBuffer));
+        if (!buf)
+            return AVERROR(ENOMEM);
+        buf->refcount = 1;
+        buf->data     = src->data;
+        src->priv     = buf;
+        src->destruct = destruct_packet_ref;
+    }
+
+    *dst = *src;
+    ((PacketBuffer *)src->priv)->refcount++;
+    return 0;
+}
+
 void av_free_packet(AVPacket *pkt)
 {
     if (pkt) {
@@ -6853,6 +6853,14 @@ static int decode_slice(struct AVCodecContext *avctx, void *arg){
     return -1; //not reached
 }
 
+static int timed_decode_slice(AVCodecContext *avctx, void *arg){
+    int ret;
+    AV_PERF_START(h264_decode_slice)
+    ret = decode_slice(avctx, arg);
+    AV_PERF_STOP(h264_decode_slice)
+    return ret;
+}
+
 static int decode_picture_timing(H264Context *h){
     MpegEncContext * const s = &h->s;
     if(h->sps.nal_hrd_parameters_present_flag || h->sps.vcl_hrd_parameters_present_flag){
@@ -7451,7 +7459,7 @@ static void execute_decode_slices(H264Context *h, int context_count){
     if(s->avctx->codec->capabilities&CODEC_CAP_HWACCEL_VDPAU)
         return;
     if(context_count == 1) {
-        decode_slice(avctx, &h);
+        timed_decode_slice(avctx, &h);
     } else {
         for(i = 1; i < context_count; i++) {
             hx = h->thread_context[i];
@@ -7459,7 +7467,7 @@ static void execute_decode_slices(H264Context *h, int context_count){
             hx->s.error_count = 0;
         }
 
-        avctx->execute(avctx, (void *)decode_slice,
+        avctx->execute(avctx, (void *)timed_decode_slice,
                        h->thread_context, NULL, context_count, sizeof(void*));
 
         /* pull back stuff from slices to master context */
@@ -1959,6 +1959,7 @@ static int pre_estimate_motion_thread(AVCodecContext *c, void *arg){
 
 static int estimate_motion_thread(AVCodecContext *c, void *arg){
     MpegEncContext *s= *(void**)arg;
+    AV_PERF_START(motion_estimation)
 
     ff_check_alignment();
 
@@ -1981,6 +1982,7 @@ static int estimate_motion_thread(AVCodecContext *c, void *arg){
         }
         s->first_slice_line=0;
     }
+    AV_PERF_STOP(motion_estimation)
     return 0;
 }
 
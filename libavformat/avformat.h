@@ -22,7 +22,7 @@
 #define AVFORMAT_AVFORMAT_H
 
 #define LIBAVFORMAT_VERSION_MAJOR 52
-#define LIBAVFORMAT_VERSION_MINOR 46
+#define LIBAVFORMAT_VERSION_MINOR 53
 #define LIBAVFORMAT_VERSION_MICRO  0
 
 #define LIBAVFORMAT_VERSION_INT AV_VERSION_INT(LIBAVFORMAT_VERSION_MAJOR, \
@@ -565,7 +565,9 @@ typedef struct AVFormatContext {
     int64_t start_time;
     /** Decoding: duration of the stream, in AV_TIME_BASE fractional
        seconds. NEVER set this value directly: it is deduced from the
-       AVStream values.  */
+       AVStream values.
+       Encoding: expected duration if known, muxers may use it to reserve
+       room for their index in the header, 0 otherwise.  */
     int64_t duration;
     /** decoding: total file size, 0 if unknown */
     int64_t file_size;
@@ -600,6 +602,9 @@ typedef struct AVFormatContext {
 #define AVFMT_FLAG_GENPTS       0x0001 ///< Generate missing pts even if it requires parsing future frames.
 #define AVFMT_FLAG_IGNIDX       0x0002 ///< Ignore index.
 #define AVFMT_FLAG_NONBLOCK     0x0004 ///< Do not block when reading packets from input.
+#define AVFMT_FLAG_FRAGMENT     0x0008 ///< Write fragmented output in muxers supporting it (moof/mdat pairs for MOV/MP4).
+#define AVFMT_FLAG_FASTSTART    0x0010 ///< Put the index at the start of the file in muxers supporting it (moov for MOV/MP4).
+#define AVFMT_FLAG_FASTPROBE    0x0020 ///< Make av_find_stream_info() stop as soon as each stream has its codec parameters, see av_find_stream_info().
 
     int loop_input;
     /** decoding: size of data to probe; encoding: unused. */
@@ -679,6 +684,62 @@ typedef struct AVFormatContext {
      */
 #define RAW_PACKET_BUFFER_SIZE 2500000
     int raw_packet_buffer_remaining_size;
+
+    /**
+     * Minimum duration of the fragments written when AVFMT_FLAG_FRAGMENT
+     * is set, in AV_TIME_BASE units. Fragments always start at a keyframe,
+     * 0 means starting a new fragment at every keyframe.
+     * - encoding: Set by user.
+     * - decoding: unused
+     */
+    int fragment_duration;
+
+    /**
+     * Packet queues attached with av_program_queue_attach().
+     * - encoding: unused
+     * - decoding: Set by libavformat.
+     */
+    struct AVProgramQueue *program_queues;
+
+    /**
+     * Pool of packet list nodes and payloads used by the packet queues of
+     * this context.
+     * - encoding: Set by libavformat.
+     * - decoding: Set by libavformat.
+     */
+    struct AVPacketPool *packet_pool;
+
+    /**
+     * Maximum time span of the packets buffered by the dts interleaver,
+     * in AV_TIME_BASE units. Once it is exceeded the earliest packet is
+     * written even if some streams have no packet buffered.
+     * 0 means no limit, packets are then only written early on flush.
+     * - encoding: Set by user.
+     * - decoding: unused
+     */
+    int64_t max_interleave_delta;
+
+    /**
+     * State of the dts interleaver.
+     * NOT PART OF PUBLIC API
+     */
+    struct AVInterleaver *interleaver;
+
+    /**
+     * File in which the keyframe index built while reading is kept, so
+     * that later opens of the same file can seek without searching.
+     * It is only used if the size and modification time of the file match,
+     * and only by demuxers which do not read an index from the file.
+     * - encoding: unused
+     * - decoding: Set by user.
+     */
+    char *index_cache_path;
+
+    /**
+     * State of the index cache.
+     * NOT PART OF PUBLIC API
+     */
+    struct AVIndexCache *index_cache;
 } AVFormatContext;
 
 typedef struct AVPacketList {
@@ -686,6 +747,24 @@ typedef struct AVPacketList {
     struct AVPacketList *next;
 } AVPacketList;
 
+typedef struct AVPacketPool AVPacketPool;
+
+/**
+ * Usage counters of the packet pool of an AVFormatContext.
+ */
+typedef struct AVPacketPoolStats {
+    int64_t node_hits;      ///< list nodes reused from the pool
+    int64_t node_misses;    ///< list nodes which had to be allocated
+    int64_t payload_hits;   ///< payload copies made in a reused buffer
+    int64_t payload_misses; ///< payload copies which had to allocate a buffer
+} AVPacketPoolStats;
+
+/**
+ * Gets the usage counters of the packet pool of a context. The pool is
+ * released by av_close_input_stream() and av_write_trailer().
+ */
+void av_packet_pool_get_stats(AVFormatContext *s, AVPacketPoolStats *stats);
+
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
 extern AVInputFormat *first_iformat;
 extern AVOutputFormat *first_oformat;
@@ -872,6 +951,12 @@ AVFormatContext *avformat_alloc_context(void);
  * The logical file position is not changed by this function;
  * examined packets may be buffered for later processing.
  *
+ * With AVFMT_FLAG_FASTPROBE set in ic->flags, probing stops as soon as
+ * the codec parameters of each stream are known from the headers, the
+ * parsers or the first frame decoded, without analyzing the frame rate
+ * further. Streams of formats without header which start after all the
+ * others are complete are then not found.
+ *
  * @param ic media file handle
  * @return >=0 if OK, AVERROR_xxx on error
  * @todo Let the user decide somehow what information is needed so that
@@ -993,6 +1078,55 @@ void av_close_input_file(AVFormatContext *s);
 AVStream *av_new_stream(AVFormatContext *s, int id);
 AVProgram *av_new_program(AVFormatContext *s, int id);
 
+/**
+ * Queue of the packets of one program of an input file.
+ *
+ * Several queues can be attached to the same AVFormatContext so that one
+ * pass over a multi-program input feeds several consumers: whichever
+ * consumer needs a packet reads from the demuxer and the packets of the
+ * other attached programs are queued for their own consumers. Programs
+ * which have no queue attached are set to AVDISCARD_ALL, packets of streams
+ * not belonging to any attached program are dropped.
+ *
+ * The queues of one AVFormatContext share its state, calls on them must
+ * not be made concurrently.
+ *
+ * Once a queue holds PROGRAM_QUEUE_MAX_SIZE bytes of packets, the input
+ * file is not read any further until its consumer catches up: reading the
+ * other queues returns AVERROR(EAGAIN) when they are empty.
+ */
+typedef struct AVProgramQueue AVProgramQueue;
+
+/**
+ * maximum number of bytes of the packets held in one AVProgramQueue
+ */
+#define PROGRAM_QUEUE_MAX_SIZE (16 << 20)
+
+/**
+ * Attaches a packet queue for a program to an input file.
+ *
+ * @param s media file handle
+ * @param program_id id of the program, as in AVProgram.id
+ * @return the new queue or NULL on error
+ */
+AVProgramQueue *av_program_queue_attach(AVFormatContext *s, int program_id);
+
+/**
+ * Returns the next packet of the program of a queue, reading from the
+ * input file as needed. The packet must be freed with av_free_packet().
+ *
+ * @return 0 if OK, AVERROR(EAGAIN) if another queue is full,
+ *         < 0 on error or end of file
+ */
+int av_program_queue_read(AVProgramQueue *q, AVPacket *pkt);
+
+/**
+ * Detaches a queue from its input file and frees it together with the
+ * packets still queued in it. Queues still attached when the input file
+ * is closed are freed by av_close_input_stream().
+ */
+void av_program_queue_detach(AVProgramQueue *q);
+
 /**
  * Adds a new chapter.
  * This function is NOT part of the public API
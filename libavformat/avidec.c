@@ -25,6 +25,7 @@
 #include "libavutil/intreadwrite.h"
 #include "libavutil/bswap.h"
 #include "avformat.h"
+#include "internal.h"
 #include "avi.h"
 #include "dv.h"
 #include "riff.h"
@@ -32,6 +33,13 @@
 #undef NDEBUG
 #include <assert.h>
 
+typedef struct AVIIndexChunk {
+    int64_t pos;                      ///< position of the standard index chunk
+    int64_t timestamp;                ///< index timestamp of its first entry
+    int64_t duration;                 ///< in index timestamp units
+    int loaded;
+} AVIIndexChunk;
+
 typedef struct AVIStream {
     int64_t frame_offset; /* current frame (video) or byte (audio) counter
                          (used to compute the pts) */
@@ -48,6 +56,10 @@ typedef struct AVIStream {
     int prefix_count;
     uint32_t pal[256];
     int has_pal;
+
+    AVIIndexChunk *odml_chunks;       ///< standard indexes listed in the OpenDML super index
+    int nb_odml_chunks;
+    int odml_pending;                 ///< standard indexes not loaded yet
 } AVIStream;
 
 typedef struct {
@@ -74,6 +86,7 @@ static const char avi_headers[][8] = {
 
 static int avi_load_index(AVFormatContext *s);
 static int guess_ni_flag(AVFormatContext *s);
+static void avi_load_odml_chunk(AVFormatContext *s, AVStream *st, int n);
 
 #ifdef DEBUG
 static void print_tag(const char *str, unsigned int tag, int size)
@@ -111,7 +124,7 @@ static int get_riff(AVFormatContext *s, ByteIOContext *pb)
     return 0;
 }
 
-static int read_braindead_odml_indx(AVFormatContext *s, int frame_num){
+static int read_braindead_odml_indx(AVFormatContext *s){
     AVIContext *avi = s->priv_data;
     ByteIOContext *pb = s->pb;
     int longs_pre_entry= get_le16(pb);
@@ -155,19 +168,35 @@ static int read_braindead_odml_indx(AVFormatContext *s, int frame_num){
             return -1;
     }
 
-    for(i=0; i<entries_in_use; i++){
-        if(index_type){
-            int64_t pos= get_le32(pb) + base - 8;
-            int len    = get_le32(pb);
+    if(index_type){
+        /* standard index, read all entries at once and append them to
+           the stream index in a single pass */
+        uint8_t *buf;
+        int n;
+
+        if(entries_in_use <= 0)
+            goto done;
+        if(entries_in_use > INT_MAX / 8 || (filesize > 0 && 8LL*entries_in_use > filesize))
+            return -1;
+        buf= av_malloc(8*entries_in_use);
+        if(!buf)
+            return AVERROR(ENOMEM);
+        n= get_buffer(pb, buf, 8*entries_in_use);
+        n= FFMAX(n, 0) / 8;
+        if(ff_reserve_index_entries(st, n) < 0){
+            av_free(buf);
+            return AVERROR(ENOMEM);
+        }
+
+        for(i=0; i<n; i++){
+            int64_t pos= (uint32_t)AV_RL32(buf + 8*i) + base - 8;
+            int len    = AV_RL32(buf + 8*i + 4);
             int key= len >= 0;
             len &= 0x7FFFFFFF;
 
 #ifdef DEBUG_SEEK
             av_log(s, AV_LOG_ERROR, "pos:%"PRId64", len:%X\n", pos, len);
 #endif
-            if(url_feof(pb))
-                return -1;
-
             if(last_pos == pos || pos == base - 8)
                 avi->non_interleaved= 1;
             if(last_pos != pos && (len || !ast->sample_size))
@@ -178,29 +207,123 @@ static int read_braindead_odml_indx(AVFormatContext *s, int frame_num){
             else
                 ast->cum_len ++;
             last_pos= pos;
-        }else{
-            int64_t offset, pos;
-            int duration;
-            offset = get_le64(pb);
-            get_le32(pb);       /* size */
-            duration = get_le32(pb);
+        }
+        av_free(buf);
+        if(n < entries_in_use)
+            return -1;
+    }else{
+        /* super index, only remember where the standard indexes are,
+           they are loaded when a seek needs them */
+        int64_t ts= 0;
 
-            if(url_feof(pb))
-                return -1;
+        if(ast->odml_chunks || entries_in_use <= 0 || entries_in_use > INT_MAX / sizeof(AVIIndexChunk))
+            return -1;
+        ast->odml_chunks= av_mallocz(entries_in_use * sizeof(AVIIndexChunk));
+        if(!ast->odml_chunks)
+            return AVERROR(ENOMEM);
 
-            pos = url_ftell(pb);
+        for(i=0; i<entries_in_use; i++){
+            AVIIndexChunk *c= &ast->odml_chunks[i];
 
-            url_fseek(pb, offset+8, SEEK_SET);
-            read_braindead_odml_indx(s, frame_num);
-            frame_num += duration;
+            c->pos= get_le64(pb);
+            get_le32(pb);       /* size */
+            c->duration= get_le32(pb) * (int64_t)FFMAX(ast->sample_size, 1);
+            c->timestamp= ts;
+            ts += c->duration;
 
-            url_fseek(pb, pos, SEEK_SET);
+            if(url_feof(pb))
+                break;
         }
+        ast->nb_odml_chunks=
+        ast->odml_pending  = i;
+
+        /* the first one is needed to tell apart interleaved files */
+        if(i)
+            avi_load_odml_chunk(s, st, 0);
     }
+ done:
     avi->index_loaded=1;
     return 0;
 }
 
+static void avi_load_odml_all(AVFormatContext *s, AVStream *st)
+{
+    AVIStream *ast = st->priv_data;
+    int64_t pos = url_ftell(s->pb);
+    int i;
+
+    st->nb_index_entries = 0;
+    ast->cum_len = 0;
+    for (i = 0; i < ast->nb_odml_chunks; i++) {
+        ast->odml_chunks[i].loaded = 1;
+        url_fseek(s->pb, ast->odml_chunks[i].pos + 8, SEEK_SET);
+        if (read_braindead_odml_indx(s) < 0)
+            break;
+    }
+    ast->odml_pending = 0;
+    url_fseek(s->pb, pos, SEEK_SET);
+}
+
+/**
+ * Load the n-th standard index of a stream. The timestamps of its entries
+ * are derived from the durations in the super index, if they do not match
+ * the entries all standard indexes of the stream are loaded in order.
+ */
+static void avi_load_odml_chunk(AVFormatContext *s, AVStream *st, int n)
+{
+    AVIStream *ast = st->priv_data;
+    AVIIndexChunk *c = &ast->odml_chunks[n];
+    int64_t pos = url_ftell(s->pb);
+    int ret;
+
+    if (c->loaded)
+        return;
+    c->loaded = 1;
+    ast->odml_pending--;
+
+    ast->cum_len = c->timestamp;
+    url_fseek(s->pb, c->pos + 8, SEEK_SET);
+    ret = read_braindead_odml_indx(s);
+    url_fseek(s->pb, pos, SEEK_SET);
+
+    if (ret < 0 || ast->cum_len != c->timestamp + c->duration) {
+        if (ast->odml_pending) {
+            av_log(s, AV_LOG_DEBUG, "OpenDML super index durations do not match, "
+                   "loading all standard indexes of stream %d\n", st->index);
+            avi_load_odml_all(s, st);
+        }
+    }
+}
+
+/**
+ * Load the standard indexes of a stream needed to find the entry
+ * av_index_search_timestamp() returns for timestamp and flags.
+ */
+static void avi_load_odml_range(AVFormatContext *s, AVStream *st,
+                                int64_t timestamp, int flags)
+{
+    AVIStream *ast = st->priv_data;
+    int n, index;
+
+    for (n = 0; n + 1 < ast->nb_odml_chunks &&
+                ast->odml_chunks[n + 1].timestamp <= timestamp; n++);
+
+    while (ast->odml_pending && n >= 0 && n < ast->nb_odml_chunks) {
+        avi_load_odml_chunk(s, st, n);
+        index = av_index_search_timestamp(st, timestamp, flags);
+        if (flags & AVSEEK_FLAG_BACKWARD) {
+            if (index >= 0 && st->index_entries[index].timestamp >= ast->odml_chunks[n].timestamp)
+                break;
+            n--;
+        } else {
+            if (index >= 0 && (n + 1 == ast->nb_odml_chunks ||
+                               st->index_entries[index].timestamp < ast->odml_chunks[n + 1].timestamp))
+                break;
+            n++;
+        }
+    }
+}
+
 static void clean_index(AVFormatContext *s){
     int i;
     int64_t j;
@@ -566,7 +689,7 @@ static int avi_read_header(AVFormatContext *s, AVFormatParameters *ap)
         case MKTAG('i', 'n', 'd', 'x'):
             i= url_ftell(pb);
             if(!url_is_streamed(pb) && !(s->flags & AVFMT_FLAG_IGNIDX)){
-                read_braindead_odml_indx(s, 0);
+                read_braindead_odml_indx(s);
             }
             url_fseek(pb, i+size, SEEK_SET);
             break;
@@ -643,6 +766,12 @@ static int avi_read_header(AVFormatContext *s, AVFormatParameters *ap)
     avi->non_interleaved |= guess_ni_flag(s);
     if(avi->non_interleaved) {
         av_log(s, AV_LOG_INFO, "non-interleaved AVI\n");
+        /* packets are read in the order of the index */
+        for(i=0; i<s->nb_streams; i++){
+            ast = s->streams[i]->priv_data;
+            if(ast->odml_pending)
+                avi_load_odml_all(s, s->streams[i]);
+        }
         clean_index(s);
     }
 
@@ -910,7 +1039,7 @@ resync:
                 ast->packet_size= size + 8;
                 ast->remaining= size;
 
-                if(size || !ast->sample_size){
+                if((size || !ast->sample_size) && !ast->odml_pending){
                     uint64_t pos= url_ftell(pb) - 8;
                     if(!st->index_entries || !st->nb_index_entries || st->index_entries[st->nb_index_entries - 1].pos < pos){
                         av_add_index_entry(st, pos, ast->frame_offset, size, 0, AVINDEX_KEYFRAME);
@@ -935,17 +1064,47 @@ static int avi_read_idx1(AVFormatContext *s, int size)
     AVIStream *ast;
     unsigned int index, tag, flags, pos, len;
     unsigned last_pos= -1;
+    unsigned int count[MAX_STREAMS] = {0};
+    uint8_t *buf, *p;
+    int ret = 0;
 
     nb_index_entries = size / 16;
     if (nb_index_entries <= 0)
         return -1;
+    if (url_fsize(pb) > 0 && nb_index_entries > (url_fsize(pb) - url_ftell(pb)) / 16) {
+        nb_index_entries = (url_fsize(pb) - url_ftell(pb)) / 16;
+        ret = -1;
+    }
+
+    /* read the whole index at once so that the entries of each stream
+       can be reserved before they are added */
+    buf = av_malloc(16 * nb_index_entries);
+    if (!buf)
+        return AVERROR(ENOMEM);
+    i = get_buffer(pb, buf, 16 * nb_index_entries);
+    if (i < 16 * nb_index_entries) {
+        nb_index_entries = FFMAX(i, 0) / 16;
+        ret = -1;
+    }
+
+    for (i = 0, p = buf; i < nb_index_entries; i++, p += 16) {
+        tag   = AV_RL32(p);
+        index = ((tag & 0xff) - '0') * 10 + ((tag >> 8) & 0xff) - '0';
+        if (index < s->nb_streams)
+            count[index]++;
+    }
+    for (i = 0; i < s->nb_streams; i++)
+        if (count[i] && ff_reserve_index_entries(s->streams[i], count[i]) < 0) {
+            av_free(buf);
+            return AVERROR(ENOMEM);
+        }
 
     /* Read the entries and sort them in each stream component. */
-    for(i = 0; i < nb_index_entries; i++) {
-        tag = get_le32(pb);
-        flags = get_le32(pb);
-        pos = get_le32(pb);
-        len = get_le32(pb);
+    for(i = 0, p = buf; i < nb_index_entries; i++, p += 16) {
+        tag   = AV_RL32(p);
+        flags = AV_RL32(p +  4);
+        pos   = AV_RL32(p +  8);
+        len   = AV_RL32(p + 12);
 #if defined(DEBUG_SEEK)
         av_log(s, AV_LOG_DEBUG, "%d: tag=0x%x flags=0x%x pos=0x%x len=%d/",
                i, tag, flags, pos, len);
@@ -964,9 +1123,6 @@ static int avi_read_idx1(AVFormatContext *s, int size)
 #if defined(DEBUG_SEEK)
         av_log(s, AV_LOG_DEBUG, "%d cum_len=%"PRId64"\n", len, ast->cum_len);
 #endif
-        if(url_feof(pb))
-            return -1;
-
         if(last_pos == pos)
             avi->non_interleaved= 1;
         else if(len || !ast->sample_size)
@@ -977,7 +1133,8 @@ static int avi_read_idx1(AVFormatContext *s, int size)
             ast->cum_len ++;
         last_pos= pos;
     }
-    return 0;
+    av_free(buf);
+    return ret;
 }
 
 static int guess_ni_flag(AVFormatContext *s){
@@ -1062,7 +1219,7 @@ static int avi_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp
     AVIContext *avi = s->priv_data;
     AVStream *st;
     int i, index;
-    int64_t pos;
+    int64_t pos, ts2;
     AVIStream *ast;
 
     if (!avi->index_loaded) {
@@ -1074,6 +1231,7 @@ static int avi_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp
 
     st = s->streams[stream_index];
     ast= st->priv_data;
+    avi_load_odml_range(s, st, timestamp * FFMAX(ast->sample_size, 1), flags);
     index= av_index_search_timestamp(st, timestamp * FFMAX(ast->sample_size, 1), flags);
     if(index<0)
         return -1;
@@ -1106,15 +1264,15 @@ static int avi_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp
         ast2->packet_size=
         ast2->remaining= 0;
 
+        ts2 = av_rescale_q(timestamp, st->time_base, st2->time_base) * FFMAX(ast2->sample_size, 1);
+        avi_load_odml_range(s, st2, ts2, flags | AVSEEK_FLAG_BACKWARD);
+
         if (st2->nb_index_entries <= 0)
             continue;
 
 //        assert(st2->codec->block_align);
         assert((int64_t)st2->time_base.num*ast2->rate == (int64_t)st2->time_base.den*ast2->scale);
-        index = av_index_search_timestamp(
-                st2,
-                av_rescale_q(timestamp, st->time_base, st2->time_base) * FFMAX(ast2->sample_size, 1),
-                flags | AVSEEK_FLAG_BACKWARD);
+        index = av_index_search_timestamp(st2, ts2, flags | AVSEEK_FLAG_BACKWARD);
         if(index<0)
             index=0;
 
@@ -1143,7 +1301,10 @@ static int avi_read_close(AVFormatContext *s)
 
     for(i=0;i<s->nb_streams;i++) {
         AVStream *st = s->streams[i];
+        AVIStream *ast = st->priv_data;
         av_free(st->codec->palctrl);
+        if (ast)
+            av_freep(&ast->odml_chunks);
     }
 
     if (avi->dv_demux)
@@ -293,6 +293,7 @@ static void fill_buffer(ByteIOContext *s)
 {
     uint8_t *dst= !s->max_packet_size && s->buf_end - s->buffer < s->buffer_size ? s->buf_ptr : s->buffer;
     int len= s->buffer_size - (dst - s->buffer);
+    AV_PERF_START(fill_buffer)
 
     assert(s->buf_ptr == s->buf_end);
 
@@ -321,6 +322,7 @@ static void fill_buffer(ByteIOContext *s)
         s->buf_ptr = dst;
         s->buf_end = dst + len;
     }
+    AV_PERF_STOP(fill_buffer)
 }
 
 unsigned long ff_crc04C11DB7_update(unsigned long checksum, const uint8_t *buf,
@@ -0,0 +1,246 @@
+/*
+ * seek index cache
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/indexcache.c
+ * Keeps the keyframe index built while reading a file without a usable
+ * index in a sidecar file. Later opens of the same file load it back into
+ * the index of the streams, which av_seek_frame_binary() and
+ * av_seek_frame_generic() then use to seek without searching the file.
+ * Demuxers which build their own index from the file are left alone.
+ *
+ * The sidecar holds, all numbers little endian:
+ *   "FFIX", version (32 bits), size and modification time of the indexed
+ *   file (64 bits each), number of streams (32 bits), then for each
+ *   stream its id and number of entries (32 bits each) followed by
+ *   the entries as position and timestamp (64 bits each).
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#include "internal.h"
+
+#define INDEX_CACHE_VERSION 2
+
+typedef struct IndexCacheStream {
+    int id;
+    int nb_entries;
+    int64_t *entries;           ///< position and timestamp pairs
+} IndexCacheStream;
+
+struct AVIndexCache {
+    int64_t file_size;
+    int64_t file_mtime;
+    IndexCacheStream *streams;
+    int nb_streams;
+    int nb_applied;             ///< streams whose entries were added to the index
+    int nb_entries;             ///< entries loaded, the cache is only rewritten if more are known
+};
+
+static int64_t file_mtime(const char *filename)
+{
+    struct stat st;
+
+    av_strstart(filename, "file:", &filename);
+    if (strstr(filename, "://") || stat(filename, &st) < 0)
+        return 0;
+    return st.st_mtime;
+}
+
+/**
+ * Return whether the demuxer seeks with an index built while reading,
+ * rather than with one it reads from the file itself.
+ */
+static int has_generic_index(AVFormatContext *s)
+{
+    return (s->iformat->flags & AVFMT_GENERIC_INDEX) || s->iformat->read_timestamp;
+}
+
+static int nb_keyframe_entries(AVStream *st)
+{
+    int i, n = 0;
+
+    for (i = 0; i < st->nb_index_entries; i++)
+        n += !!(st->index_entries[i].flags & AVINDEX_KEYFRAME);
+    return n;
+}
+
+static void free_streams(AVIndexCache *ic)
+{
+    int i;
+
+    for (i = 0; i < ic->nb_streams; i++)
+        av_free(ic->streams[i].entries);
+    av_freep(&ic->streams);
+    ic->nb_streams = 0;
+}
+
+static int read_cache(AVFormatContext *s, AVIndexCache *ic, ByteIOContext *pb)
+{
+    int i, j, nb_streams;
+
+    if (get_le32(pb) != MKTAG('F','F','I','X') ||
+        get_le32(pb) != INDEX_CACHE_VERSION ||
+        get_le64(pb) != ic->file_size ||
+        get_le64(pb) != ic->file_mtime)
+        return -1;
+    nb_streams = get_le32(pb);
+    if (nb_streams <= 0 || nb_streams > MAX_STREAMS)
+        return -1;
+    ic->streams = av_mallocz(nb_streams * sizeof(*ic->streams));
+    if (!ic->streams)
+        return AVERROR(ENOMEM);
+    ic->nb_streams = nb_streams;
+
+    for (i = 0; i < nb_streams; i++) {
+        IndexCacheStream *cs = &ic->streams[i];
+        cs->id         = get_le32(pb);
+        cs->nb_entries = get_le32(pb);
+        if ((unsigned)cs->nb_entries >= INT_MAX / (2 * sizeof(int64_t)))
+            return -1;
+        if (!cs->nb_entries)
+            continue;
+        cs->entries = av_malloc(2 * cs->nb_entries * sizeof(int64_t));
+        if (!cs->entries)
+            return AVERROR(ENOMEM);
+        for (j = 0; j < 2 * cs->nb_entries; j++)
+            cs->entries[j] = get_le64(pb);
+        ic->nb_entries += cs->nb_entries;
+    }
+    if (url_feof(pb) || url_ferror(pb))
+        return -1;
+    return 0;
+}
+
+void ff_index_cache_open(AVFormatContext *s)
+{
+    AVIndexCache *ic;
+    ByteIOContext *pb;
+
+    if (!s->index_cache_path || !s->pb || url_is_streamed(s->pb) ||
+        !has_generic_index(s))
+        return;
+    ic = s->index_cache = av_mallocz(sizeof(AVIndexCache));
+    if (!ic)
+        return;
+    ic->file_size  = url_fsize(s->pb);
+    ic->file_mtime = file_mtime(s->filename);
+
+    if (url_fopen(&pb, s->index_cache_path, URL_RDONLY) < 0)
+        return;
+    if (read_cache(s, ic, pb) < 0) {
+        av_log(s, AV_LOG_VERBOSE, "ignoring index cache %s\n", s->index_cache_path);
+        free_streams(ic);
+        ic->nb_entries = 0;
+    } else
+        av_log(s, AV_LOG_VERBOSE, "loaded %d index entries from %s\n",
+               ic->nb_entries, s->index_cache_path);
+    url_fclose(pb);
+
+    ff_index_cache_apply(s);
+}
+
+void ff_index_cache_apply(AVFormatContext *s)
+{
+    AVIndexCache *ic = s->index_cache;
+    int i, j;
+
+    if (!ic || ic->nb_applied == ic->nb_streams)
+        return;
+    for (i = 0; i < ic->nb_streams && i < s->nb_streams; i++) {
+        IndexCacheStream *cs = &ic->streams[i];
+        AVStream *st = s->streams[i];
+
+        if (!cs->entries || st->id != cs->id)
+            continue;
+        if (ff_reserve_index_entries(st, cs->nb_entries) >= 0) {
+            for (j = 0; j < cs->nb_entries; j++) {
+                int64_t timestamp = cs->entries[2*j+1];
+                int k = av_index_search_timestamp(st, timestamp, AVSEEK_FLAG_ANY);
+
+                /* never replace what the demuxer already knows */
+                if (k >= 0 && st->index_entries[k].timestamp == timestamp)
+                    continue;
+                av_add_index_entry(st, cs->entries[2*j], timestamp,
+                                   0, 0, AVINDEX_KEYFRAME);
+            }
+        }
+        av_freep(&cs->entries);
+        ic->nb_applied++;
+    }
+}
+
+static void write_cache(AVFormatContext *s, ByteIOContext *pb)
+{
+    AVIndexCache *ic = s->index_cache;
+    int i, j;
+
+    put_tag(pb, "FFIX");
+    put_le32(pb, INDEX_CACHE_VERSION);
+    put_le64(pb, ic->file_size);
+    put_le64(pb, ic->file_mtime);
+    put_le32(pb, s->nb_streams);
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *st = s->streams[i];
+        put_le32(pb, st->id);
+        put_le32(pb, nb_keyframe_entries(st));
+        for (j = 0; j < st->nb_index_entries; j++) {
+            if (!(st->index_entries[j].flags & AVINDEX_KEYFRAME))
+                continue;
+            put_le64(pb, st->index_entries[j].pos);
+            put_le64(pb, st->index_entries[j].timestamp);
+        }
+    }
+}
+
+void ff_index_cache_close(AVFormatContext *s)
+{
+    AVIndexCache *ic = s->index_cache;
+    ByteIOContext *pb;
+    char tmp[1024];
+    int i, nb_entries = 0;
+
+    if (!ic)
+        return;
+    for (i = 0; i < s->nb_streams; i++)
+        nb_entries += nb_keyframe_entries(s->streams[i]);
+
+    /* write to a temporary file so that concurrent readers never see
+       a partial cache */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s->index_cache_path);
+    if (s->nb_streams && nb_entries > ic->nb_entries &&
+        url_fopen(&pb, tmp, URL_WRONLY) >= 0) {
+        write_cache(s, pb);
+        put_flush_packet(pb);
+        i = url_ferror(pb);
+        url_fclose(pb);
+        if (i < 0 || rename(tmp, s->index_cache_path) < 0) {
+            av_log(s, AV_LOG_WARNING, "could not write index cache %s\n",
+                   s->index_cache_path);
+            unlink(tmp);
+        }
+    }
+
+    free_streams(ic);
+    av_freep(&s->index_cache);
+}
@@ -35,4 +35,64 @@ void av_program_add_stream_index(AVFormatContext *ac, int progid, unsigned int i
 void ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
                               int (*compare)(AVFormatContext *, AVPacket *, AVPacket *));
 
+/**
+ * Make room for count more entries in the index of st, so that adding
+ * them does not reallocate it.
+ * @return 0 if OK, < 0 on error
+ */
+int ff_reserve_index_entries(AVStream *st, unsigned int count);
+
+/**
+ * Interleave packets by the order of AVFormatContext->packet_buffer, as
+ * built by ff_interleave_add_packet(). A packet is output once every
+ * stream has one buffered, or on flush.
+ * Same parameters and return value as av_interleave_packet_per_dts(),
+ * pkt is added with ff_interleave_compare_dts().
+ */
+int ff_interleave_packet_list(AVFormatContext *s, AVPacket *out,
+                              AVPacket *pkt, int flush);
+
+/**
+ * Get a zeroed AVPacketList node from the pool of the context.
+ */
+AVPacketList *ff_packet_pool_get_node(AVFormatContext *s);
+
+/**
+ * Give a node obtained with ff_packet_pool_get_node() back to the pool.
+ */
+void ff_packet_pool_put_node(AVFormatContext *s, AVPacketList *pktl);
+
+/**
+ * Same as av_dup_packet(), but a payload which has to be copied is put in
+ * a buffer from the pool of the context. The packet must be freed in the
+ * thread using the context.
+ */
+int ff_packet_pool_dup_packet(AVFormatContext *s, AVPacket *pkt);
+
+/**
+ * Free the pool of the context. Payloads still in use are freed when
+ * their packets are.
+ */
+void ff_packet_pool_close(AVFormatContext *s);
+
+typedef struct AVIndexCache AVIndexCache;
+
+/**
+ * Load the index cache of a just opened input if s->index_cache_path is set.
+ * A missing or stale cache is ignored.
+ */
+void ff_index_cache_open(AVFormatContext *s);
+
+/**
+ * Add the entries loaded from the index cache to the streams created
+ * since the last call.
+ */
+void ff_index_cache_apply(AVFormatContext *s);
+
+/**
+ * Write the index cache if more entries are known than were loaded,
+ * and free it.
+ */
+void ff_index_cache_close(AVFormatContext *s);
+
 #endif /* AVFORMAT_INTERNAL_H */
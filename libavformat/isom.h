@@ -87,6 +87,23 @@ typedef struct {
     unsigned flags;
 } MOVTrackExt;
 
+typedef struct {
+    int64_t key;          ///< file position or dts in AV_TIME_BASE of the next sample
+    int stream_index;
+} MOVHeapEntry;
+
+/**
+ * Min-heap of the streams which still have samples to demux,
+ * keyed by the position or dts of their next sample.
+ */
+typedef struct {
+    MOVHeapEntry *entries;
+    int nb_entries;
+} MOVSampleHeap;
+
+#define MOV_HEAP_POS 0
+#define MOV_HEAP_DTS 1
+
 typedef struct MOVStreamContext {
     ByteIOContext *pb;
     int ffindex;          ///< AVStream index
@@ -123,6 +140,7 @@ typedef struct MOVStreamContext {
     int width;            ///< tkhd width
     int height;           ///< tkhd height
     int dts_shift;        ///< dts shift when ctts is negative
+    int heap_slot[2];     ///< position in the pos/dts sample heaps, -1 if absent
 } MOVStreamContext;
 
 typedef struct MOVContext {
@@ -138,6 +156,8 @@ typedef struct MOVContext {
     MOVTrackExt *trex_data;
     unsigned trex_count;
     int itunes_metadata;  ///< metadata are itunes style
+    MOVSampleHeap sample_heap[2]; ///< next sample selection, indexed by MOV_HEAP_POS/MOV_HEAP_DTS
+    int sample_heap_dirty;        ///< heaps must be rebuilt before selecting the next sample
 } MOVContext;
 
 int ff_mp4_read_descr_len(ByteIOContext *pb);
@@ -233,6 +233,11 @@ typedef struct {
     int done;
     int has_cluster_id;
 
+    /* position of the first cluster, where indexing files without cues starts */
+    int64_t first_cluster_pos;
+    /* whether the index covers the whole file, from cues or a full scan */
+    int index_complete;
+
     /* What to skip before effectively reading a packet. */
     int skip_to_keyframe;
     uint64_t skip_to_timecode;
@@ -633,8 +638,10 @@ static int ebml_read_ascii(ByteIOContext *pb, int size, char **str)
 static int ebml_read_binary(ByteIOContext *pb, int length, EbmlBin *bin)
 {
     av_free(bin->data);
-    if (!(bin->data = av_malloc(length)))
+    /* padded so that unlaced blocks can be handed out without copying */
+    if (!(bin->data = av_malloc(length + FF_INPUT_BUFFER_PADDING_SIZE)))
         return AVERROR(ENOMEM);
+    memset(bin->data + length, 0, FF_INPUT_BUFFER_PADDING_SIZE);
 
     bin->size = length;
     bin->pos  = url_ftell(pb);
@@ -979,10 +986,19 @@ static void matroska_fix_ass_packet(MatroskaDemuxContext *matroska,
 
 static void matroska_merge_packets(AVPacket *out, AVPacket *in)
 {
-    out->data = av_realloc(out->data, out->size+in->size);
-    memcpy(out->data+out->size, in->data, in->size);
-    out->size += in->size;
-    av_destruct_packet(in);
+    int size = out->size + in->size;
+    uint8_t *data = av_malloc(size + FF_INPUT_BUFFER_PADDING_SIZE);
+
+    if (data) {
+        memcpy(data, out->data, out->size);
+        memcpy(data+out->size, in->data, in->size);
+        memset(data+size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+        av_free_packet(out);
+        out->data     = data;
+        out->size     = size;
+        out->destruct = av_destruct_packet;
+    }
+    av_free_packet(in);
     av_free(in);
 }
 
@@ -1453,6 +1469,10 @@ static int matroska_read_header(AVFormatContext *s, AVFormatParameters *ap)
 
     matroska_convert_tags(s);
 
+    matroska->index_complete = index_list->nb_elem > 0;
+    if (matroska->has_cluster_id)
+        matroska->first_cluster_pos = url_ftell(s->pb) - 4;
+
     return 0;
 }
 
@@ -1498,11 +1518,22 @@ static void matroska_clear_queue(MatroskaDemuxContext *matroska)
     }
 }
 
-static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
-                                int size, int64_t pos, uint64_t cluster_time,
+static void matroska_destruct_block(AVPacket *pkt)
+{
+    /* copies of the packet whose data was taken over keep the destructor */
+    if (pkt->data)
+        av_freep(&pkt->priv);
+    pkt->data = NULL; pkt->size = 0;
+}
+
+static int matroska_parse_block(MatroskaDemuxContext *matroska, EbmlBin *bin,
+                                uint64_t cluster_time,
                                 uint64_t duration, int is_keyframe,
                                 int64_t cluster_pos)
 {
+    uint8_t *data = bin->data;
+    int size = bin->size;
+    int64_t pos = bin->pos;
     uint64_t timecode = AV_NOPTS_VALUE;
     MatroskaTrack *track;
     int res = 0;
@@ -1680,15 +1711,31 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
                 }
 
                 pkt = av_mallocz(sizeof(AVPacket));
-                /* XXX: prevent data copy... */
-                if (av_new_packet(pkt, pkt_size+offset) < 0) {
-                    av_free(pkt);
+                if (!pkt) {
                     res = AVERROR(ENOMEM);
                     break;
                 }
-                if (offset)
-                    memcpy (pkt->data, encodings->compression.settings.data, offset);
-                memcpy (pkt->data+offset, pkt_data, pkt_size);
+                av_init_packet(pkt);
+                if (laces == 1 && pkt_data == data && !offset
+                    && st->codec->codec_id != CODEC_ID_SSA) {
+                    /* the block is the end of the padded element buffer,
+                       which the packet takes over */
+                    pkt->data     = data;
+                    pkt->size     = pkt_size;
+                    pkt->priv     = bin->data;
+                    pkt->destruct = matroska_destruct_block;
+                    bin->data = NULL;
+                    bin->size = 0;
+                } else {
+                    if (av_new_packet(pkt, pkt_size+offset) < 0) {
+                        av_free(pkt);
+                        res = AVERROR(ENOMEM);
+                        break;
+                    }
+                    if (offset)
+                        memcpy (pkt->data, encodings->compression.settings.data, offset);
+                    memcpy (pkt->data+offset, pkt_data, pkt_size);
+                }
 
                 if (pkt_data != data)
                     av_free(pkt_data);
@@ -1750,9 +1797,8 @@ static int matroska_parse_cluster(MatroskaDemuxContext *matroska)
     for (i=0; i<blocks_list->nb_elem; i++)
         if (blocks[i].bin.size > 0) {
             int is_keyframe = blocks[i].non_simple ? !blocks[i].reference : -1;
-            res=matroska_parse_block(matroska,
-                                     blocks[i].bin.data, blocks[i].bin.size,
-                                     blocks[i].bin.pos,  cluster.timecode,
+            res=matroska_parse_block(matroska, &blocks[i].bin,
+                                     cluster.timecode,
                                      blocks[i].duration, is_keyframe,
                                      pos);
         }
@@ -1761,6 +1807,114 @@ static int matroska_parse_cluster(MatroskaDemuxContext *matroska)
     return res;
 }
 
+/*
+ * Read the ID and size of the next element for scanning.
+ * Returns: 0 on success, < 0 on error or for elements of unknown size
+ */
+static int matroska_scan_element(MatroskaDemuxContext *matroska,
+                                 uint64_t *id, int64_t *end)
+{
+    ByteIOContext *pb = matroska->ctx->pb;
+    uint64_t length;
+    int res;
+
+    if ((res = ebml_read_num(matroska, pb, 4, id)) < 0)
+        return res;
+    *id |= 1 << 7*res;
+    if ((res = ebml_read_num(matroska, pb, 8, &length)) < 0)
+        return res;
+    if (length == (1ULL << 7*res) - 1)
+        return AVERROR(ENOSYS);
+    *end = url_ftell(pb) + length;
+    return 0;
+}
+
+/*
+ * Add the block starting at the current position to the index, reading
+ * only its header.
+ */
+static void matroska_scan_block(MatroskaDemuxContext *matroska,
+                                uint64_t cluster_time, int is_keyframe,
+                                int64_t cluster_pos)
+{
+    ByteIOContext *pb = matroska->ctx->pb;
+    MatroskaTrack *track;
+    int16_t block_time;
+    uint64_t num;
+    int flags;
+
+    if (ebml_read_num(matroska, pb, 8, &num) < 0)
+        return;
+    block_time = get_be16(pb);
+    flags = get_byte(pb);
+    if (is_keyframe == -1)
+        is_keyframe = flags & 0x80;
+
+    track = matroska_find_track_by_num(matroska, num);
+    if (!track || !track->stream || !is_keyframe
+        || track->type == MATROSKA_TRACK_TYPE_SUBTITLE)
+        return;
+    if (cluster_time != (uint64_t)-1
+        && (block_time >= 0 || cluster_time >= -block_time))
+        av_add_index_entry(track->stream, cluster_pos,
+                           cluster_time + block_time, 0, 0, AVINDEX_KEYFRAME);
+}
+
+/*
+ * Index the keyframes of the next top level element if it is a cluster,
+ * reading the block headers only, and skip it.
+ * Returns: 0 on success, < 0 at the end of the file or on error
+ */
+static int matroska_scan_cluster(MatroskaDemuxContext *matroska)
+{
+    ByteIOContext *pb = matroska->ctx->pb;
+    int64_t cluster_pos = url_ftell(pb), end, elem_end, sub_end;
+    uint64_t id, cluster_time = (uint64_t)-1;
+    int res;
+
+    if ((res = matroska_scan_element(matroska, &id, &end)) < 0)
+        return res;
+
+    if (id == MATROSKA_ID_CLUSTER) {
+        while (url_ftell(pb) < end) {
+            if ((res = matroska_scan_element(matroska, &id, &elem_end)) < 0)
+                return res;
+            switch (id) {
+            case MATROSKA_ID_CLUSTERTIMECODE:
+                ebml_read_uint(pb, elem_end - url_ftell(pb), &cluster_time);
+                break;
+            case MATROSKA_ID_SIMPLEBLOCK:
+                matroska_scan_block(matroska, cluster_time, -1, cluster_pos);
+                break;
+            case MATROSKA_ID_BLOCKGROUP: {
+                int64_t block_pos = -1;
+                int is_keyframe = 1;
+                while (url_ftell(pb) < elem_end) {
+                    if ((res = matroska_scan_element(matroska, &id, &sub_end)) < 0)
+                        return res;
+                    if (id == MATROSKA_ID_BLOCK)
+                        block_pos = url_ftell(pb);
+                    else if (id == MATROSKA_ID_BLOCKREFERENCE)
+                        is_keyframe = 0;
+                    if (url_fseek(pb, sub_end, SEEK_SET) < 0)
+                        return AVERROR(EIO);
+                }
+                if (block_pos >= 0 && url_fseek(pb, block_pos, SEEK_SET) >= 0)
+                    matroska_scan_block(matroska, cluster_time, is_keyframe,
+                                        cluster_pos);
+                break;
+            }
+            }
+            if (url_fseek(pb, elem_end, SEEK_SET) < 0)
+                return AVERROR(EIO);
+        }
+    }
+
+    if (url_fseek(pb, end, SEEK_SET) < 0 || url_feof(pb))
+        return AVERROR(EIO);
+    return 0;
+}
+
 static int matroska_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     MatroskaDemuxContext *matroska = s->priv_data;
@@ -1782,12 +1936,34 @@ static int matroska_read_seek(AVFormatContext *s, int stream_index,
     AVStream *st = s->streams[stream_index];
     int i, index, index_sub, index_min;
 
+    int64_t before_pos = url_ftell(s->pb);
+    int has_cluster_id = matroska->has_cluster_id, done = matroska->done;
+
+    /* Without cues, the index only covers the clusters read so far:
+     * extend it up to the timestamp from the headers of the blocks. */
+    if (!matroska->index_complete && matroska->first_cluster_pos
+        && (!st->nb_index_entries
+            || st->index_entries[st->nb_index_entries-1].timestamp < timestamp)) {
+        int64_t pos = st->nb_index_entries ? st->index_entries[st->nb_index_entries-1].pos
+                                           : matroska->first_cluster_pos;
+        int res = 0;
+        url_fseek(s->pb, pos, SEEK_SET);
+        while (!st->nb_index_entries
+               || st->index_entries[st->nb_index_entries-1].timestamp < timestamp)
+            if ((res = matroska_scan_cluster(matroska)) < 0)
+                break;
+        if (url_feof(s->pb))
+            matroska->index_complete = 1;
+        matroska->has_cluster_id = 0;
+    }
+
     if (!st->nb_index_entries)
-        return 0;
+        goto fail;
     timestamp = FFMAX(timestamp, st->index_entries[0].timestamp);
 
     if ((index = av_index_search_timestamp(st, timestamp, flags)) < 0) {
         url_fseek(s->pb, st->index_entries[st->nb_index_entries-1].pos, SEEK_SET);
+        matroska->has_cluster_id = 0;
         while ((index = av_index_search_timestamp(st, timestamp, flags)) < 0) {
             matroska_clear_queue(matroska);
             if (matroska_parse_cluster(matroska) < 0)
@@ -1797,7 +1973,7 @@ static int matroska_read_seek(AVFormatContext *s, int stream_index,
 
     matroska_clear_queue(matroska);
     if (index < 0)
-        return 0;
+        goto fail;
 
     index_min = index;
     for (i=0; i < matroska->tracks.nb_elem; i++) {
@@ -1813,11 +1989,17 @@ static int matroska_read_seek(AVFormatContext *s, int stream_index,
     }
 
     url_fseek(s->pb, st->index_entries[index_min].pos, SEEK_SET);
+    matroska->has_cluster_id = 0;
     matroska->skip_to_keyframe = !(flags & AVSEEK_FLAG_ANY);
     matroska->skip_to_timecode = st->index_entries[index].timestamp;
     matroska->done = 0;
     av_update_cur_dts(s, st, st->index_entries[index].timestamp);
     return 0;
+fail:
+    url_fseek(s->pb, before_pos, SEEK_SET);
+    matroska->has_cluster_id = has_cluster_id;
+    matroska->done = done;
+    return 0;
 }
 
 static int matroska_read_close(AVFormatContext *s)
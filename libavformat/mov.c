@@ -29,6 +29,7 @@
 #include "libavutil/intreadwrite.h"
 #include "libavutil/avstring.h"
 #include "avformat.h"
+#include "internal.h"
 #include "riff.h"
 #include "isom.h"
 #include "libavcodec/mpeg4audio.h"
@@ -1458,6 +1459,9 @@ static void mov_build_index(MOVContext *mov, AVStream *st)
 
         current_dts -= sc->dts_shift;
 
+        if (ff_reserve_index_entries(st, sc->sample_count) < 0)
+            return;
+
         for (i = 0; i < sc->chunk_count; i++) {
             current_offset = sc->chunk_offsets[i];
             if (stsc_index + 1 < sc->stsc_count &&
@@ -1485,7 +1489,7 @@ static void mov_build_index(MOVContext *mov, AVStream *st)
                 if(sc->pseudo_stream_id == -1 ||
                    sc->stsc_data[stsc_index].id - 1 == sc->pseudo_stream_id) {
                     av_add_index_entry(st, current_offset, current_dts, sample_size, distance,
-                                    keyframe ? AVINDEX_KEYFRAME : 0);
+                                       keyframe ? AVINDEX_KEYFRAME : 0);
                     dprintf(mov->fc, "AVIndex stream %d, sample %d, offset %"PRIx64", dts %"PRId64", "
                             "size %d, distance %d, keyframe %d\n", st->index, current_sample,
                             current_offset, current_dts, sample_size, distance, keyframe);
@@ -1610,6 +1614,7 @@ static int mov_read_trak(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
     st->priv_data = sc;
     st->codec->codec_type = CODEC_TYPE_DATA;
     sc->ffindex = st->index;
+    sc->heap_slot[MOV_HEAP_POS] = sc->heap_slot[MOV_HEAP_DTS] = -1;
 
     if ((ret = mov_read_default(c, pb, atom)) < 0)
         return ret;
@@ -1882,6 +1887,8 @@ static int mov_read_trun(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
             return AVERROR(ENOMEM);
         sc->ctts_data = ctts_data;
     }
+    if (ff_reserve_index_entries(st, entries) < 0)
+        return AVERROR(ENOMEM);
     dts = st->duration;
     offset = frag->base_data_offset + data_offset;
     distance = 0;
@@ -2146,34 +2153,149 @@ static int mov_read_header(AVFormatContext *s, AVFormatParameters *ap)
         return -1;
     }
     dprintf(mov->fc, "on_parse_exit_offset=%lld\n", url_ftell(pb));
+    mov->sample_heap_dirty = 1;
 
     return 0;
 }
 
-static AVIndexEntry *mov_find_next_sample(AVFormatContext *s, AVStream **st)
+static void mov_heap_swap(AVFormatContext *s, int which, int a, int b)
 {
-    AVIndexEntry *sample = NULL;
-    int64_t best_dts = INT64_MAX;
-    int i;
+    MOVContext *mov = s->priv_data;
+    MOVHeapEntry *entries = mov->sample_heap[which].entries;
+    MOVHeapEntry tmp = entries[a];
+    MOVStreamContext *sca, *scb;
+
+    entries[a] = entries[b];
+    entries[b] = tmp;
+    sca = s->streams[entries[a].stream_index]->priv_data;
+    scb = s->streams[entries[b].stream_index]->priv_data;
+    sca->heap_slot[which] = a;
+    scb->heap_slot[which] = b;
+}
+
+static void mov_heap_sift(AVFormatContext *s, int which, int i)
+{
+    MOVContext *mov = s->priv_data;
+    MOVSampleHeap *heap = &mov->sample_heap[which];
+
+    while (i > 0 && heap->entries[i].key < heap->entries[(i - 1) >> 1].key) {
+        mov_heap_swap(s, which, i, (i - 1) >> 1);
+        i = (i - 1) >> 1;
+    }
+    for (;;) {
+        int child = 2*i + 1;
+        if (child >= heap->nb_entries)
+            break;
+        if (child + 1 < heap->nb_entries &&
+            heap->entries[child + 1].key < heap->entries[child].key)
+            child++;
+        if (heap->entries[i].key <= heap->entries[child].key)
+            break;
+        mov_heap_swap(s, which, i, child);
+        i = child;
+    }
+}
+
+/**
+ * Insert, move or remove a stream in a sample heap according to its
+ * current sample.
+ */
+static void mov_heap_update(AVFormatContext *s, int which, AVStream *st)
+{
+    MOVContext *mov = s->priv_data;
+    MOVSampleHeap *heap = &mov->sample_heap[which];
+    MOVStreamContext *sc = st->priv_data;
+    int i = sc->heap_slot[which];
+
+    if (sc->current_sample >= st->nb_index_entries) {
+        if (i < 0)
+            return;
+        mov_heap_swap(s, which, i, --heap->nb_entries);
+        sc->heap_slot[which] = -1;
+        if (i < heap->nb_entries)
+            mov_heap_sift(s, which, i);
+        return;
+    }
+    if (i < 0) {
+        i = heap->nb_entries++;
+        heap->entries[i].stream_index = st->index;
+        sc->heap_slot[which] = i;
+    }
+    if (which == MOV_HEAP_POS)
+        heap->entries[i].key = st->index_entries[sc->current_sample].pos;
+    else
+        heap->entries[i].key = av_rescale(st->index_entries[sc->current_sample].timestamp,
+                                          AV_TIME_BASE, sc->time_scale);
+    mov_heap_sift(s, which, i);
+}
+
+static int mov_build_sample_heaps(AVFormatContext *s)
+{
+    MOVContext *mov = s->priv_data;
+    int i, j;
+
+    for (j = 0; j < 2; j++) {
+        MOVHeapEntry *entries = av_realloc(mov->sample_heap[j].entries,
+                                           s->nb_streams * sizeof(*entries));
+        if (!entries)
+            return AVERROR(ENOMEM);
+        mov->sample_heap[j].entries = entries;
+        mov->sample_heap[j].nb_entries = 0;
+    }
     for (i = 0; i < s->nb_streams; i++) {
-        AVStream *avst = s->streams[i];
-        MOVStreamContext *msc = avst->priv_data;
-        if (msc->pb && msc->current_sample < avst->nb_index_entries) {
-            AVIndexEntry *current_sample = &avst->index_entries[msc->current_sample];
-            int64_t dts = av_rescale(current_sample->timestamp, AV_TIME_BASE, msc->time_scale);
-            dprintf(s, "stream %d, sample %d, dts %"PRId64"\n", i, msc->current_sample, dts);
-            if (!sample || (url_is_streamed(s->pb) && current_sample->pos < sample->pos) ||
-                (!url_is_streamed(s->pb) &&
-                 ((msc->pb != s->pb && dts < best_dts) || (msc->pb == s->pb &&
-                 ((FFABS(best_dts - dts) <= AV_TIME_BASE && current_sample->pos < sample->pos) ||
-                  (FFABS(best_dts - dts) > AV_TIME_BASE && dts < best_dts)))))) {
-                sample = current_sample;
-                best_dts = dts;
-                *st = avst;
-            }
+        AVStream *st = s->streams[i];
+        MOVStreamContext *sc = st->priv_data;
+
+        sc->heap_slot[MOV_HEAP_POS] = sc->heap_slot[MOV_HEAP_DTS] = -1;
+        if (!sc->pb)
+            continue;
+        /* position order is only meaningful within the main file, streams
+           in external references are scheduled by dts alone */
+        if (url_is_streamed(s->pb) || sc->pb == s->pb)
+            mov_heap_update(s, MOV_HEAP_POS, st);
+        if (!url_is_streamed(s->pb))
+            mov_heap_update(s, MOV_HEAP_DTS, st);
+    }
+    mov->sample_heap_dirty = 0;
+    return 0;
+}
+
+/**
+ * Pick the stream whose next sample should be read: samples are read in
+ * file order, unless a stream lags more than one second behind.
+ * The sample heaps must have been built with mov_build_sample_heaps().
+ */
+static AVIndexEntry *mov_find_next_sample(AVFormatContext *s, AVStream **st)
+{
+    MOVContext *mov = s->priv_data;
+    MOVSampleHeap *pos_heap = &mov->sample_heap[MOV_HEAP_POS];
+    MOVSampleHeap *dts_heap = &mov->sample_heap[MOV_HEAP_DTS];
+    AVStream *avst = NULL;
+    MOVStreamContext *msc;
+
+    if (pos_heap->nb_entries)
+        avst = s->streams[pos_heap->entries[0].stream_index];
+    if (dts_heap->nb_entries) {
+        AVStream *first = s->streams[dts_heap->entries[0].stream_index];
+        int64_t first_dts = dts_heap->entries[0].key;
+        msc = first->priv_data;
+        if (!avst || msc->pb != s->pb) {
+            avst = first;
+        } else {
+            MOVStreamContext *sc = avst->priv_data;
+            int64_t dts = av_rescale(avst->index_entries[sc->current_sample].timestamp,
+                                     AV_TIME_BASE, sc->time_scale);
+            if (first_dts < dts - AV_TIME_BASE)
+                avst = first;
         }
     }
-    return sample;
+    if (!avst)
+        return NULL;
+    msc = avst->priv_data;
+    dprintf(s, "stream %d, sample %d, pos 0x%"PRIx64"\n", avst->index,
+            msc->current_sample, avst->index_entries[msc->current_sample].pos);
+    *st = avst;
+    return &avst->index_entries[msc->current_sample];
 }
 
 static int mov_read_packet(AVFormatContext *s, AVPacket *pkt)
@@ -2184,6 +2306,8 @@ static int mov_read_packet(AVFormatContext *s, AVPacket *pkt)
     AVStream *st = NULL;
     int ret;
  retry:
+    if (mov->sample_heap_dirty && (ret = mov_build_sample_heaps(s)) < 0)
+        return ret;
     sample = mov_find_next_sample(s, &st);
     if (!sample) {
         mov->found_mdat = 0;
@@ -2192,11 +2316,16 @@ static int mov_read_packet(AVFormatContext *s, AVPacket *pkt)
             url_feof(s->pb))
             return AVERROR_EOF;
         dprintf(s, "read fragments, offset 0x%llx\n", url_ftell(s->pb));
+        mov->sample_heap_dirty = 1;
         goto retry;
     }
     sc = st->priv_data;
     /* must be done just before reading, to avoid infinite loop on sample */
     sc->current_sample++;
+    if (sc->heap_slot[MOV_HEAP_POS] >= 0)
+        mov_heap_update(s, MOV_HEAP_POS, st);
+    if (sc->heap_slot[MOV_HEAP_DTS] >= 0)
+        mov_heap_update(s, MOV_HEAP_DTS, st);
 
     if (st->discard != AVDISCARD_ALL) {
         if (url_fseek(sc->pb, sample->pos, SEEK_SET) != sample->pos) {
@@ -2249,6 +2378,7 @@ static int mov_read_packet(AVFormatContext *s, AVPacket *pkt)
 
 static int mov_seek_stream(AVFormatContext *s, AVStream *st, int64_t timestamp, int flags)
 {
+    MOVContext *mov = s->priv_data;
     MOVStreamContext *sc = st->priv_data;
     int sample, time_sample;
     int i;
@@ -2258,6 +2388,7 @@ static int mov_seek_stream(AVFormatContext *s, AVStream *st, int64_t timestamp,
     if (sample < 0) /* not sure what to do */
         return -1;
     sc->current_sample = sample;
+    mov->sample_heap_dirty = 1;
     dprintf(s, "stream %d, found sample %d\n", st->index, sc->current_sample);
     /* adjust ctts index */
     if (sc->ctts_data) {
@@ -2337,6 +2468,8 @@ static int mov_read_close(AVFormatContext *s)
     }
 
     av_freep(&mov->trex_data);
+    av_freep(&mov->sample_heap[MOV_HEAP_POS].entries);
+    av_freep(&mov->sample_heap[MOV_HEAP_DTS].entries);
 
     return 0;
 }
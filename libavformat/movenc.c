@@ -34,6 +34,8 @@
 
 #define MOV_INDEX_CLUSTER_SIZE 16384
 #define MOV_TIMESCALE 1000
+#define MOV_FRAG_DEFAULT_DURATION AV_TIME_BASE ///< fragment duration without video track
+#define MOV_SHIFT_BLOCK_SIZE (1<<20)
 
 #define MODE_MP4  0x01
 #define MODE_MOV  0x02
@@ -55,6 +57,13 @@ typedef struct MOVIentry {
     uint32_t     flags;
 } MOVIentry;
 
+typedef struct MOVFragmentIndex {
+    int64_t     time;        ///< decoding time of the first sync sample of the fragment
+    int64_t     moof_offset; ///< position of the moof atom
+    unsigned    traf;        ///< 1-based number of the track traf in the moof
+    unsigned    sample;      ///< 1-based number of the sync sample in the track run
+} MOVFragmentIndex;
+
 typedef struct MOVIndex {
     int         mode;
     int         entry;
@@ -77,6 +86,14 @@ typedef struct MOVIndex {
     MOVIentry   *cluster;
     int         audio_vbr;
     int         height; ///< active picture (w/o VBI) height for D-10/IMX
+
+    ByteIOContext *mdat_buf;      ///< sample data of the current fragment
+    int         frag_entries;     ///< buffered samples written in the next moof
+    int64_t     end_dts;          ///< dts following the buffered samples, AV_NOPTS_VALUE if unknown
+    int64_t     frag_dts;         ///< decoding time of the next fragment, as signalled by the written runs
+    int64_t     data_offset_pos;  ///< position of the trun data offset field in the moof
+    MOVFragmentIndex *frag_index; ///< random access points of the written fragments
+    int         nb_frag_index;
 } MOVTrack;
 
 typedef struct MOVMuxContext {
@@ -86,6 +103,13 @@ typedef struct MOVMuxContext {
     int64_t mdat_pos;
     uint64_t mdat_size;
     MOVTrack *tracks;
+    int     fragment;     ///< write moof/mdat fragments instead of a single mdat
+    int     frag_track;   ///< track whose keyframes start new fragments
+    int     nb_fragments;
+    int     moov_written;
+    int     faststart;          ///< write the moov before the mdat
+    int64_t reserved_moov_pos;  ///< where the moov goes when writing it first
+    int     reserved_moov_size; ///< size of the free atom reserved for the moov
 } MOVMuxContext;
 
 //FIXME support 64 bit variant with wide placeholders
@@ -106,7 +130,8 @@ static int mov_write_stco_tag(ByteIOContext *pb, MOVTrack *track)
     int mode64 = 0; //   use 32 bit size variant if possible
     int64_t pos = url_ftell(pb);
     put_be32(pb, 0); /* size */
-    if (pos > UINT32_MAX) {
+    /* chunks are written in order, the last one has the largest offset */
+    if (track->entry && track->cluster[track->entry-1].pos > UINT32_MAX) {
         mode64 = 1;
         put_tag(pb, "co64");
     } else
@@ -142,7 +167,7 @@ static int mov_write_stsz_tag(ByteIOContext *pb, MOVTrack *track)
         entries += track->cluster[i].entries;
     }
     if (equalChunks) {
-        int sSize = track->cluster[0].size/track->cluster[0].entries;
+        int sSize = track->entry ? track->cluster[0].size/track->cluster[0].entries : 0;
         put_be32(pb, sSize); // sample size
         put_be32(pb, entries); // sample count
     }
@@ -1212,7 +1237,7 @@ static int mov_write_edts_tag(ByteIOContext *pb, MOVTrack *track)
     put_be32(pb, av_rescale_rnd(track->trackDuration, MOV_TIMESCALE,
                                 track->timescale, AV_ROUND_UP));
 
-    put_be32(pb, track->cluster[0].cts); /* first pts is cts since dts is 0 */
+    put_be32(pb, track->entry ? track->cluster[0].cts : 0); /* first pts is cts since dts is 0 */
     put_be32(pb, 0x00010000);
     return 0x24;
 }
@@ -1273,16 +1298,19 @@ static int mov_write_mvhd_tag(ByteIOContext *pb, MOVMuxContext *mov)
     int version;
 
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry > 0) {
+        if (mov->tracks[i].entry <= 0 && !mov->fragment)
+            continue;
+        /* the duration of fragmented files is not known in advance */
+        if (!mov->fragment) {
             maxTrackLenTemp = av_rescale_rnd(mov->tracks[i].trackDuration,
                                              MOV_TIMESCALE,
                                              mov->tracks[i].timescale,
                                              AV_ROUND_UP);
             if(maxTrackLen < maxTrackLenTemp)
                 maxTrackLen = maxTrackLenTemp;
-            if(maxTrackID < mov->tracks[i].trackID)
-                maxTrackID = mov->tracks[i].trackID;
         }
+        if(maxTrackID < mov->tracks[i].trackID)
+            maxTrackID = mov->tracks[i].trackID;
     }
 
     version = maxTrackLen < UINT32_MAX ? 0 : 1;
@@ -1616,6 +1644,25 @@ static int mov_write_uuidusmt_tag(ByteIOContext *pb, AVFormatContext *s)
     return 0;
 }
 
+static int mov_write_mvex_tag(ByteIOContext *pb, MOVMuxContext *mov)
+{
+    int i;
+    int64_t pos = url_ftell(pb);
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "mvex");
+    for (i=0; i<mov->nb_streams; i++) {
+        put_be32(pb, 32); /* size */
+        put_tag(pb, "trex");
+        put_be32(pb, 0); /* version & flags */
+        put_be32(pb, mov->tracks[i].trackID);
+        put_be32(pb, 1); /* default sample description index */
+        put_be32(pb, 0); /* default sample duration */
+        put_be32(pb, 0); /* default sample size */
+        put_be32(pb, 0); /* default sample flags */
+    }
+    return updateSize(pb, pos);
+}
+
 static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
                               AVFormatContext *s)
 {
@@ -1625,7 +1672,7 @@ static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
     put_tag(pb, "moov");
 
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry <= 0) continue;
+        if(mov->tracks[i].entry <= 0 && !mov->fragment) continue;
 
         mov->tracks[i].time = mov->time;
         mov->tracks[i].trackID = i+1;
@@ -1634,10 +1681,21 @@ static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
     mov_write_mvhd_tag(pb, mov);
     //mov_write_iods_tag(pb, mov);
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry > 0) {
+        if (mov->fragment) {
+            /* samples are described by the fragments, write empty tables */
+            MOVTrack track = mov->tracks[i];
+            track.entry         = 0;
+            track.hasKeyframes  = 0;
+            track.sampleCount   = 0;
+            track.trackDuration = 0;
+            track.flags         = 0;
+            mov_write_trak_tag(pb, &track, s->streams[i]);
+        } else if(mov->tracks[i].entry > 0) {
             mov_write_trak_tag(pb, &(mov->tracks[i]), s->streams[i]);
         }
     }
+    if (mov->fragment)
+        mov_write_mvex_tag(pb, mov);
 
     if (mov->mode == MODE_PSP)
         mov_write_uuidusmt_tag(pb, s);
@@ -1776,14 +1834,504 @@ static void mov_write_uuidprof_tag(ByteIOContext *pb, AVFormatContext *s)
     put_be32(pb, 0x010001); /* ? */
 }
 
+static int64_t mov_get_sample_duration(MOVTrack *track, int i)
+{
+    int64_t duration;
+
+    if (i + 1 < track->entry)
+        return track->cluster[i+1].dts - track->cluster[i].dts;
+    if (track->end_dts != AV_NOPTS_VALUE)
+        return track->end_dts - track->cluster[i].dts;
+    /* last sample of the file, rely on the packet duration */
+    duration = track->trackDuration - track->cluster[i].dts + track->cluster[0].dts;
+    if (duration <= 0 && i > 0)
+        duration = track->cluster[i].dts - track->cluster[i-1].dts;
+    return FFMAX(duration, 0);
+}
+
+static int mov_write_mfhd_tag(ByteIOContext *pb, MOVMuxContext *mov)
+{
+    put_be32(pb, 16); /* size */
+    put_tag(pb, "mfhd");
+    put_be32(pb, 0); /* version & flags */
+    put_be32(pb, mov->nb_fragments); /* sequence number */
+    return 16;
+}
+
+static int mov_write_tfhd_tag(ByteIOContext *pb, MOVTrack *track, int64_t moof_offset)
+{
+    put_be32(pb, 24); /* size */
+    put_tag(pb, "tfhd");
+    put_byte(pb, 0); /* version */
+    put_be24(pb, 0x01); /* flags: base data offset present */
+    put_be32(pb, track->trackID);
+    put_be64(pb, moof_offset);
+    return 24;
+}
+
+static int mov_write_trun_tag(ByteIOContext *pb, MOVTrack *track)
+{
+    int64_t pos = url_ftell(pb);
+    int flags = 0x001 | 0x100 | 0x200 | 0x400; /* data offset, sample duration, size and flags */
+    int i;
+
+    for (i=0; i<track->frag_entries; i++) {
+        if (track->cluster[i].cts) {
+            flags |= 0x800; /* sample composition time offsets */
+            break;
+        }
+    }
+
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "trun");
+    put_byte(pb, 0); /* version */
+    put_be24(pb, flags);
+    put_be32(pb, track->frag_entries); /* sample count */
+    track->data_offset_pos = url_ftell(pb);
+    put_be32(pb, 0); /* data offset, set once the moof size is known */
+    for (i=0; i<track->frag_entries; i++) {
+        put_be32(pb, mov_get_sample_duration(track, i));
+        put_be32(pb, track->cluster[i].size);
+        /* sync samples do not depend on others, other samples are difference samples */
+        put_be32(pb, track->cluster[i].flags & MOV_SYNC_SAMPLE ? 0x02000000 : 0x01010000);
+        if (flags & 0x800)
+            put_be32(pb, track->cluster[i].cts);
+    }
+    return updateSize(pb, pos);
+}
+
+static int mov_write_traf_tag(ByteIOContext *pb, MOVTrack *track, int64_t moof_offset)
+{
+    int64_t pos = url_ftell(pb);
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "traf");
+    mov_write_tfhd_tag(pb, track, moof_offset);
+    mov_write_trun_tag(pb, track);
+    return updateSize(pb, pos);
+}
+
+static int mov_write_moof_tag(ByteIOContext *pb, MOVMuxContext *mov, int64_t moof_offset)
+{
+    int i;
+    int64_t pos = url_ftell(pb);
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "moof");
+    mov_write_mfhd_tag(pb, mov);
+    for (i=0; i<mov->nb_streams; i++) {
+        if (mov->tracks[i].frag_entries > 0)
+            mov_write_traf_tag(pb, &mov->tracks[i], moof_offset);
+    }
+    return updateSize(pb, pos);
+}
+
+static int mov_write_tfra_tag(ByteIOContext *pb, MOVTrack *track)
+{
+    int i;
+    int64_t pos = url_ftell(pb);
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "tfra");
+    put_byte(pb, 1); /* version */
+    put_be24(pb, 0); /* flags */
+    put_be32(pb, track->trackID);
+    put_be32(pb, 0x3); /* 1 byte traf and trun numbers, 4 bytes sample numbers */
+    put_be32(pb, track->nb_frag_index);
+    for (i=0; i<track->nb_frag_index; i++) {
+        put_be64(pb, track->frag_index[i].time);
+        put_be64(pb, track->frag_index[i].moof_offset);
+        put_byte(pb, track->frag_index[i].traf);
+        put_byte(pb, 1); /* trun number */
+        put_be32(pb, track->frag_index[i].sample);
+    }
+    return updateSize(pb, pos);
+}
+
+static int mov_write_mfra_tag(ByteIOContext *pb, MOVMuxContext *mov)
+{
+    int i;
+    int64_t pos = url_ftell(pb);
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "mfra");
+    for (i=0; i<mov->nb_streams; i++) {
+        if (mov->tracks[i].nb_frag_index)
+            mov_write_tfra_tag(pb, &mov->tracks[i]);
+    }
+    put_be32(pb, 16); /* size */
+    put_tag(pb, "mfro");
+    put_be32(pb, 0); /* version & flags */
+    put_be32(pb, url_ftell(pb) - pos + 4); /* mfra size */
+    return updateSize(pb, pos);
+}
+
+/**
+ * Write atoms built by write_atom() through a dynamic buffer, so that
+ * their sizes can be updated even if the output is not seekable.
+ */
+static int mov_write_buffered(AVFormatContext *s,
+                              int (*write_atom)(AVFormatContext *s, ByteIOContext *pb))
+{
+    ByteIOContext *buf_pb;
+    uint8_t *buf;
+    int size, ret;
+
+    if ((ret = url_open_dyn_buf(&buf_pb)) < 0)
+        return ret;
+    ret = write_atom(s, buf_pb);
+    size = url_close_dyn_buf(buf_pb, &buf);
+    if (ret >= 0)
+        put_buffer(s->pb, buf, size);
+    av_free(buf);
+    return ret;
+}
+
+static int mov_write_fragmented_moov(AVFormatContext *s, ByteIOContext *pb)
+{
+    return mov_write_moov_tag(pb, s->priv_data, s);
+}
+
+static int mov_write_fragmented_mfra(AVFormatContext *s, ByteIOContext *pb)
+{
+    return mov_write_mfra_tag(pb, s->priv_data);
+}
+
+/**
+ * Size in bytes of the last buffered sample of a track.
+ */
+static int mov_held_sample_size(MOVTrack *track)
+{
+    return track->entry > track->frag_entries ? track->cluster[track->entry - 1].size : 0;
+}
+
+/**
+ * Write the samples buffered since the last fragment as a moof/mdat pair.
+ * The moov is written before the first fragment, once the codec
+ * extradata found in the first packets is known.
+ *
+ * The runs only store sample durations, so the last sample of a track is
+ * held back for the next fragment until the dts following it is known:
+ * that of pkt, the packet starting the next fragment, for its own track.
+ * At the end of the file (pkt == NULL) all the samples are written.
+ */
+static int mov_flush_fragment(AVFormatContext *s, AVPacket *pkt)
+{
+    MOVMuxContext *mov = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    ByteIOContext *moof_pb;
+    uint64_t mdat_size = 0;
+    int64_t moof_offset, data_offset, moof_end;
+    uint8_t *buf;
+    int i, j, size, held, traf, ret;
+
+    if (!mov->moov_written) {
+        if ((ret = mov_write_buffered(s, mov_write_fragmented_moov)) < 0)
+            return ret;
+        mov->moov_written = 1;
+    }
+
+    for (i=0; i<mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        track->frag_entries = track->entry;
+        track->end_dts      = AV_NOPTS_VALUE;
+        if (pkt && i == pkt->stream_index)
+            track->end_dts = pkt->dts;
+        else if (pkt && track->entry)
+            track->frag_entries--;
+        if (track->frag_entries > 0)
+            mdat_size += url_ftell(track->mdat_buf) - mov_held_sample_size(track);
+    }
+    if (!mdat_size)
+        return 0;
+
+    if ((ret = url_open_dyn_buf(&moof_pb)) < 0)
+        return ret;
+    mov->nb_fragments++;
+    moof_offset = url_ftell(pb);
+    mov_write_moof_tag(moof_pb, mov, moof_offset);
+
+    /* patch the run data offsets now that the moof size is known */
+    moof_end = url_ftell(moof_pb);
+    data_offset = moof_end + (mdat_size + 8 > UINT32_MAX ? 16 : 8);
+    for (i=0; i<mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        if (!track->frag_entries)
+            continue;
+        url_fseek(moof_pb, track->data_offset_pos, SEEK_SET);
+        put_be32(moof_pb, data_offset);
+        data_offset += url_ftell(track->mdat_buf) - mov_held_sample_size(track);
+    }
+    url_fseek(moof_pb, moof_end, SEEK_SET);
+    size = url_close_dyn_buf(moof_pb, &buf);
+    put_buffer(pb, buf, size);
+    av_free(buf);
+
+    if (mdat_size + 8 <= UINT32_MAX) {
+        put_be32(pb, mdat_size + 8);
+        put_tag(pb, "mdat");
+    } else {
+        put_be32(pb, 1); /* real atom size is the 64 bit value after tag field */
+        put_tag(pb, "mdat");
+        put_be64(pb, mdat_size + 16);
+    }
+
+    for (i=0, traf=0; i<mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        int64_t dts = track->frag_dts;
+
+        if (!track->frag_entries)
+            continue;
+        traf++;
+        held = mov_held_sample_size(track);
+        size = url_close_dyn_buf(track->mdat_buf, &buf);
+        track->mdat_buf = NULL;
+        put_buffer(pb, buf, size - held);
+        ret = held ? url_open_dyn_buf(&track->mdat_buf) : 0;
+        if (held && ret >= 0)
+            put_buffer(track->mdat_buf, buf + size - held, held);
+        av_free(buf);
+        if (ret < 0)
+            return ret;
+
+        for (j=0; j<track->frag_entries; j++) {
+            if (track->cluster[j].flags & MOV_SYNC_SAMPLE) {
+                MOVFragmentIndex *index = av_realloc(track->frag_index,
+                                                     (track->nb_frag_index + 1) * sizeof(*index));
+                if (!index)
+                    return AVERROR(ENOMEM);
+                track->frag_index = index;
+                index += track->nb_frag_index++;
+                index->time        = dts;
+                index->moof_offset = moof_offset;
+                index->traf        = traf;
+                index->sample      = j + 1;
+                break;
+            }
+            dts += mov_get_sample_duration(track, j);
+        }
+        for (j=0; j<track->frag_entries; j++)
+            track->frag_dts += mov_get_sample_duration(track, j);
+
+        if (held) {
+            MOVIentry *last = &track->cluster[track->entry - 1];
+            track->trackDuration -= last->dts - track->cluster[0].dts;
+            track->cluster[0]     = *last;
+            track->cluster[0].pos = 0;
+            track->entry          = 1;
+            track->hasKeyframes   = !!(last->flags & MOV_SYNC_SAMPLE);
+            track->sampleCount    = last->entries;
+        } else {
+            track->entry         = 0;
+            track->hasKeyframes  = 0;
+            track->sampleCount   = 0;
+            track->trackDuration = 0;
+        }
+    }
+    put_flush_packet(pb);
+    return 0;
+}
+
+static int mov_fragment_boundary(AVFormatContext *s, MOVTrack *trk, AVPacket *pkt)
+{
+    MOVMuxContext *mov = s->priv_data;
+    MOVTrack *ref = &mov->tracks[mov->frag_track];
+    int64_t duration = s->fragment_duration;
+
+    /* bound the memory used by the sample tables of a fragment */
+    if (trk->entry >= MOV_INDEX_CLUSTER_SIZE)
+        return 1;
+    if (pkt->stream_index != mov->frag_track || !(pkt->flags & PKT_FLAG_KEY) || !ref->entry)
+        return 0;
+    if (!duration && ref->enc->codec_type != CODEC_TYPE_VIDEO)
+        duration = MOV_FRAG_DEFAULT_DURATION;
+    return av_rescale_q(pkt->dts - ref->cluster[0].dts,
+                        s->streams[mov->frag_track]->time_base, AV_TIME_BASE_Q) >= duration;
+}
+
+/**
+ * Estimate the size of the moov from the stream parameters and the
+ * expected duration, with some cushion for variable frame sizes.
+ */
+static int64_t mov_estimate_moov_size(AVFormatContext *s)
+{
+    int64_t size = 1024; /* mvhd, udta */
+    int i;
+
+    if (s->duration <= 0)
+        return 0;
+    for (i=0; i<s->nb_streams; i++) {
+        AVCodecContext *enc = s->streams[i]->codec;
+        int64_t samples = 0;
+        int sample_size = 4 + 4 + 4; /* stsz, stco and stts entries */
+
+        size += 1024 + enc->extradata_size; /* trak, stsd */
+        if (enc->codec_type == CODEC_TYPE_VIDEO) {
+            if (enc->time_base.num)
+                samples = av_rescale(s->duration, enc->time_base.den,
+                                     (int64_t)enc->time_base.num * AV_TIME_BASE);
+            if (enc->has_b_frames || enc->max_b_frames)
+                sample_size += 8; /* ctts entry */
+            if (enc->gop_size > 1)
+                sample_size += 1; /* stss entries */
+        } else if (enc->codec_type == CODEC_TYPE_AUDIO) {
+            samples = av_rescale(s->duration, enc->sample_rate,
+                                 (int64_t)FFMAX(enc->frame_size, 1024) * AV_TIME_BASE);
+        }
+        size += samples * sample_size;
+    }
+    return size + size / 8;
+}
+
+static int mov_write_free_tag(ByteIOContext *pb, int size)
+{
+    uint8_t zero[1024] = { 0 };
+    int left;
+
+    put_be32(pb, size);
+    put_tag(pb, "free");
+    for (left = size - 8; left > 0; left -= sizeof(zero))
+        put_buffer(pb, zero, FFMIN(left, sizeof(zero)));
+    return size;
+}
+
+static int mov_get_moov_size(AVFormatContext *s)
+{
+    ByteIOContext *moov_buf;
+    uint8_t *buf;
+    int size, ret;
+
+    if ((ret = url_open_dyn_buf(&moov_buf)) < 0)
+        return ret;
+    mov_write_moov_tag(moov_buf, s->priv_data, s);
+    size = url_close_dyn_buf(moov_buf, &buf);
+    av_free(buf);
+    return size;
+}
+
+static void mov_shift_chunk_offsets(MOVMuxContext *mov, int64_t shift)
+{
+    int i, j;
+
+    for (i=0; i<mov->nb_streams; i++)
+        for (j=0; j<mov->tracks[i].entry; j++)
+            mov->tracks[i].cluster[j].pos += shift;
+}
+
+/**
+ * Move the data between start and end forward by shift bytes, copying
+ * large blocks from the end so that no data is overwritten before being
+ * read. The file is reopened for reading since the output is write only,
+ * which only local files allow.
+ */
+static int mov_shift_data(AVFormatContext *s, int64_t start, int64_t end, int shift)
+{
+    ByteIOContext *pb = s->pb;
+    ByteIOContext *read_pb;
+    URLContext *h = url_fileno(pb);
+    uint8_t *buf;
+    int64_t pos = end;
+    int ret = 0;
+
+    if (!h || strcmp(h->prot->name, "file")) {
+        av_log(s, AV_LOG_ERROR, "the mdat can only be moved in local files\n");
+        return AVERROR(ENOSYS);
+    }
+    put_flush_packet(pb);
+    if (url_fopen(&read_pb, s->filename, URL_RDONLY) < 0) {
+        av_log(s, AV_LOG_ERROR, "could not reopen %s to move the mdat\n", s->filename);
+        return -1;
+    }
+    buf = av_malloc(MOV_SHIFT_BLOCK_SIZE);
+    if (!buf) {
+        url_fclose(read_pb);
+        return AVERROR(ENOMEM);
+    }
+    while (pos > start) {
+        int size = FFMIN(pos - start, MOV_SHIFT_BLOCK_SIZE);
+        pos -= size;
+        url_fseek(read_pb, pos, SEEK_SET);
+        if (get_buffer(read_pb, buf, size) != size) {
+            av_log(s, AV_LOG_ERROR, "short read while moving the mdat\n");
+            ret = AVERROR(EIO);
+            break;
+        }
+        url_fseek(pb, pos + shift, SEEK_SET);
+        put_buffer(pb, buf, size);
+    }
+    av_free(buf);
+    url_fclose(read_pb);
+    return ret;
+}
+
+/**
+ * Write the moov in the space reserved in the header if it fits, or move
+ * the atoms following the reserved space to make room for it otherwise.
+ */
+static int mov_write_moov_faststart(AVFormatContext *s, int64_t moov_pos)
+{
+    MOVMuxContext *mov = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    int64_t data_pos = mov->reserved_moov_pos + mov->reserved_moov_size;
+    int moov_size, shift, needed, free_size, ret;
+
+    if ((moov_size = mov_get_moov_size(s)) < 0)
+        return moov_size;
+
+    free_size = mov->reserved_moov_size - moov_size;
+    if (free_size == 0 || free_size >= 8) {
+        url_fseek(pb, mov->reserved_moov_pos, SEEK_SET);
+        mov_write_moov_tag(pb, mov, s);
+        if (free_size) {
+            put_be32(pb, free_size);
+            put_tag(pb, "free");
+        }
+        url_fseek(pb, moov_pos, SEEK_SET);
+        return 0;
+    }
+    if (mov->reserved_moov_size)
+        av_log(s, AV_LOG_WARNING, "reserved %d bytes for a moov of %d bytes, moving the mdat\n",
+               mov->reserved_moov_size, moov_size);
+
+    /* grow the reserved space to the moov size, or leave room for a free
+       atom after it if the moov is only a few bytes smaller; moving the
+       chunks may require 64 bit chunk offsets and a bigger moov */
+    shift = 0;
+    for (;;) {
+        needed = moov_size - mov->reserved_moov_size;
+        if (needed < 0)
+            needed += 8;
+        if (needed == shift)
+            break;
+        mov_shift_chunk_offsets(mov, needed - shift);
+        shift = needed;
+        if ((moov_size = mov_get_moov_size(s)) < 0)
+            return moov_size;
+    }
+
+    if ((ret = mov_shift_data(s, data_pos, moov_pos, shift)) < 0) {
+        mov_shift_chunk_offsets(mov, -shift);
+        url_fseek(pb, moov_pos, SEEK_SET);
+        mov_write_moov_tag(pb, mov, s);
+        return ret;
+    }
+    url_fseek(pb, mov->reserved_moov_pos, SEEK_SET);
+    mov_write_moov_tag(pb, mov, s);
+    free_size = mov->reserved_moov_size + shift - moov_size;
+    if (free_size) {
+        put_be32(pb, free_size);
+        put_tag(pb, "free");
+    }
+    url_fseek(pb, moov_pos + shift, SEEK_SET);
+    return 0;
+}
+
 static int mov_write_header(AVFormatContext *s)
 {
     ByteIOContext *pb = s->pb;
     MOVMuxContext *mov = s->priv_data;
     int i;
 
-    if (url_is_streamed(s->pb)) {
-        av_log(s, AV_LOG_ERROR, "muxer does not support non seekable output\n");
+    mov->fragment = !!(s->flags & AVFMT_FLAG_FRAGMENT);
+    if (url_is_streamed(s->pb) && !mov->fragment) {
+        av_log(s, AV_LOG_ERROR, "muxer does not support non seekable output, "
+               "unless writing fragments\n");
         return -1;
     }
 
@@ -1875,7 +2423,26 @@ static int mov_write_header(AVFormatContext *s)
         av_set_pts_info(st, 64, 1, track->timescale);
     }
 
-    mov_write_mdat_tag(pb, mov);
+    for (i=0; i<s->nb_streams; i++) {
+        if (s->streams[i]->codec->codec_type == CODEC_TYPE_VIDEO) {
+            mov->frag_track = i;
+            break;
+        }
+    }
+
+    /* the moov of fragmented files is always at the start */
+    mov->faststart = !mov->fragment && s->flags & AVFMT_FLAG_FASTSTART;
+    if (mov->faststart) {
+        int64_t size = mov_estimate_moov_size(s);
+        mov->reserved_moov_pos = url_ftell(pb);
+        if (size > 0 && size < INT_MAX) {
+            mov->reserved_moov_size = size;
+            mov_write_free_tag(pb, size);
+        }
+    }
+
+    if (!mov->fragment)
+        mov_write_mdat_tag(pb, mov);
     mov->time = s->timestamp + 0x7C25B080; //1970 based -> 1904 based
     mov->nb_streams = s->nb_streams;
 
@@ -1916,10 +2483,20 @@ static int mov_write_packet(AVFormatContext *s, AVPacket *pkt)
     AVCodecContext *enc = trk->enc;
     unsigned int samplesInChunk = 0;
     int size= pkt->size;
+    int ret;
 
-    if (url_is_streamed(s->pb)) return 0; /* Can't handle that */
+    if (url_is_streamed(s->pb) && !mov->fragment) return 0; /* Can't handle that */
     if (!size) return 0; /* Discard 0 sized packets */
 
+    if (mov->fragment) {
+        if (mov_fragment_boundary(s, trk, pkt) &&
+            (ret = mov_flush_fragment(s, pkt)) < 0)
+            return ret;
+        if (!trk->mdat_buf && (ret = url_open_dyn_buf(&trk->mdat_buf)) < 0)
+            return ret;
+        pb = trk->mdat_buf;
+    }
+
     if (enc->codec_id == CODEC_ID_AMR_NB) {
         /* We must find out how many AMR blocks there are in one packet */
         static uint16_t packed_size[16] =
@@ -2013,6 +2590,12 @@ static int mov_write_trailer(AVFormatContext *s)
 
     int64_t moov_pos = url_ftell(pb);
 
+    if (mov->fragment) {
+        if ((res = mov_flush_fragment(s, NULL)) >= 0)
+            res = mov_write_buffered(s, mov_write_fragmented_mfra);
+        goto end;
+    }
+
     /* Write size of mdat tag */
     if (mov->mdat_size+8 <= UINT32_MAX) {
         url_fseek(pb, mov->mdat_pos, SEEK_SET);
@@ -2026,10 +2609,20 @@ static int mov_write_trailer(AVFormatContext *s)
     }
     url_fseek(pb, moov_pos, SEEK_SET);
 
-    mov_write_moov_tag(pb, mov, s);
+    if (mov->faststart)
+        res = mov_write_moov_faststart(s, moov_pos);
+    else
+        mov_write_moov_tag(pb, mov, s);
 
+ end:
     for (i=0; i<mov->nb_streams; i++) {
         av_freep(&mov->tracks[i].cluster);
+        av_freep(&mov->tracks[i].frag_index);
+        if (mov->tracks[i].mdat_buf) {
+            uint8_t *buf;
+            url_close_dyn_buf(mov->tracks[i].mdat_buf, &buf);
+            av_free(buf);
+        }
 
         if(mov->tracks[i].vosLen) av_free(mov->tracks[i].vosData);
 
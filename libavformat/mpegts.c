@@ -122,6 +122,14 @@ struct MpegTSContext {
 
     /** filters for various streams specified by PMT + for the PAT and PMT */
     MpegTSFilter *pids[NB_PID_MAX];
+
+    /** pids dropped before any parsing, one bit per pid     */
+    uint32_t discard_pids[NB_PID_MAX / 32];
+    /** set when the program to pid mapping changed          */
+    int discard_pids_dirty;
+    /** program and stream discard values discard_pids was built from */
+    int *discard_cache;
+    int nb_discard_cache;
 };
 
 /* TS stream handling */
@@ -168,12 +176,14 @@ static void clear_program(MpegTSContext *ts, unsigned int programid)
     for(i=0; i<ts->nb_prg; i++)
         if(ts->prg[i].id == programid)
             ts->prg[i].nb_pids = 0;
+    ts->discard_pids_dirty = 1;
 }
 
 static void clear_programs(MpegTSContext *ts)
 {
     av_freep(&ts->prg);
     ts->nb_prg=0;
+    ts->discard_pids_dirty = 1;
 }
 
 static void add_pat_entry(MpegTSContext *ts, unsigned int programid)
@@ -187,6 +197,7 @@ static void add_pat_entry(MpegTSContext *ts, unsigned int programid)
     p->id = programid;
     p->nb_pids = 0;
     ts->nb_prg++;
+    ts->discard_pids_dirty = 1;
 }
 
 static void add_pid_to_pmt(MpegTSContext *ts, unsigned int programid, unsigned int pid)
@@ -205,6 +216,7 @@ static void add_pid_to_pmt(MpegTSContext *ts, unsigned int programid, unsigned i
     if(p->nb_pids >= MAX_PIDS_PER_PROGRAM)
         return;
     p->pids[p->nb_pids++] = pid;
+    ts->discard_pids_dirty = 1;
 }
 
 /**
@@ -240,6 +252,77 @@ static int discard_pid(MpegTSContext *ts, unsigned int pid)
     return !used && discarded;
 }
 
+/**
+ * Rebuild the bitmap of pids dropped by handle_packet() if the program
+ * mapping or the discard value of any program or stream changed since
+ * it was last built.
+ */
+static void update_discard_pids(MpegTSContext *ts)
+{
+    AVFormatContext *s = ts->stream;
+    int i, j, n = s->nb_programs + s->nb_streams;
+    int *tmp;
+
+    if (!ts->discard_pids_dirty) {
+        if (n != ts->nb_discard_cache)
+            ts->discard_pids_dirty = 1;
+        for (i = 0; i < s->nb_programs && !ts->discard_pids_dirty; i++)
+            if (ts->discard_cache[i] != s->programs[i]->discard)
+                ts->discard_pids_dirty = 1;
+        for (i = 0; i < s->nb_streams && !ts->discard_pids_dirty; i++)
+            if (ts->discard_cache[s->nb_programs + i] != s->streams[i]->discard)
+                ts->discard_pids_dirty = 1;
+        if (!ts->discard_pids_dirty)
+            return;
+    }
+
+    if (n > ts->nb_discard_cache) {
+        tmp = av_realloc(ts->discard_cache, n * sizeof(*ts->discard_cache));
+        if (!tmp)
+            return;
+        ts->discard_cache = tmp;
+    }
+    for (i = 0; i < s->nb_programs; i++)
+        ts->discard_cache[i] = s->programs[i]->discard;
+    for (i = 0; i < s->nb_streams; i++)
+        ts->discard_cache[s->nb_programs + i] = s->streams[i]->discard;
+    ts->nb_discard_cache   = n;
+    ts->discard_pids_dirty = 0;
+
+    memset(ts->discard_pids, 0, sizeof(ts->discard_pids));
+    for (i = 0; i < ts->nb_prg; i++) {
+        for (j = 0; j < ts->prg[i].nb_pids; j++) {
+            unsigned int pid = ts->prg[i].pids[j];
+            if (pid && discard_pid(ts, pid))
+                ts->discard_pids[pid >> 5] |= 1U << (pid & 31);
+        }
+    }
+    for (i = 0; i < NB_PID_MAX; i++) {
+        MpegTSFilter *f = ts->pids[i];
+        PESContext *pes;
+        if (!f || f->type != MPEGTS_PES)
+            continue;
+        pes = f->u.pes_filter.opaque;
+        /* the embedded AC3 stream shares the pid of its TrueHD stream */
+        if (!pes->st || pes->st->discard < AVDISCARD_ALL ||
+            (pes->sub_st && pes->sub_st->discard < AVDISCARD_ALL))
+            continue;
+        ts->discard_pids[i >> 5] |= 1U << (i & 31);
+    }
+
+    /* drop the partial PES packets of the pids which are now skipped */
+    for (i = 0; i < NB_PID_MAX; i++) {
+        MpegTSFilter *f = ts->pids[i];
+        if (f && f->type == MPEGTS_PES &&
+            ts->discard_pids[i >> 5] & (1U << (i & 31))) {
+            PESContext *pes = f->u.pes_filter.opaque;
+            av_freep(&pes->buffer);
+            pes->data_index = 0;
+            pes->state = MPEGTS_SKIP;
+        }
+    }
+}
+
 /**
  *  Assembles PES packets out of TS packets, and then calls the "section_cb"
  *  function when they are complete.
@@ -1134,7 +1217,9 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
     int64_t pos;
 
     pid = AV_RB16(packet + 1) & 0x1fff;
-    if(pid && discard_pid(ts, pid))
+    if (ts->discard_pids_dirty)
+        update_discard_pids(ts);
+    if (ts->discard_pids[pid >> 5] & (1U << (pid & 31)))
         return 0;
     is_start = packet[1] & 0x40;
     tss = ts->pids[pid];
@@ -1257,9 +1342,13 @@ static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size)
 static int handle_packets(MpegTSContext *ts, int nb_packets)
 {
     AVFormatContext *s = ts->stream;
+    ByteIOContext *pb = s->pb;
     uint8_t packet[TS_PACKET_SIZE];
+    const uint8_t *data;
     int packet_num, ret;
 
+    update_discard_pids(ts);
+
     ts->stop_parse = 0;
     packet_num = 0;
     for(;;) {
@@ -1268,10 +1357,20 @@ static int handle_packets(MpegTSContext *ts, int nb_packets)
         packet_num++;
         if (nb_packets != 0 && packet_num >= nb_packets)
             break;
-        ret = read_packet(s, packet, ts->raw_packet_size);
-        if (ret != 0)
-            return ret;
-        ret = handle_packet(ts, packet);
+        /* parse the packet in place when it is entirely in the I/O
+           buffer, which is refilled in large blocks; only packets
+           straddling a refill or needing a resync are copied */
+        if (pb->buf_end - pb->buf_ptr >= ts->raw_packet_size &&
+            pb->buf_ptr[0] == 0x47) {
+            data = pb->buf_ptr;
+            pb->buf_ptr += ts->raw_packet_size;
+        } else {
+            ret = read_packet(s, packet, ts->raw_packet_size);
+            if (ret != 0)
+                return ret;
+            data = packet;
+        }
+        ret = handle_packet(ts, data);
         if (ret != 0)
             return ret;
     }
@@ -1531,6 +1630,7 @@ static int mpegts_read_close(AVFormatContext *s)
     int i;
 
     clear_programs(ts);
+    av_freep(&ts->discard_cache);
 
     for(i=0;i<NB_PID_MAX;i++)
         if (ts->pids[i]) mpegts_close_filter(ts, ts->pids[i]);
@@ -1715,6 +1815,7 @@ int mpegts_parse_packet(MpegTSContext *ts, AVPacket *pkt,
     len1 = len;
     ts->pkt = pkt;
     ts->stop_parse = 0;
+    update_discard_pids(ts);
     for(;;) {
         if (ts->stop_parse>0)
             break;
@@ -1738,6 +1839,7 @@ void mpegts_parse_close(MpegTSContext *ts)
 
     for(i=0;i<NB_PID_MAX;i++)
         av_free(ts->pids[i]);
+    av_free(ts->discard_cache);
     av_free(ts);
 }
 
@@ -103,11 +103,34 @@ typedef struct {
     int extradata_size;
 } MXFDescriptor;
 
+typedef struct {
+    int64_t pos;            ///< stream offset in segments, file offset once resolved, -1 if unknown
+    int8_t temporal_offset;
+    int8_t key_frame_offset;
+    uint8_t flags;
+} MXFIndexEntry;
+
 typedef struct {
     UID uid;
     enum MXFMetadataSetType type;
+    int edit_unit_byte_count;
+    int index_sid;
+    int body_sid;
+    AVRational index_edit_rate;
+    int64_t index_start_position;
+    int64_t index_duration;
+    MXFIndexEntry *entries;
+    int nb_entries;
 } MXFIndexTableSegment;
 
+typedef struct {
+    int64_t this_partition;
+    int64_t previous_partition;
+    int64_t body_offset;
+    int body_sid;
+    int64_t essence_offset; ///< file offset of the first essence KLV, 0 if unknown
+} MXFPartition;
+
 typedef struct {
     UID uid;
     enum MXFMetadataSetType type;
@@ -132,6 +155,17 @@ typedef struct {
     struct AVAES *aesc;
     uint8_t *local_tags;
     int local_tags_count;
+    int64_t run_in;             ///< offset of the header partition, ThisPartition values are relative to it
+    int64_t footer_partition;
+    MXFPartition *partitions;   ///< sorted by offset
+    int partitions_count;
+    /* seek index, built from the index table segments */
+    AVRational index_edit_rate;
+    int64_t index_start_position;
+    int edit_unit_byte_count;   ///< constant bytes per edit unit, no entries then
+    int index_body_sid;
+    MXFIndexEntry *index_entries;
+    int nb_index_entries;
 } MXFContext;
 
 enum MXFWrappingScheme {
@@ -148,6 +182,9 @@ typedef struct {
 
 /* partial keys to match */
 static const uint8_t mxf_header_partition_pack_key[]       = { 0x06,0x0e,0x2b,0x34,0x02,0x05,0x01,0x01,0x0d,0x01,0x02,0x01,0x01,0x02 };
+static const uint8_t mxf_partition_pack_key[]              = { 0x06,0x0e,0x2b,0x34,0x02,0x05,0x01,0x01,0x0d,0x01,0x02,0x01,0x01 };
+static const uint8_t mxf_index_table_segment_key[]         = { 0x06,0x0e,0x2b,0x34,0x02,0x53,0x01,0x01,0x0d,0x01,0x02,0x01,0x01,0x10,0x01,0x00 };
+static const uint8_t mxf_system_item_key[]                 = { 0x06,0x0e,0x2b,0x34,0x02,0x05,0x01,0x01,0x0d,0x01,0x03,0x01,0x04 };
 static const uint8_t mxf_essence_element_key[]             = { 0x06,0x0e,0x2b,0x34,0x01,0x02,0x01,0x01,0x0d,0x01,0x03,0x01 };
 static const uint8_t mxf_klv_key[]                         = { 0x06,0x0e,0x2b,0x34 };
 /* complete keys to match */
@@ -197,6 +234,19 @@ static int klv_read_packet(KLVPacket *klv, ByteIOContext *pb)
     return klv->length == -1 ? -1 : 0;
 }
 
+static int mxf_is_partition_pack_key(const uint8_t *key)
+{
+    /* header, body or footer partition */
+    return IS_KLV_KEY(key, mxf_partition_pack_key) && key[13] >= 0x02 && key[13] <= 0x04;
+}
+
+static int mxf_is_essence_key(const uint8_t *key)
+{
+    return IS_KLV_KEY(key, mxf_essence_element_key) ||
+           IS_KLV_KEY(key, mxf_encrypted_triplet_key) ||
+           IS_KLV_KEY(key, mxf_system_item_key);
+}
+
 static int mxf_get_stream_index(AVFormatContext *s, KLVPacket *klv)
 {
     int i;
@@ -341,6 +391,48 @@ static int mxf_read_packet(AVFormatContext *s, AVPacket *pkt)
     return AVERROR_EOF;
 }
 
+static MXFPartition *mxf_find_partition(MXFContext *mxf, int64_t offset)
+{
+    int i;
+
+    for (i = 0; i < mxf->partitions_count; i++)
+        if (mxf->partitions[i].this_partition == offset)
+            return &mxf->partitions[i];
+    return NULL;
+}
+
+static int mxf_read_partition_pack(MXFContext *mxf, KLVPacket *klv)
+{
+    ByteIOContext *pb = mxf->fc->pb;
+    MXFPartition *partition;
+    int64_t footer_partition;
+
+    if (klv->length < 64)
+        return -1;
+    partition = av_realloc(mxf->partitions, (mxf->partitions_count + 1) * sizeof(*mxf->partitions));
+    if (!partition)
+        return AVERROR(ENOMEM);
+    mxf->partitions = partition;
+    partition = &mxf->partitions[mxf->partitions_count++];
+    memset(partition, 0, sizeof(*partition));
+
+    url_fskip(pb, 8); /* version, KAG size */
+    partition->this_partition     = get_be64(pb);
+    partition->previous_partition = get_be64(pb);
+    footer_partition              = get_be64(pb);
+    url_fskip(pb, 16); /* header and index byte counts */
+    url_fskip(pb, 4);  /* IndexSID */
+    partition->body_offset        = get_be64(pb);
+    partition->body_sid           = get_be32(pb);
+    url_fskip(pb, klv->length - 64);
+    if (footer_partition)
+        mxf->footer_partition = footer_partition;
+    dprintf(mxf->fc, "partition at %#llx previous %#llx body sid %d offset %lld\n",
+            partition->this_partition, partition->previous_partition,
+            partition->body_sid, partition->body_offset);
+    return 0;
+}
+
 static int mxf_read_primer_pack(MXFContext *mxf)
 {
     ByteIOContext *pb = mxf->fc->pb;
@@ -505,15 +597,44 @@ static int mxf_read_source_package(MXFPackage *package, ByteIOContext *pb, int t
     return 0;
 }
 
+static int mxf_read_index_entry_array(MXFIndexTableSegment *segment, ByteIOContext *pb)
+{
+    int i, length, nb_entries;
+
+    nb_entries = get_be32(pb);
+    length = get_be32(pb);
+    dprintf(NULL, "IndexEntryArray %d entries of %d bytes\n", nb_entries, length);
+    if (length < 11 || nb_entries <= 0 || nb_entries >= UINT_MAX / sizeof(MXFIndexEntry))
+        return 0;
+    av_free(segment->entries);
+    segment->nb_entries = 0;
+    if (!(segment->entries = av_malloc(nb_entries * sizeof(MXFIndexEntry))))
+        return -1;
+    for (i = 0; i < nb_entries && !url_feof(pb); i++) {
+        MXFIndexEntry *entry = &segment->entries[i];
+        entry->temporal_offset  = get_byte(pb);
+        entry->key_frame_offset = get_byte(pb);
+        entry->flags            = get_byte(pb);
+        entry->pos              = get_be64(pb);
+        url_fskip(pb, length - 11); /* slice offsets and pos table */
+    }
+    segment->nb_entries = i;
+    return 0;
+}
+
 static int mxf_read_index_table_segment(MXFIndexTableSegment *segment, ByteIOContext *pb, int tag)
 {
     switch(tag) {
-    case 0x3F05: dprintf(NULL, "EditUnitByteCount %d\n", get_be32(pb)); break;
-    case 0x3F06: dprintf(NULL, "IndexSID %d\n", get_be32(pb)); break;
-    case 0x3F07: dprintf(NULL, "BodySID %d\n", get_be32(pb)); break;
-    case 0x3F0B: dprintf(NULL, "IndexEditRate %d/%d\n", get_be32(pb), get_be32(pb)); break;
-    case 0x3F0C: dprintf(NULL, "IndexStartPosition %lld\n", get_be64(pb)); break;
-    case 0x3F0D: dprintf(NULL, "IndexDuration %lld\n", get_be64(pb)); break;
+    case 0x3F05: segment->edit_unit_byte_count = get_be32(pb); break;
+    case 0x3F06: segment->index_sid = get_be32(pb); break;
+    case 0x3F07: segment->body_sid = get_be32(pb); break;
+    case 0x3F0A: return mxf_read_index_entry_array(segment, pb);
+    case 0x3F0B:
+        segment->index_edit_rate.num = get_be32(pb);
+        segment->index_edit_rate.den = get_be32(pb);
+        break;
+    case 0x3F0C: segment->index_start_position = get_be64(pb); break;
+    case 0x3F0D: segment->index_duration = get_be64(pb); break;
     }
     return 0;
 }
@@ -895,6 +1016,145 @@ static int mxf_read_local_tags(MXFContext *mxf, KLVPacket *klv, int (*read_child
     return ctx_size ? mxf_add_metadata_set(mxf, ctx) : 0;
 }
 
+/*
+ * Read the index table segments of the partitions following the header,
+ * going back from the footer partition.
+ */
+static void mxf_read_partitions(MXFContext *mxf)
+{
+    ByteIOContext *pb = mxf->fc->pb;
+    int64_t pos = url_ftell(pb);
+    int64_t offset = mxf->footer_partition;
+    KLVPacket klv;
+
+    while (offset > 0 && !mxf_find_partition(mxf, offset)) {
+        MXFPartition *partition;
+
+        if (url_fseek(pb, mxf->run_in + offset, SEEK_SET) < 0 ||
+            klv_read_packet(&klv, pb) < 0 ||
+            !mxf_is_partition_pack_key(klv.key) ||
+            mxf_read_partition_pack(mxf, &klv) < 0)
+            break;
+        partition = &mxf->partitions[mxf->partitions_count - 1];
+
+        /* index table segments follow the partition pack and any header metadata */
+        while (!url_feof(pb) && klv_read_packet(&klv, pb) >= 0) {
+            if (mxf_is_essence_key(klv.key)) {
+                partition->essence_offset = klv.offset;
+                break;
+            }
+            if (mxf_is_partition_pack_key(klv.key))
+                break;
+            if (IS_KLV_KEY(klv.key, mxf_index_table_segment_key))
+                mxf_read_local_tags(mxf, &klv, mxf_read_index_table_segment,
+                                    sizeof(MXFIndexTableSegment), IndexTableSegment);
+            else
+                url_fskip(pb, klv.length);
+        }
+        if (partition->previous_partition >= offset)
+            break;
+        offset = partition->previous_partition;
+    }
+    url_fseek(pb, pos, SEEK_SET);
+}
+
+static int mxf_compare_partitions(const void *a, const void *b)
+{
+    const MXFPartition *pa = a, *pb = b;
+    return (pa->this_partition > pb->this_partition) - (pa->this_partition < pb->this_partition);
+}
+
+static int mxf_compare_segments(const void *a, const void *b)
+{
+    const MXFIndexTableSegment *sa = *(MXFIndexTableSegment * const *)a;
+    const MXFIndexTableSegment *sb = *(MXFIndexTableSegment * const *)b;
+    return (sa->index_start_position > sb->index_start_position) -
+           (sa->index_start_position < sb->index_start_position);
+}
+
+/*
+ * Return the file offset of a byte of the essence container stored in
+ * the partitions of body_sid, -1 if unknown.
+ */
+static int64_t mxf_essence_offset(MXFContext *mxf, int body_sid, int64_t stream_offset)
+{
+    int i;
+
+    for (i = mxf->partitions_count - 1; i >= 0; i--) {
+        MXFPartition *partition = &mxf->partitions[i];
+        if (partition->body_sid == body_sid && partition->essence_offset &&
+            partition->body_offset <= stream_offset)
+            return partition->essence_offset + stream_offset - partition->body_offset;
+    }
+    return -1;
+}
+
+/*
+ * Build the seek index from the index table segments of the first index
+ * stream, resolving stream offsets to file offsets.
+ */
+static int mxf_parse_index(MXFContext *mxf)
+{
+    MXFIndexTableSegment **segments, *segment;
+    int64_t start, end;
+    int i, j, nb_segments = 0;
+
+    qsort(mxf->partitions, mxf->partitions_count, sizeof(*mxf->partitions),
+          mxf_compare_partitions);
+
+    segments = av_malloc(mxf->metadata_sets_count * sizeof(*segments));
+    if (!segments)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < mxf->metadata_sets_count; i++) {
+        segment = (MXFIndexTableSegment *)mxf->metadata_sets[i];
+        if (segment->type == IndexTableSegment &&
+            segment->index_edit_rate.num > 0 && segment->index_edit_rate.den > 0 &&
+            (!nb_segments || segment->index_sid == segments[0]->index_sid))
+            segments[nb_segments++] = segment;
+    }
+    if (!nb_segments)
+        goto end;
+    qsort(segments, nb_segments, sizeof(*segments), mxf_compare_segments);
+
+    segment = segments[0];
+    mxf->index_edit_rate      = segment->index_edit_rate;
+    mxf->index_start_position = segment->index_start_position;
+    mxf->index_body_sid       = segment->body_sid;
+    if (segment->edit_unit_byte_count) {
+        mxf->edit_unit_byte_count = segment->edit_unit_byte_count;
+        goto end;
+    }
+
+    start = segment->index_start_position;
+    end   = start;
+    for (i = 0; i < nb_segments; i++)
+        end = FFMAX(end, segments[i]->index_start_position + segments[i]->nb_entries);
+    if (end - start <= 0 || end - start >= INT_MAX / sizeof(MXFIndexEntry))
+        goto end;
+    mxf->index_entries = av_malloc((end - start) * sizeof(MXFIndexEntry));
+    if (!mxf->index_entries) {
+        av_free(segments);
+        return AVERROR(ENOMEM);
+    }
+    mxf->nb_index_entries = end - start;
+    for (i = 0; i < mxf->nb_index_entries; i++)
+        mxf->index_entries[i].pos = -1;
+
+    /* repeated segments overwrite the same edit units */
+    for (i = 0; i < nb_segments; i++) {
+        segment = segments[i];
+        for (j = 0; j < segment->nb_entries; j++) {
+            MXFIndexEntry *entry = &mxf->index_entries[segment->index_start_position + j - start];
+            *entry = segment->entries[j];
+            entry->pos = mxf_essence_offset(mxf, segment->body_sid, entry->pos);
+        }
+    }
+    dprintf(mxf->fc, "%d edit units indexed\n", mxf->nb_index_entries);
+end:
+    av_free(segments);
+    return 0;
+}
+
 static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
 {
     MXFContext *mxf = s->priv_data;
@@ -905,6 +1165,7 @@ static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
         return -1;
     }
     url_fseek(s->pb, -14, SEEK_CUR);
+    mxf->run_in = url_ftell(s->pb);
     mxf->fc = s;
     while (!url_feof(s->pb)) {
         const MXFMetadataReadTableEntry *metadata;
@@ -913,12 +1174,18 @@ static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
             return -1;
         PRINT_KEY(s, "read header", klv.key);
         dprintf(s, "size %lld offset %#llx\n", klv.length, klv.offset);
-        if (IS_KLV_KEY(klv.key, mxf_encrypted_triplet_key) ||
-            IS_KLV_KEY(klv.key, mxf_essence_element_key)) {
+        if (mxf_is_essence_key(klv.key)) {
+            if (mxf->partitions_count)
+                mxf->partitions[mxf->partitions_count - 1].essence_offset = klv.offset;
             /* FIXME avoid seek */
             url_fseek(s->pb, klv.offset, SEEK_SET);
             break;
         }
+        if (mxf_is_partition_pack_key(klv.key)) {
+            if (mxf_read_partition_pack(mxf, &klv) < 0)
+                return -1;
+            continue;
+        }
 
         for (metadata = mxf_metadata_read_table; metadata->read; metadata++) {
             if (IS_KLV_KEY(klv.key, metadata->key)) {
@@ -933,6 +1200,10 @@ static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
         if (!metadata->read)
             url_fskip(s->pb, klv.length);
     }
+    if (!url_is_streamed(s->pb))
+        mxf_read_partitions(mxf);
+    if (mxf_parse_index(mxf) < 0)
+        return -1;
     return mxf_parse_structural_metadata(mxf);
 }
 
@@ -958,6 +1229,9 @@ static int mxf_read_close(AVFormatContext *s)
         case MaterialPackage:
             av_freep(&((MXFPackage *)mxf->metadata_sets[i])->tracks_refs);
             break;
+        case IndexTableSegment:
+            av_freep(&((MXFIndexTableSegment *)mxf->metadata_sets[i])->entries);
+            break;
         default:
             break;
         }
@@ -966,6 +1240,8 @@ static int mxf_read_close(AVFormatContext *s)
     av_freep(&mxf->metadata_sets);
     av_freep(&mxf->aesc);
     av_freep(&mxf->local_tags);
+    av_freep(&mxf->partitions);
+    av_freep(&mxf->index_entries);
     return 0;
 }
 
@@ -985,13 +1261,47 @@ static int mxf_probe(AVProbeData *p) {
     return 0;
 }
 
-/* rudimentary byte seek */
-/* XXX: use MXF Index */
+static int mxf_read_seek_index(AVFormatContext *s, AVStream *st, int64_t sample_time, int flags)
+{
+    MXFContext *mxf = s->priv_data;
+    AVRational edit_unit_tb = { mxf->index_edit_rate.den, mxf->index_edit_rate.num };
+    int64_t edit_unit, pos;
+
+    edit_unit = av_rescale_q(sample_time, st->time_base, edit_unit_tb) - mxf->index_start_position;
+    edit_unit = FFMAX(edit_unit, 0);
+    if (mxf->edit_unit_byte_count) {
+        if (st->duration != AV_NOPTS_VALUE &&
+            edit_unit >= av_rescale_q(st->duration, st->time_base, edit_unit_tb))
+            return -1;
+        pos = mxf_essence_offset(mxf, mxf->index_body_sid, edit_unit * mxf->edit_unit_byte_count);
+    } else {
+        if (edit_unit >= mxf->nb_index_entries)
+            return -1;
+        /* the entries are in stored order, find the frame displayed at
+           edit_unit, then the key frame it depends on */
+        edit_unit += mxf->index_entries[edit_unit].temporal_offset;
+        if (!(flags & AVSEEK_FLAG_ANY))
+            edit_unit += mxf->index_entries[av_clip(edit_unit, 0, mxf->nb_index_entries - 1)].key_frame_offset;
+        if (edit_unit < 0 || edit_unit >= mxf->nb_index_entries)
+            return -1;
+        pos = mxf->index_entries[edit_unit].pos;
+    }
+    if (pos < 0 || url_fseek(s->pb, pos, SEEK_SET) < 0)
+        return -1;
+    av_update_cur_dts(s, st, av_rescale_q(edit_unit + mxf->index_start_position,
+                                          edit_unit_tb, st->time_base));
+    return 0;
+}
+
+/* rudimentary byte seek, if there is no index */
 static int mxf_read_seek(AVFormatContext *s, int stream_index, int64_t sample_time, int flags)
 {
+    MXFContext *mxf = s->priv_data;
     AVStream *st = s->streams[stream_index];
     int64_t seconds;
 
+    if (mxf->index_edit_rate.num)
+        return mxf_read_seek_index(s, st, sample_time, flags);
     if (!s->bit_rate)
         return -1;
     if (sample_time < 0)
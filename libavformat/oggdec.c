@@ -195,19 +195,49 @@ ogg_new_buf(struct ogg *ogg, int idx)
     return 0;
 }
 
+static uint64_t
+ogg_gptopts (AVFormatContext * s, int i, uint64_t gp)
+{
+    struct ogg *ogg = s->priv_data;
+    struct ogg_stream *os = ogg->streams + i;
+    uint64_t pts = AV_NOPTS_VALUE;
+
+    if(os->codec->gptopts){
+        pts = os->codec->gptopts(s, i, gp);
+    } else {
+        pts = gp;
+    }
+
+    return pts;
+}
+
+/**
+ * Remember the position of a page in the index of its stream, seeks
+ * start bisecting from the closest known pages.
+ */
+static void
+ogg_add_seek_point (AVFormatContext * s, int idx, int64_t pos, uint64_t gp)
+{
+    struct ogg *ogg = s->priv_data;
+    struct ogg_stream *os = ogg->streams + idx;
+    int flags = AVINDEX_KEYFRAME;
+
+    if (gp == -1 || !os->codec || os->header < 0 || !s->streams[idx])
+        return;
+    if (os->codec->keyframe_granule &&
+        os->codec->keyframe_granule (s, idx, gp) != gp)
+        flags = 0;
+
+    ff_reduce_index (s, idx);
+    av_add_index_entry (s->streams[idx], pos, ogg_gptopts (s, idx, gp),
+                        0, 0, flags);
+}
+
 static int
-ogg_read_page (AVFormatContext * s, int *str)
+ogg_sync (AVFormatContext * s)
 {
     ByteIOContext *bc = s->pb;
-    struct ogg *ogg = s->priv_data;
-    struct ogg_stream *os;
     int i = 0;
-    int flags, nsegs;
-    uint64_t gp;
-    uint32_t serial;
-    uint32_t seq;
-    uint32_t crc;
-    int size, idx;
     uint8_t sync[4];
     int sp = 0;
 
@@ -233,6 +263,28 @@ ogg_read_page (AVFormatContext * s, int *str)
         return -1;
     }
 
+    return 0;
+}
+
+static int
+ogg_read_page (AVFormatContext * s, int *str)
+{
+    ByteIOContext *bc = s->pb;
+    struct ogg *ogg = s->priv_data;
+    struct ogg_stream *os;
+    int i;
+    int flags, nsegs;
+    uint64_t gp;
+    uint32_t serial;
+    uint32_t seq;
+    uint32_t crc;
+    int size, idx;
+    int64_t pos;
+
+    if (ogg_sync (s) < 0)
+        return -1;
+    ogg->page_pos = pos = url_ftell (bc) - 4;
+
     if (url_fgetc (bc) != 0)      /* version */
         return -1;
 
@@ -292,6 +344,8 @@ ogg_read_page (AVFormatContext * s, int *str)
     os->granule = gp;
     os->flags = flags;
 
+    ogg_add_seek_point (s, idx, pos, gp);
+
     if (str)
         *str = idx;
 
@@ -418,6 +472,8 @@ ogg_get_headers (AVFormatContext * s)
             return -1;
     }while (!ogg->headers);
 
+    ogg->data_start = ogg->page_pos;
+
 #if 0
     av_log (s, AV_LOG_DEBUG, "found headers\n");
 #endif
@@ -425,23 +481,6 @@ ogg_get_headers (AVFormatContext * s)
     return 0;
 }
 
-static uint64_t
-ogg_gptopts (AVFormatContext * s, int i, uint64_t gp)
-{
-    struct ogg *ogg = s->priv_data;
-    struct ogg_stream *os = ogg->streams + i;
-    uint64_t pts = AV_NOPTS_VALUE;
-
-    if(os->codec->gptopts){
-        pts = os->codec->gptopts(s, i, gp);
-    } else {
-        pts = gp;
-    }
-
-    return pts;
-}
-
-
 static int
 ogg_get_length (AVFormatContext * s)
 {
@@ -588,6 +627,165 @@ ogg_read_timestamp (AVFormatContext * s, int stream_index, int64_t * pos_arg,
     return pts;
 }
 
+/**
+ * Read the header of the next page and skip its data.
+ * @return position of the page, negative at the end of the file
+ */
+static int64_t
+ogg_read_page_header (AVFormatContext * s, int *str, uint64_t *gp)
+{
+    ByteIOContext *bc = s->pb;
+    struct ogg *ogg = s->priv_data;
+    uint8_t segments[255];
+    int64_t pos;
+    int i, nsegs, size = 0;
+
+    do{
+        if (ogg_sync (s) < 0)
+            return -1;
+        pos = url_ftell (bc) - 4;
+    }while (url_fgetc (bc) != 0 && url_fseek (bc, pos + 1, SEEK_SET) >= 0);
+
+    url_fgetc (bc);               /* flags */
+    *gp = get_le64 (bc);
+    *str = ogg_find_stream (ogg, get_le32 (bc));
+    url_fskip (bc, 8);            /* seq, crc */
+    nsegs = url_fgetc (bc);
+    if (nsegs < 0 || get_buffer (bc, segments, nsegs) < nsegs)
+        return -1;
+    for (i = 0; i < nsegs; i++)
+        size += segments[i];
+    url_fskip (bc, size);
+
+    if (*str >= 0)
+        ogg_add_seek_point (s, *str, pos, *gp);
+
+    return pos;
+}
+
+/**
+ * Find the next page of stream idx with a granule position starting
+ * before limit.
+ */
+static int64_t
+ogg_next_granule_page (AVFormatContext * s, int idx, int64_t limit, uint64_t *gp)
+{
+    int64_t pos;
+    int i;
+
+    while ((pos = ogg_read_page_header (s, &i, gp)) >= 0 && pos < limit)
+        if (i == idx && *gp != -1)
+            return pos;
+
+    return -1;
+}
+
+/**
+ * Bisect on page granule positions for the last page of stream idx
+ * ending before timestamp, starting from the closest known pages.
+ * @return position of that page, or of the first data page if none
+ */
+static int64_t
+ogg_bisect (AVFormatContext * s, int idx, int64_t timestamp)
+{
+    struct ogg *ogg = s->priv_data;
+    ByteIOContext *bc = s->pb;
+    AVStream *st = s->streams[idx];
+    int64_t lo = ogg->data_start, hi = url_fsize (bc);
+    int64_t pos, best;
+    uint64_t gp;
+    int i;
+
+    /* every page of the stream starting at or after hi ends at or after
+       timestamp, lo is a page ending before it or the first data page */
+    i = av_index_search_timestamp (st, timestamp - 1,
+                                   AVSEEK_FLAG_ANY | AVSEEK_FLAG_BACKWARD);
+    if (i >= 0 && st->index_entries[i].pos > lo)
+        lo = st->index_entries[i].pos;
+    i = av_index_search_timestamp (st, timestamp, AVSEEK_FLAG_ANY);
+    if (i >= 0 && st->index_entries[i].pos > lo)
+        hi = FFMIN(hi, st->index_entries[i].pos);
+
+    while (hi - lo > MAX_PAGE_SIZE){
+        int64_t mid = lo + (hi - lo) / 2;
+
+        url_fseek (bc, mid, SEEK_SET);
+        pos = ogg_next_granule_page (s, idx, hi, &gp);
+        if (pos >= 0 && (int64_t)ogg_gptopts (s, idx, gp) < timestamp)
+            lo = pos;
+        else
+            hi = mid;
+    }
+
+    best = lo;
+    url_fseek (bc, lo, SEEK_SET);
+    while ((pos = ogg_next_granule_page (s, idx, hi, &gp)) >= 0 &&
+           (int64_t)ogg_gptopts (s, idx, gp) < timestamp)
+        best = pos;
+
+    return best;
+}
+
+/**
+ * Find the timestamp of the keyframe the frame at timestamp depends on,
+ * scanning the pages following pos, which ends before timestamp.
+ * @return the keyframe timestamp, INT64_MIN if it is at the start
+ */
+static int64_t
+ogg_keyframe_ts (AVFormatContext * s, int idx, int64_t pos, int64_t timestamp)
+{
+    struct ogg *ogg = s->priv_data;
+    struct ogg_stream *os = ogg->streams + idx;
+    uint64_t gp, prev = -1;
+    int64_t kts;
+
+    url_fseek (s->pb, pos, SEEK_SET);
+    while (ogg_next_granule_page (s, idx, INT64_MAX, &gp) >= 0){
+        if ((int64_t)ogg_gptopts (s, idx, gp) < timestamp){
+            prev = gp;
+            continue;
+        }
+        kts = ogg_gptopts (s, idx, os->codec->keyframe_granule (s, idx, gp));
+        if (kts <= timestamp)
+            return kts;
+        break;
+    }
+
+    /* a later keyframe ends the page, the previous page has ours */
+    if (prev == -1)
+        return INT64_MIN;
+    return ogg_gptopts (s, idx, os->codec->keyframe_granule (s, idx, prev));
+}
+
+static int
+ogg_read_seek (AVFormatContext * s, int stream_index, int64_t timestamp,
+               int flags)
+{
+    struct ogg *ogg = s->priv_data;
+    struct ogg_stream *os = ogg->streams + stream_index;
+    int64_t pos, kts;
+
+    if (url_is_streamed (s->pb) || url_fsize (s->pb) <= 0 || !os->codec ||
+        os->header < 0)
+        return -1;
+
+    pos = ogg_bisect (s, stream_index, timestamp);
+
+    /* frames only decode from the keyframe they depend on */
+    if (os->codec->keyframe_granule && !(flags & AVSEEK_FLAG_ANY)){
+        kts = ogg_keyframe_ts (s, stream_index, pos, timestamp);
+        if (kts == INT64_MIN)
+            pos = ogg->data_start;
+        else if (kts < timestamp)
+            pos = ogg_bisect (s, stream_index, kts);
+    }
+
+    url_fseek (s->pb, pos, SEEK_SET);
+    ogg_reset (ogg);
+
+    return 0;
+}
+
 static int ogg_probe(AVProbeData *p)
 {
     if (p->buf[0] == 'O' && p->buf[1] == 'g' &&
@@ -606,7 +804,7 @@ AVInputFormat ogg_demuxer = {
     ogg_read_header,
     ogg_read_packet,
     ogg_read_close,
-    NULL,
+    ogg_read_seek,
     ogg_read_timestamp,
     .extensions = "ogg",
     .metadata_conv = ff_vorbiscomment_metadata_conv,
@@ -46,6 +46,11 @@ struct ogg_codec {
      * 0 if granule is the end time of the associated packet.
      */
     int granule_is_start;
+    /**
+     * Return the granule position of the keyframe the frame at the given
+     * granule position depends on, NULL if every packet is a keyframe.
+     */
+    uint64_t (*keyframe_granule)(AVFormatContext *, int, uint64_t);
 };
 
 struct ogg_stream {
@@ -83,6 +88,8 @@ struct ogg {
     int headers;
     int curidx;
     uint64_t size;
+    int64_t page_pos;               ///< position of the last page read
+    int64_t data_start;             ///< position of the first page with data packets
     struct ogg_state *state;
 };
 
@@ -140,9 +140,20 @@ theora_gptopts(AVFormatContext *ctx, int idx, uint64_t gp)
     return iframe + pframe;
 }
 
+static uint64_t
+theora_keyframe_granule(AVFormatContext *ctx, int idx, uint64_t gp)
+{
+    struct ogg *ogg = ctx->priv_data;
+    struct ogg_stream *os = ogg->streams + idx;
+    struct theora_params *thp = os->private;
+
+    return gp & ~(uint64_t)thp->gpmask;
+}
+
 const struct ogg_codec ff_theora_codec = {
     .magic = "\200theora",
     .magicsize = 7,
     .header = theora_header,
-    .gptopts = theora_gptopts
+    .gptopts = theora_gptopts,
+    .keyframe_granule = theora_keyframe_granule
 };
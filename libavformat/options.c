@@ -46,6 +46,9 @@ static const AVOption options[]={
 {"fflags", NULL, OFFSET(flags), FF_OPT_TYPE_FLAGS, DEFAULT, INT_MIN, INT_MAX, D|E, "fflags"},
 {"ignidx", "ignore index", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_IGNIDX, INT_MIN, INT_MAX, D, "fflags"},
 {"genpts", "generate pts", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_GENPTS, INT_MIN, INT_MAX, D, "fflags"},
+{"fragment", "write fragmented output", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FRAGMENT, INT_MIN, INT_MAX, E, "fflags"},
+{"faststart", "put the index at the start of the file", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FASTSTART, INT_MIN, INT_MAX, E, "fflags"},
+{"fastprobe", "stop probing streams as soon as their codec parameters are known", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FASTPROBE, INT_MIN, INT_MAX, D, "fflags"},
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
 {"track", " set the track number", OFFSET(track), FF_OPT_TYPE_INT, DEFAULT, 0, INT_MAX, E},
 {"year", "set the year", OFFSET(year), FF_OPT_TYPE_INT, DEFAULT, INT_MIN, INT_MAX, E},
@@ -54,6 +57,9 @@ static const AVOption options[]={
 {"cryptokey", "decryption key", OFFSET(key), FF_OPT_TYPE_BINARY, 0, 0, 0, D},
 {"indexmem", "max memory used for timestamp index (per stream)", OFFSET(max_index_size), FF_OPT_TYPE_INT, 1<<20, 0, INT_MAX, D},
 {"rtbufsize", "max memory used for buffering real-time frames", OFFSET(max_picture_buffer), FF_OPT_TYPE_INT, 3041280, 0, INT_MAX, D}, /* defaults to 1s of 15fps 352x288 YUYV422 video */
+{"fragduration", "minimum duration of output fragments in microseconds", OFFSET(fragment_duration), FF_OPT_TYPE_INT, DEFAULT, 0, INT_MAX, E},
+{"max_interleave_delta", "maximum buffering duration for interleaving in microseconds, 0 for unlimited", OFFSET(max_interleave_delta), FF_OPT_TYPE_INT64, DEFAULT, 0, INT64_MAX, E},
+{"indexcache", "file keeping the seek index across opens", OFFSET(index_cache_path), FF_OPT_TYPE_STRING, DEFAULT, CHAR_MIN, CHAR_MAX, D},
 {"fdebug", "print specific debug info", OFFSET(debug), FF_OPT_TYPE_FLAGS, DEFAULT, 0, INT_MAX, E|D, "fdebug"},
 {"ts", NULL, 0, FF_OPT_TYPE_CONST, FF_FDEBUG_TS, INT_MIN, INT_MAX, E|D, "fdebug"},
 {NULL},
@@ -0,0 +1,188 @@
+/*
+ * per context pools of packet list nodes and payloads
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/common.h"
+#include "libavutil/mem.h"
+#include "avformat.h"
+#include "internal.h"
+
+#define POOL_MIN_SHIFT      8   ///< size of the smallest payload class, 256 bytes
+#define POOL_NB_CLASSES    13   ///< the largest payload class holds 1 MiB
+#define POOL_MAX_BUFFERS   32   ///< payloads kept per class
+#define POOL_MAX_NODES    256   ///< list nodes kept
+
+typedef struct PoolBuffer {
+    struct AVPacketPool *pool;
+    struct PoolBuffer *next;
+    int size_class;
+} PoolBuffer;
+
+/* keep the payload following the header aligned */
+#define POOL_HEADER_SIZE FFALIGN(sizeof(PoolBuffer), 16)
+
+struct AVPacketPool {
+    AVPacketList *nodes;
+    int nb_nodes;
+    PoolBuffer *buffers[POOL_NB_CLASSES];
+    int nb_buffers[POOL_NB_CLASSES];
+    int nb_outstanding;     ///< payloads in use, the pool is freed once they are all back
+    int closed;
+    AVPacketPoolStats stats;
+};
+
+static AVPacketPool *get_pool(AVFormatContext *s)
+{
+    if (!s->packet_pool)
+        s->packet_pool = av_mallocz(sizeof(AVPacketPool));
+    return s->packet_pool;
+}
+
+static void free_pool_cache(AVPacketPool *pool)
+{
+    AVPacketList *pktl;
+    PoolBuffer *buf;
+    int i;
+
+    while ((pktl = pool->nodes)) {
+        pool->nodes = pktl->next;
+        av_free(pktl);
+    }
+    pool->nb_nodes = 0;
+    for (i = 0; i < POOL_NB_CLASSES; i++) {
+        while ((buf = pool->buffers[i])) {
+            pool->buffers[i] = buf->next;
+            av_free(buf);
+        }
+        pool->nb_buffers[i] = 0;
+    }
+}
+
+AVPacketList *ff_packet_pool_get_node(AVFormatContext *s)
+{
+    AVPacketPool *pool = get_pool(s);
+    AVPacketList *pktl;
+
+    if (pool && pool->nodes) {
+        pktl = pool->nodes;
+        pool->nodes = pktl->next;
+        pool->nb_nodes--;
+        pool->stats.node_hits++;
+        memset(pktl, 0, sizeof(*pktl));
+        return pktl;
+    }
+    if (pool)
+        pool->stats.node_misses++;
+    return av_mallocz(sizeof(AVPacketList));
+}
+
+void ff_packet_pool_put_node(AVFormatContext *s, AVPacketList *pktl)
+{
+    AVPacketPool *pool = s->packet_pool;
+
+    if (pool && pool->nb_nodes < POOL_MAX_NODES) {
+        pktl->next = pool->nodes;
+        pool->nodes = pktl;
+        pool->nb_nodes++;
+    } else
+        av_free(pktl);
+}
+
+static void destruct_pool_packet(AVPacket *pkt)
+{
+    PoolBuffer *buf = pkt->priv;
+    AVPacketPool *pool = buf->pool;
+    int c = buf->size_class;
+
+    pool->nb_outstanding--;
+    if (!pool->closed && pool->nb_buffers[c] < POOL_MAX_BUFFERS) {
+        buf->next = pool->buffers[c];
+        pool->buffers[c] = buf;
+        pool->nb_buffers[c]++;
+    } else {
+        av_free(buf);
+        if (pool->closed && !pool->nb_outstanding)
+            av_free(pool);
+    }
+    pkt->priv = NULL;
+    pkt->data = NULL; pkt->size = 0;
+}
+
+int ff_packet_pool_dup_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    AVPacketPool *pool;
+    PoolBuffer *buf;
+    unsigned int size;
+    int c;
+
+    if (pkt->destruct || !pkt->data)
+        return av_dup_packet(pkt);
+
+    size = pkt->size + FF_INPUT_BUFFER_PADDING_SIZE;
+    for (c = 0; c < POOL_NB_CLASSES && size > 1U << (c + POOL_MIN_SHIFT); c++);
+    pool = get_pool(s);
+    if (c == POOL_NB_CLASSES || !pool || size < (unsigned)pkt->size)
+        return av_dup_packet(pkt);
+
+    if ((buf = pool->buffers[c])) {
+        pool->buffers[c] = buf->next;
+        pool->nb_buffers[c]--;
+        pool->stats.payload_hits++;
+    } else {
+        buf = av_malloc(POOL_HEADER_SIZE + (1 << (c + POOL_MIN_SHIFT)));
+        if (!buf)
+            return AVERROR(ENOMEM);
+        buf->pool       = pool;
+        buf->size_class = c;
+        pool->stats.payload_misses++;
+    }
+    pool->nb_outstanding++;
+
+    memcpy((uint8_t*)buf + POOL_HEADER_SIZE, pkt->data, pkt->size);
+    pkt->data = (uint8_t*)buf + POOL_HEADER_SIZE;
+    memset(pkt->data + pkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    pkt->priv     = buf;
+    pkt->destruct = destruct_pool_packet;
+    return 0;
+}
+
+void ff_packet_pool_close(AVFormatContext *s)
+{
+    AVPacketPool *pool = s->packet_pool;
+
+    if (!pool)
+        return;
+    av_log(s, AV_LOG_DEBUG, "packet pool: nodes %"PRId64" hits %"PRId64" misses, "
+           "payloads %"PRId64" hits %"PRId64" misses\n",
+           pool->stats.node_hits, pool->stats.node_misses,
+           pool->stats.payload_hits, pool->stats.payload_misses);
+    free_pool_cache(pool);
+    pool->closed = 1;
+    if (!pool->nb_outstanding)
+        av_free(pool);
+    s->packet_pool = NULL;
+}
+
+void av_packet_pool_get_stats(AVFormatContext *s, AVPacketPoolStats *stats)
+{
+    if (s->packet_pool)
+        *stats = s->packet_pool->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
@@ -436,6 +436,8 @@ int av_open_input_stream(AVFormatContext **ic_ptr,
 
     ic->raw_packet_buffer_remaining_size = RAW_PACKET_BUFFER_SIZE;
 
+    ff_index_cache_open(ic);
+
     *ic_ptr = ic;
     return 0;
  fail:
@@ -554,9 +556,9 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
 
 /*******************************************************/
 
-static AVPacket *add_to_pktbuf(AVPacketList **packet_buffer, AVPacket *pkt,
-                               AVPacketList **plast_pktl){
-    AVPacketList *pktl = av_mallocz(sizeof(AVPacketList));
+static AVPacket *add_to_pktbuf(AVFormatContext *s, AVPacketList **packet_buffer,
+                               AVPacket *pkt, AVPacketList **plast_pktl){
+    AVPacketList *pktl = ff_packet_pool_get_node(s);
     if (!pktl)
         return NULL;
 
@@ -589,7 +591,7 @@ int av_read_packet(AVFormatContext *s, AVPacket *pkt)
                 pd->buf_size = 0;
                 s->raw_packet_buffer = pktl->next;
                 s->raw_packet_buffer_remaining_size += pkt->size;
-                av_free(pktl);
+                ff_packet_pool_put_node(s, pktl);
                 return 0;
             }
         }
@@ -621,7 +623,7 @@ int av_read_packet(AVFormatContext *s, AVPacket *pkt)
                      !st->probe_packets))
             return ret;
 
-        add_to_pktbuf(&s->raw_packet_buffer, pkt, &s->raw_packet_buffer_end);
+        add_to_pktbuf(s, &s->raw_packet_buffer, pkt, &s->raw_packet_buffer_end);
         s->raw_packet_buffer_remaining_size -= pkt->size;
 
         if(st->codec->codec_id == CODEC_ID_PROBE){
@@ -954,6 +956,17 @@ static void compute_pkt_fields(AVFormatContext *s, AVStream *st,
 }
 
 
+/**
+ * Return whether keyframes read are added to the index: always for formats
+ * relying on it for seeking, otherwise if it is kept in an index cache for
+ * av_seek_frame_binary().
+ */
+static int generic_index(AVFormatContext *s)
+{
+    return (s->iformat->flags & AVFMT_GENERIC_INDEX) ||
+           (s->index_cache && s->iformat->read_timestamp);
+}
+
 static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
 {
     AVStream *st;
@@ -971,7 +984,7 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
                 *pkt = st->cur_pkt; st->cur_pkt.data= NULL;
                 compute_pkt_fields(s, st, NULL, pkt);
                 s->cur_st = NULL;
-                if ((s->iformat->flags & AVFMT_GENERIC_INDEX) &&
+                if (generic_index(s) &&
                     (pkt->flags & PKT_FLAG_KEY) && pkt->dts != AV_NOPTS_VALUE) {
                     ff_reduce_index(s, st->index);
                     av_add_index_entry(st, pkt->pos, pkt->dts, 0, 0, AVINDEX_KEYFRAME);
@@ -999,7 +1012,7 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
                     pkt->destruct = NULL;
                     compute_pkt_fields(s, st, st->parser, pkt);
 
-                    if((s->iformat->flags & AVFMT_GENERIC_INDEX) && pkt->flags & PKT_FLAG_KEY){
+                    if(generic_index(s) && pkt->flags & PKT_FLAG_KEY){
                         ff_reduce_index(s, st->index);
                         av_add_index_entry(st, st->parser->frame_offset, pkt->dts,
                                            0, 0, AVINDEX_KEYFRAME);
@@ -1070,7 +1083,7 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
                 }else if(st->need_parsing == AVSTREAM_PARSE_HEADERS){
                     st->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
                 }
-                if(st->parser && (s->iformat->flags & AVFMT_GENERIC_INDEX)){
+                if(st->parser && generic_index(s)){
                     st->parser->next_frame_offset=
                     st->parser->cur_offset= st->cur_pkt.pos;
                 }
@@ -1119,7 +1132,7 @@ int av_read_frame(AVFormatContext *s, AVPacket *pkt)
                 /* read packet from packet buffer, if there is data */
                 *pkt = *next_pkt;
                 s->packet_buffer = pktl->next;
-                av_free(pktl);
+                ff_packet_pool_put_node(s, pktl);
                 return 0;
             }
         }
@@ -1133,7 +1146,7 @@ int av_read_frame(AVFormatContext *s, AVPacket *pkt)
                     return ret;
             }
 
-            if(av_dup_packet(add_to_pktbuf(&s->packet_buffer, pkt,
+            if(av_dup_packet(add_to_pktbuf(s, &s->packet_buffer, pkt,
                                            &s->packet_buffer_end)) < 0)
                 return AVERROR(ENOMEM);
         }else{
@@ -1143,10 +1156,35 @@ int av_read_frame(AVFormatContext *s, AVPacket *pkt)
     }
 }
 
+struct AVProgramQueue {
+    AVFormatContext *s;
+    int program_id;
+    AVPacketList *first, *last;
+    int size;     /* bytes of the queued packets */
+    struct AVProgramQueue *next;
+};
+
+static void program_queue_flush(AVProgramQueue *q)
+{
+    AVPacketList *pktl;
+
+    while ((pktl = q->first)) {
+        q->first = pktl->next;
+        av_free_packet(&pktl->pkt);
+        ff_packet_pool_put_node(q->s, pktl);
+    }
+    q->last = NULL;
+    q->size = 0;
+}
+
 /* XXX: suppress the packet queue */
 static void flush_packet_queue(AVFormatContext *s)
 {
     AVPacketList *pktl;
+    AVProgramQueue *q;
+
+    for (q = s->program_queues; q; q = q->next)
+        program_queue_flush(q);
 
     for(;;) {
         pktl = s->packet_buffer;
@@ -1154,13 +1192,13 @@ static void flush_packet_queue(AVFormatContext *s)
             break;
         s->packet_buffer = pktl->next;
         av_free_packet(&pktl->pkt);
-        av_free(pktl);
+        ff_packet_pool_put_node(s, pktl);
     }
     while(s->raw_packet_buffer){
         pktl = s->raw_packet_buffer;
         s->raw_packet_buffer = pktl->next;
         av_free_packet(&pktl->pkt);
-        av_free(pktl);
+        ff_packet_pool_put_node(s, pktl);
     }
     s->packet_buffer_end=
     s->raw_packet_buffer_end= NULL;
@@ -1249,6 +1287,24 @@ void ff_reduce_index(AVFormatContext *s, int stream_index)
     }
 }
 
+int ff_reserve_index_entries(AVStream *st, unsigned int count)
+{
+    AVIndexEntry *entries;
+    unsigned int size;
+
+    if((uint64_t)st->nb_index_entries + count >= UINT_MAX / sizeof(AVIndexEntry))
+        return -1;
+    size= (st->nb_index_entries + count) * sizeof(AVIndexEntry);
+    if(size <= st->index_entries_allocated_size)
+        return 0;
+    entries= av_realloc(st->index_entries, size);
+    if(!entries)
+        return AVERROR(ENOMEM);
+    st->index_entries= entries;
+    st->index_entries_allocated_size= size;
+    return 0;
+}
+
 int av_add_index_entry(AVStream *st,
                             int64_t pos, int64_t timestamp, int size, int distance, int flags)
 {
@@ -1267,7 +1323,11 @@ int av_add_index_entry(AVStream *st,
 
     st->index_entries= entries;
 
-    index= av_index_search_timestamp(st, timestamp, AVSEEK_FLAG_ANY);
+    /* indexes are mostly built in timestamp order, append without searching */
+    if(!st->nb_index_entries || entries[st->nb_index_entries-1].timestamp < timestamp)
+        index= -1;
+    else
+        index= av_index_search_timestamp(st, timestamp, AVSEEK_FLAG_ANY);
 
     if(index<0){
         index= st->nb_index_entries++;
@@ -1913,11 +1973,11 @@ static int has_codec_parameters(AVCodecContext *enc)
     return enc->codec_id != CODEC_ID_NONE && val != 0;
 }
 
-static int try_decode_frame(AVStream *st, AVPacket *avpkt)
+static int try_decode_frame(AVStream *st, AVPacket *avpkt, int *got_frame)
 {
     int16_t *samples;
     AVCodec *codec;
-    int got_picture, data_size, ret=0;
+    int got_picture = 0, data_size = 0, ret=0;
     AVFrame picture;
 
     if(!st->codec->codec){
@@ -1948,6 +2008,7 @@ static int try_decode_frame(AVStream *st, AVPacket *avpkt)
         default:
             break;
         }
+        *got_frame = got_picture || data_size > 0;
     }
  fail:
     return ret;
@@ -2058,6 +2119,8 @@ int av_find_stream_info(AVFormatContext *ic)
     int64_t old_offset = url_ftell(ic->pb);
     int64_t codec_info_duration[MAX_STREAMS]={0};
     int codec_info_nb_frames[MAX_STREAMS]={0};
+    int decoded_frames[MAX_STREAMS]={0};
+    int fast = ic->flags & AVFMT_FLAG_FASTPROBE;
 
     duration_error = av_mallocz(MAX_STREAMS * sizeof(*duration_error));
     if (!duration_error) return AVERROR(ENOMEM);
@@ -2095,10 +2158,11 @@ int av_find_stream_info(AVFormatContext *ic)
         /* check if one codec still needs to be handled */
         for(i=0;i<ic->nb_streams;i++) {
             st = ic->streams[i];
-            if (!has_codec_parameters(st->codec))
+            /* in fast mode, what a decoded frame did not tell stays unknown */
+            if (!has_codec_parameters(st->codec) && !(fast && decoded_frames[i]))
                 break;
             /* variable fps and no guess at the real fps */
-            if(   tb_unreliable(st->codec)
+            if(   tb_unreliable(st->codec) && !fast
                && duration_count[i]<20 && st->codec->codec_type == CODEC_TYPE_VIDEO)
                 break;
             if(st->parser && st->parser->parser->split && !st->codec->extradata)
@@ -2109,8 +2173,9 @@ int av_find_stream_info(AVFormatContext *ic)
         if (i == ic->nb_streams) {
             /* NOTE: if the format has no header, then we need to read
                some packets to get most of the streams, so we cannot
-               stop here */
-            if (!(ic->ctx_flags & AVFMTCTX_NOHEADER)) {
+               stop here, unless fast probing accepts missing streams
+               which start late */
+            if (!(ic->ctx_flags & AVFMTCTX_NOHEADER) || (fast && ic->nb_streams)) {
                 /* if we found the info for all the codecs, we can stop */
                 ret = count;
                 av_log(ic, AV_LOG_DEBUG, "All info found\n");
@@ -2145,7 +2210,7 @@ int av_find_stream_info(AVFormatContext *ic)
             break;
         }
 
-        pkt= add_to_pktbuf(&ic->packet_buffer, &pkt1, &ic->packet_buffer_end);
+        pkt= add_to_pktbuf(ic, &ic->packet_buffer, &pkt1, &ic->packet_buffer_end);
         if(av_dup_packet(pkt) < 0) {
             av_free(duration_error);
             return AVERROR(ENOMEM);
@@ -2204,8 +2269,11 @@ int av_find_stream_info(AVFormatContext *ic)
            decompress the frame. We try to avoid that in most cases as
            it takes longer and uses more memory. For MPEG-4, we need to
            decompress for QuickTime. */
-        if (!has_codec_parameters(st->codec))
-            try_decode_frame(st, pkt);
+        if (!has_codec_parameters(st->codec) && !(fast && decoded_frames[st->index])) {
+            int got_frame = 0;
+            try_decode_frame(st, pkt, &got_frame);
+            decoded_frames[st->index] += got_frame;
+        }
 
         count++;
     }
@@ -2273,6 +2341,8 @@ int av_find_stream_info(AVFormatContext *ic)
 
     compute_chapters_end(ic);
 
+    ff_index_cache_apply(ic);
+
 #if 0
     /* correct DTS for B-frame streams with no timestamps */
     for(i=0;i<ic->nb_streams;i++) {
@@ -2328,6 +2398,9 @@ void av_close_input_stream(AVFormatContext *s)
     int i;
     AVStream *st;
 
+    while (s->program_queues)
+        av_program_queue_detach(s->program_queues);
+    ff_index_cache_close(s);
     if (s->iformat->read_close)
         s->iformat->read_close(s);
     for(i=0;i<s->nb_streams;i++) {
@@ -2358,6 +2431,7 @@ void av_close_input_stream(AVFormatContext *s)
     }
     av_freep(&s->programs);
     flush_packet_queue(s);
+    ff_packet_pool_close(s);
     av_freep(&s->priv_data);
     while(s->nb_chapters--) {
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
@@ -2368,6 +2442,7 @@ void av_close_input_stream(AVFormatContext *s)
     }
     av_freep(&s->chapters);
     av_metadata_free(&s->metadata);
+    av_freep(&s->index_cache_path);
     av_free(s);
 }
 
@@ -2679,10 +2754,10 @@ void ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
 {
     AVPacketList **next_point, *this_pktl;
 
-    this_pktl = av_mallocz(sizeof(AVPacketList));
+    this_pktl = ff_packet_pool_get_node(s);
     this_pktl->pkt= *pkt;
     pkt->destruct= NULL;             // do not free original but only the copy
-    av_dup_packet(&this_pktl->pkt);  // duplicate the packet if it uses non-alloced memory
+    ff_packet_pool_dup_packet(s, &this_pktl->pkt); // duplicate the packet if it uses non-alloced memory
 
     if(s->streams[pkt->stream_index]->last_in_packet_buffer){
         next_point = &(s->streams[pkt->stream_index]->last_in_packet_buffer->next);
@@ -2714,16 +2789,14 @@ int ff_interleave_compare_dts(AVFormatContext *s, AVPacket *next, AVPacket *pkt)
 {
     AVStream *st = s->streams[ pkt ->stream_index];
     AVStream *st2= s->streams[ next->stream_index];
-    int64_t left = st2->time_base.num * (int64_t)st ->time_base.den;
-    int64_t right= st ->time_base.num * (int64_t)st2->time_base.den;
 
     if (pkt->dts == AV_NOPTS_VALUE)
         return 0;
 
-    return next->dts * left > pkt->dts * right; //FIXME this can overflow
+    return av_compare_ts(next->dts, st2->time_base, pkt->dts, st->time_base) > 0;
 }
 
-int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
+int ff_interleave_packet_list(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
     AVPacketList *pktl;
     int stream_count=0;
     int i;
@@ -2745,7 +2818,7 @@ int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pk
 
         if(s->streams[out->stream_index]->last_in_packet_buffer == pktl)
             s->streams[out->stream_index]->last_in_packet_buffer= NULL;
-        av_freep(&pktl);
+        ff_packet_pool_put_node(s, pktl);
         return 1;
     }else{
         av_init_packet(out);
@@ -2753,6 +2826,228 @@ int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pk
     }
 }
 
+typedef struct InterleaveEntry {
+    AVPacket pkt;
+    int64_t seq;                ///< arrival order, breaks dts ties
+    struct InterleaveEntry *next;
+} InterleaveEntry;
+
+typedef struct InterleaveStream {
+    InterleaveEntry *first, *last;
+    int heap_pos;               ///< position in the heap, -1 if nothing is queued
+} InterleaveStream;
+
+/**
+ * One packet FIFO per stream, and a min-heap of the streams with packets
+ * queued ordered by the dts of their first packet.
+ */
+typedef struct AVInterleaver {
+    InterleaveStream *streams;
+    int nb_streams;
+    int *heap;
+    int nb_heap;
+    int64_t seq;
+    int64_t max_dts;            ///< highest dts queued, in AV_TIME_BASE units
+    InterleaveEntry *free_entries;
+    int nb_free_entries;
+} AVInterleaver;
+
+#define INTERLEAVE_MAX_FREE_ENTRIES 256
+
+/**
+ * @return 1 if the first packet of stream a is to be written before the
+ * first packet of stream b
+ */
+static int interleave_before(AVFormatContext *s, int a, int b)
+{
+    InterleaveEntry *ea = s->interleaver->streams[a].first;
+    InterleaveEntry *eb = s->interleaver->streams[b].first;
+
+    if (ea->pkt.dts != AV_NOPTS_VALUE && eb->pkt.dts != AV_NOPTS_VALUE) {
+        int cmp = av_compare_ts(ea->pkt.dts, s->streams[a]->time_base,
+                                eb->pkt.dts, s->streams[b]->time_base);
+        if (cmp)
+            return cmp < 0;
+    }
+    return ea->seq < eb->seq;
+}
+
+static void interleave_heap_set(AVInterleaver *il, int pos, int idx)
+{
+    il->heap[pos] = idx;
+    il->streams[idx].heap_pos = pos;
+}
+
+static void interleave_heap_up(AVFormatContext *s, int pos)
+{
+    AVInterleaver *il = s->interleaver;
+    int idx = il->heap[pos];
+
+    while (pos > 0 && interleave_before(s, idx, il->heap[(pos - 1) >> 1])) {
+        interleave_heap_set(il, pos, il->heap[(pos - 1) >> 1]);
+        pos = (pos - 1) >> 1;
+    }
+    interleave_heap_set(il, pos, idx);
+}
+
+static void interleave_heap_down(AVFormatContext *s, int pos)
+{
+    AVInterleaver *il = s->interleaver;
+    int idx = il->heap[pos];
+
+    for (;;) {
+        int child = 2*pos + 1;
+        if (child >= il->nb_heap)
+            break;
+        if (child + 1 < il->nb_heap &&
+            interleave_before(s, il->heap[child + 1], il->heap[child]))
+            child++;
+        if (!interleave_before(s, il->heap[child], idx))
+            break;
+        interleave_heap_set(il, pos, il->heap[child]);
+        pos = child;
+    }
+    interleave_heap_set(il, pos, idx);
+}
+
+static int interleave_add_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    AVInterleaver *il = s->interleaver;
+    InterleaveStream *ist;
+    InterleaveEntry *e;
+    int i, idx = pkt->stream_index;
+
+    if (!il) {
+        il = s->interleaver = av_mallocz(sizeof(AVInterleaver));
+        if (!il)
+            return AVERROR(ENOMEM);
+        il->max_dts = INT64_MIN;
+    }
+    if (il->nb_streams < s->nb_streams) {
+        void *tmp = av_realloc(il->streams, s->nb_streams * sizeof(*il->streams));
+        if (!tmp)
+            return AVERROR(ENOMEM);
+        il->streams = tmp;
+        tmp = av_realloc(il->heap, s->nb_streams * sizeof(*il->heap));
+        if (!tmp)
+            return AVERROR(ENOMEM);
+        il->heap = tmp;
+        for (i = il->nb_streams; i < s->nb_streams; i++) {
+            il->streams[i].first = il->streams[i].last = NULL;
+            il->streams[i].heap_pos = -1;
+        }
+        il->nb_streams = s->nb_streams;
+    }
+
+    if ((e = il->free_entries)) {
+        il->free_entries = e->next;
+        il->nb_free_entries--;
+    } else if (!(e = av_malloc(sizeof(InterleaveEntry))))
+        return AVERROR(ENOMEM);
+    e->pkt  = *pkt;
+    e->seq  = il->seq++;
+    e->next = NULL;
+    pkt->destruct = NULL;            // do not free original but only the copy
+    ff_packet_pool_dup_packet(s, &e->pkt); // duplicate the packet if it uses non-alloced memory
+
+    if (pkt->dts != AV_NOPTS_VALUE)
+        il->max_dts = FFMAX(il->max_dts,
+                            av_rescale_q(pkt->dts, s->streams[idx]->time_base, AV_TIME_BASE_Q));
+
+    ist = &il->streams[idx];
+    if (ist->last) {
+        ist->last->next = e;
+        ist->last = e;
+    } else {
+        ist->first = ist->last = e;
+        il->heap[il->nb_heap] = idx;
+        interleave_heap_up(s, il->nb_heap++);
+    }
+    return 0;
+}
+
+static void interleave_get_packet(AVFormatContext *s, AVPacket *out)
+{
+    AVInterleaver *il = s->interleaver;
+    int idx = il->heap[0];
+    InterleaveStream *ist = &il->streams[idx];
+    InterleaveEntry *e = ist->first;
+
+    *out = e->pkt;
+    ist->first = e->next;
+    if (ist->first) {
+        interleave_heap_down(s, 0);
+    } else {
+        ist->last = NULL;
+        ist->heap_pos = -1;
+        if (--il->nb_heap) {
+            interleave_heap_set(il, 0, il->heap[il->nb_heap]);
+            interleave_heap_down(s, 0);
+        }
+    }
+
+    if (il->nb_free_entries < INTERLEAVE_MAX_FREE_ENTRIES) {
+        e->next = il->free_entries;
+        il->free_entries = e;
+        il->nb_free_entries++;
+    } else
+        av_free(e);
+}
+
+static void interleave_free(AVFormatContext *s)
+{
+    AVInterleaver *il = s->interleaver;
+    InterleaveEntry *e;
+    int i;
+
+    if (!il)
+        return;
+    for (i = 0; i < il->nb_streams; i++) {
+        while ((e = il->streams[i].first)) {
+            il->streams[i].first = e->next;
+            av_free_packet(&e->pkt);
+            av_free(e);
+        }
+    }
+    while ((e = il->free_entries)) {
+        il->free_entries = e->next;
+        av_free(e);
+    }
+    av_free(il->streams);
+    av_free(il->heap);
+    av_freep(&s->interleaver);
+}
+
+int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
+    AVInterleaver *il;
+    int ret;
+
+    if (pkt && (ret = interleave_add_packet(s, pkt)) < 0)
+        return ret;
+
+    il = s->interleaver;
+    if (il && il->nb_heap) {
+        int output = il->nb_heap == s->nb_streams || flush;
+
+        if (!output && s->max_interleave_delta > 0) {
+            AVPacket *first = &il->streams[il->heap[0]].first->pkt;
+            if (first->dts != AV_NOPTS_VALUE &&
+                il->max_dts - av_rescale_q(first->dts, s->streams[first->stream_index]->time_base,
+                                           AV_TIME_BASE_Q) > s->max_interleave_delta) {
+                av_log(s, AV_LOG_DEBUG, "max_interleave_delta reached, writing stream %d early\n",
+                       first->stream_index);
+                output = 1;
+            }
+        }
+        if (output) {
+            interleave_get_packet(s, out);
+            return 1;
+        }
+    }
+    av_init_packet(out);
+    return 0;
+}
+
 /**
  * Interleaves an AVPacket correctly so it can be muxed.
  * @param out the interleaved packet will be output here
@@ -2831,6 +3126,8 @@ fail:
     for(i=0;i<s->nb_streams;i++)
         av_freep(&s->streams[i]->priv_data);
     av_freep(&s->priv_data);
+    interleave_free(s);
+    ff_packet_pool_close(s);
     return ret;
 }
 
@@ -2862,6 +3159,159 @@ void av_program_add_stream_index(AVFormatContext *ac, int progid, unsigned int i
     }
 }
 
+static AVProgram *find_program(AVFormatContext *s, int id)
+{
+    int i;
+
+    for (i = 0; i < s->nb_programs; i++)
+        if (s->programs[i]->id == id)
+            return s->programs[i];
+    return NULL;
+}
+
+/**
+ * Discard the programs which no queue is attached to, so that the
+ * demuxer can skip their data.
+ */
+static void update_program_discard(AVFormatContext *s)
+{
+    AVProgramQueue *q;
+    int i;
+
+    for (i = 0; i < s->nb_programs; i++) {
+        AVProgram *program = s->programs[i];
+        program->discard = AVDISCARD_ALL;
+        for (q = s->program_queues; q; q = q->next) {
+            if (q->program_id == program->id) {
+                program->discard = AVDISCARD_DEFAULT;
+                break;
+            }
+        }
+    }
+}
+
+AVProgramQueue *av_program_queue_attach(AVFormatContext *s, int program_id)
+{
+    AVProgramQueue *q, **qp;
+
+    if (!find_program(s, program_id)) {
+        av_log(s, AV_LOG_ERROR, "program %d not found\n", program_id);
+        return NULL;
+    }
+    q = av_mallocz(sizeof(AVProgramQueue));
+    if (!q)
+        return NULL;
+    q->s = s;
+    q->program_id = program_id;
+
+    for (qp = &s->program_queues; *qp; qp = &(*qp)->next);
+    *qp = q;
+    update_program_discard(s);
+    return q;
+}
+
+void av_program_queue_detach(AVProgramQueue *q)
+{
+    AVFormatContext *s = q->s;
+    AVProgramQueue **qp;
+
+    for (qp = &s->program_queues; *qp; qp = &(*qp)->next) {
+        if (*qp == q) {
+            *qp = q->next;
+            break;
+        }
+    }
+    program_queue_flush(q);
+    av_free(q);
+    update_program_discard(s);
+}
+
+static int program_has_stream(AVProgram *program, unsigned int idx)
+{
+    int i;
+
+    for (i = 0; i < program->nb_stream_indexes; i++)
+        if (program->stream_index[i] == idx)
+            return 1;
+    return 0;
+}
+
+/**
+ * Append a packet to all the queues of the programs containing its stream.
+ * The consumers free their packets from different threads, so the first
+ * queue takes the packet and the others get their own copy of the payload.
+ */
+static int program_queue_dispatch(AVFormatContext *s, AVPacket *pkt)
+{
+    AVProgramQueue *q;
+    AVPacketList *pktl;
+    AVProgram *program;
+    AVPacket *src = NULL; /* queued packet the other queues copy */
+    int ret = 0;
+
+    for (q = s->program_queues; q; q = q->next) {
+        program = find_program(s, q->program_id);
+        if (!program || !program_has_stream(program, pkt->stream_index))
+            continue;
+
+        pktl = ff_packet_pool_get_node(s);
+        if (!pktl) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        if (src) {
+            pktl->pkt = *src;
+            pktl->pkt.destruct = NULL;
+        } else
+            pktl->pkt = *pkt;
+        if ((ret = av_dup_packet(&pktl->pkt)) < 0) {
+            ff_packet_pool_put_node(s, pktl);
+            break;
+        }
+        if (!src)
+            src = &pktl->pkt;
+
+        if (q->last)
+            q->last->next = pktl;
+        else
+            q->first = pktl;
+        q->last = pktl;
+        q->size += pkt->size;
+    }
+    if (!src)
+        av_free_packet(pkt);
+    return ret;
+}
+
+int av_program_queue_read(AVProgramQueue *q, AVPacket *pkt)
+{
+    AVProgramQueue *q1;
+    AVPacketList *pktl;
+    AVPacket pkt1;
+    int ret;
+
+    while (!q->first) {
+        /* wait for the consumers which lag behind rather than dropping
+           the packets of their programs */
+        for (q1 = q->s->program_queues; q1; q1 = q1->next)
+            if (q1->size >= PROGRAM_QUEUE_MAX_SIZE)
+                return AVERROR(EAGAIN);
+        if ((ret = av_read_frame(q->s, &pkt1)) < 0)
+            return ret;
+        if ((ret = program_queue_dispatch(q->s, &pkt1)) < 0)
+            return ret;
+    }
+
+    pktl = q->first;
+    *pkt = pktl->pkt;
+    q->size -= pkt->size;
+    q->first = pktl->next;
+    if (!q->first)
+        q->last = NULL;
+    ff_packet_pool_put_node(q->s, pktl);
+    return 0;
+}
+
 static void print_fps(double d, const char *postfix){
     uint64_t v= lrintf(d*100);
     if     (v% 100      ) av_log(NULL, AV_LOG_INFO, ", %3.2f %s", d, postfix);
@@ -0,0 +1,185 @@
+/*
+ * named performance counters
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#include "log.h"
+#include "mem.h"
+#include "perf.h"
+
+typedef struct PerfThread {
+    uint64_t count[AV_PERF_MAX_COUNTERS];
+    uint64_t sum  [AV_PERF_MAX_COUNTERS];
+    struct PerfThread *next;
+} PerfThread;
+
+static int enabled;
+static const char *names[AV_PERF_MAX_COUNTERS];
+static int nb_counters;
+
+/* counts of exited threads */
+static PerfThread retired;
+
+#if HAVE_PTHREADS
+static pthread_mutex_t perf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static PerfThread *threads;
+
+static void retire_thread(void *arg)
+{
+    PerfThread *pt = arg, **p;
+    int i;
+
+    pthread_mutex_lock(&perf_mutex);
+    for (i = 0; i < AV_PERF_MAX_COUNTERS; i++) {
+        retired.count[i] += pt->count[i];
+        retired.sum  [i] += pt->sum  [i];
+    }
+    for (p = &threads; *p != pt; p = &(*p)->next);
+    *p = pt->next;
+    pthread_mutex_unlock(&perf_mutex);
+    av_free(pt);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&thread_key, retire_thread);
+}
+
+static PerfThread *get_thread(void)
+{
+    PerfThread *pt;
+
+    pthread_once(&key_once, create_key);
+    if ((pt = pthread_getspecific(thread_key)))
+        return pt;
+    if (!(pt = av_mallocz(sizeof(PerfThread))))
+        return NULL;
+    pthread_setspecific(thread_key, pt);
+    pthread_mutex_lock(&perf_mutex);
+    pt->next = threads;
+    threads = pt;
+    pthread_mutex_unlock(&perf_mutex);
+    return pt;
+}
+
+#define perf_lock()   pthread_mutex_lock(&perf_mutex)
+#define perf_unlock() pthread_mutex_unlock(&perf_mutex)
+#else
+static PerfThread *threads;
+
+static PerfThread *get_thread(void)
+{
+    return &retired;
+}
+
+#define perf_lock()
+#define perf_unlock()
+#endif
+
+void av_perf_enable(int enable)
+{
+    enabled = enable;
+}
+
+int av_perf_enabled(void)
+{
+    return enabled;
+}
+
+int av_perf_register(const char *name)
+{
+    int i;
+
+    perf_lock();
+    for (i = 0; i < nb_counters; i++)
+        if (!strcmp(names[i], name))
+            break;
+    if (i == nb_counters) {
+        if (nb_counters < AV_PERF_MAX_COUNTERS)
+            names[nb_counters++] = name;
+        else
+            i = -1;
+    }
+    perf_unlock();
+    return i;
+}
+
+void av_perf_add(int index, uint64_t value)
+{
+    PerfThread *pt;
+
+    if ((unsigned)index >= AV_PERF_MAX_COUNTERS || !(pt = get_thread()))
+        return;
+    pt->count[index]++;
+    pt->sum  [index] += value;
+}
+
+int av_perf_get(int index, const char **name, uint64_t *count, uint64_t *sum)
+{
+    PerfThread *pt;
+    uint64_t c, s;
+
+    if (index < 0 || index >= nb_counters)
+        return -1;
+    perf_lock();
+    c = retired.count[index];
+    s = retired.sum  [index];
+    for (pt = threads; pt; pt = pt->next) {
+        c += pt->count[index];
+        s += pt->sum  [index];
+    }
+    perf_unlock();
+    if (name)  *name  = names[index];
+    if (count) *count = c;
+    if (sum)   *sum   = s;
+    return 0;
+}
+
+void av_perf_reset(void)
+{
+    PerfThread *pt;
+
+    perf_lock();
+    memset(retired.count, 0, sizeof(retired.count));
+    memset(retired.sum,   0, sizeof(retired.sum));
+    for (pt = threads; pt; pt = pt->next) {
+        memset(pt->count, 0, sizeof(pt->count));
+        memset(pt->sum,   0, sizeof(pt->sum));
+    }
+    perf_unlock();
+}
+
+void av_perf_dump(void *avcl, int level)
+{
+    const char *name;
+    uint64_t count, sum;
+    int i;
+
+    for (i = 0; av_perf_get(i, &name, &count, &sum) >= 0; i++)
+        if (count)
+            av_log(avcl, level, "%-24s %10"PRIu64" runs %14"PRIu64" total %10"PRIu64" per run\n",
+                   name, count, sum, sum / count);
+}
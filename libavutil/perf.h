@@ -0,0 +1,94 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavutil/perf.h
+ * named performance counters
+ *
+ * Counters are registered by name and accumulate a number of events and
+ * a sum, for timers the number of CPU cycles spent. Each thread adds to
+ * its own copy, the copies are only summed when the counters are read.
+ * Nothing is accumulated until the counters are enabled with
+ * av_perf_enable().
+ */
+
+#ifndef AVUTIL_PERF_H
+#define AVUTIL_PERF_H
+
+#include <stdint.h>
+
+/**
+ * maximum number of distinct counters
+ */
+#define AV_PERF_MAX_COUNTERS 64
+
+/**
+ * Enables or disables the accumulation of all counters.
+ */
+void av_perf_enable(int enable);
+
+/**
+ * @return nonzero if the counters are enabled
+ */
+int av_perf_enabled(void);
+
+/**
+ * Registers a counter. Registering a name again returns the same counter.
+ *
+ * @param name name of the counter, must remain valid for the lifetime of
+ *             the process, usually a string literal
+ * @return index of the counter or a negative value if all
+ *         AV_PERF_MAX_COUNTERS counters are in use
+ */
+int av_perf_register(const char *name);
+
+/**
+ * Adds one event and value to the counter of the calling thread.
+ *
+ * @param index index returned by av_perf_register()
+ */
+void av_perf_add(int index, uint64_t value);
+
+/**
+ * Gets the totals of a counter over all threads.
+ *
+ * @param index index of the counter, from 0 to the number of registered
+ *              counters - 1
+ * @param name  if not NULL, set to the name of the counter
+ * @param count if not NULL, set to the number of events
+ * @param sum   if not NULL, set to the sum of the values
+ * @return 0 on success, a negative value if no such counter is registered
+ */
+int av_perf_get(int index, const char **name, uint64_t *count, uint64_t *sum);
+
+/**
+ * Resets all counters to zero. No other thread may add to them meanwhile.
+ */
+void av_perf_reset(void);
+
+/**
+ * Logs all counters that have counted events, with the mean value per
+ * event.
+ *
+ * @param avcl  a pointer to an arbitrary struct whose first field is a
+ *              pointer to an AVClass struct, passed to av_log()
+ * @param level log level
+ */
+void av_perf_dump(void *avcl, int level);
+
+#endif /* AVUTIL_PERF_H */
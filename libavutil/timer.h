@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include "config.h"
+#include "perf.h"
 
 #if   ARCH_ARM
 #   include "arm/timer.h"
@@ -63,9 +64,29 @@ tend= AV_READ_TIME();\
                tsum*10/tcount, id, tcount, tskip_count);\
     }\
 }
+
+/**
+ * Counts the cycles spent between AV_PERF_START(id) and AV_PERF_STOP(id)
+ * in the av_perf_register() counter named id, if the counters are
+ * enabled. Unlike START_TIMER, these may stay in production code.
+ */
+#define AV_PERF_START(id) \
+    static int id##_perf = -1;\
+    uint64_t id##_perf_start = 0;\
+    if (av_perf_enabled()) {\
+        if (id##_perf < 0)\
+            id##_perf = av_perf_register(#id);\
+        id##_perf_start = AV_READ_TIME();\
+    }
+
+#define AV_PERF_STOP(id) \
+    if (id##_perf_start)\
+        av_perf_add(id##_perf, AV_READ_TIME() - id##_perf_start);
 #else
 #define START_TIMER
 #define STOP_TIMER(id) {}
+#define AV_PERF_START(id)
+#define AV_PERF_STOP(id)
 #endif
 
 #endif /* AVUTIL_TIMER_H */
@@ -87,6 +87,8 @@ fi
 
 if [ -n "$do_mov" ] ; then
 do_lavf mov "-acodec pcm_alaw"
+do_lavf mov_frag "-acodec pcm_alaw -f mov -fflags fragment"
+do_lavf mov_faststart "-acodec pcm_alaw -f mov -fflags faststart"
 fi
 
 if [ -n "$do_dv_fmt" ] ; then